@@ -0,0 +1,61 @@
+// compiles and runs a generated library of the given number of lines, of
+// which the script only calls a few functions, once compiling every body up
+// front and once compiling the bodies on their first call
+#include <cpplox/vm.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <string>
+
+namespace {
+
+// every function is ten lines long
+std::string generateScript(size_t lines) {
+	std::string source;
+	size_t functions = lines / 10;
+	for (size_t i = 0; i < functions; ++i) {
+		source += std::format("fun f{}(a, b) {{\n"
+		                      "\tvar total = 0;\n"
+		                      "\tfor (var i = 0; i < a; i = i + 1) {{\n"
+		                      "\t\tif (i < b) {{\n"
+		                      "\t\t\ttotal = total + i * {};\n"
+		                      "\t\t}} else {{\n"
+		                      "\t\t\ttotal = total - 1;\n"
+		                      "\t\t}}\n"
+		                      "\t}}\n"
+		                      "\treturn total;\n}}\n",
+		                      i, i % 7);
+	}
+	source += std::format("print f0(10, 5) + f{}(10, 5) + f{}(10, 5);\n",
+	                      functions / 2, functions - 1);
+	return source;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+	                                     start)
+	    .count();
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+	size_t lines = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 50000;
+	std::string source = generateScript(lines);
+
+	for (bool lazy : {false, true}) {
+		auto start = std::chrono::steady_clock::now();
+		lox::VM vm;
+		vm.lazy = lazy;
+		if (vm.interpret(source) != lox::InterpretResult::OK) {
+			return 70;
+		}
+		std::cout << std::format("{}: {:.3f} s for {} lines\n",
+		                         lazy ? "lazy" : "eager", secondsSince(start),
+		                         lines);
+	}
+	return 0;
+}
@@ -0,0 +1,106 @@
+// runs allocation heavy scripts on VMs allocating from the global heap, from
+// a lox::PoolResource and from a lox::ArenaResource, reporting the run time
+// and the memory the resource took for each
+#include <cpplox/memory.hpp>
+#include <cpplox/vm.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace {
+
+struct Workload {
+	std::string_view name;
+	// the script, run after a global `iterations` is defined
+	std::string_view source;
+};
+
+constexpr std::array workloads{
+    Workload{"trees", "class Tree {\n"
+                      "\tinit(left, right) {\n"
+                      "\t\tthis.left = left;\n"
+                      "\t\tthis.right = right;\n"
+                      "\t}\n"
+                      "}\n"
+                      "fun make(depth) {\n"
+                      "\tif (depth == 0) return Tree(nil, nil);\n"
+                      "\treturn Tree(make(depth - 1), make(depth - 1));\n"
+                      "}\n"
+                      "for (var i = 0; i < iterations; i = i + 1) {\n"
+                      "\tmake(10);\n"
+                      "}\n"},
+    Workload{"closures", "fun adder(n) {\n"
+                         "\tfun add(x) {\n"
+                         "\t\treturn x + n;\n"
+                         "\t}\n"
+                         "\treturn add;\n"
+                         "}\n"
+                         "var total = 0;\n"
+                         "for (var i = 0; i < iterations * 1000; i = i + 1) {\n"
+                         "\ttotal = adder(i)(1) + total;\n"
+                         "}\n"},
+    Workload{"strings", "var total = 0;\n"
+                        "for (var i = 0; i < iterations * 1000; i = i + 1) {\n"
+                        "\tvar line = \"the quick brown fox \" + \"jumps "
+                        "over the lazy dog\";\n"
+                        "\tline = line + line;\n"
+                        "\ttotal = total + 1;\n"
+                        "}\n"},
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+	                                     start)
+	    .count();
+}
+
+// seconds the script takes on a VM allocating from the resource, nullopt
+// when it fails
+std::optional<double> run(const std::string &source,
+                          std::pmr::memory_resource *resource) {
+	auto start = std::chrono::steady_clock::now();
+	{
+		lox::VM vm{resource};
+		if (vm.interpret(source) != lox::InterpretResult::OK) {
+			return std::nullopt;
+		}
+	}
+	return secondsSince(start);
+}
+
+double megabytes(size_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+	size_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200;
+
+	for (const auto &workload : workloads) {
+		std::string source =
+		    std::format("var iterations = {};\n{}", iterations, workload.source);
+
+		auto global_time = run(source, std::pmr::new_delete_resource());
+		lox::PoolResource pool;
+		auto pool_time = run(source, &pool);
+		lox::ArenaResource arena;
+		auto arena_time = run(source, &arena);
+		if (!global_time || !pool_time || !arena_time) {
+			return 70;
+		}
+		std::cout << std::format(
+		    "{}: malloc {:.3f} s, pool {:.3f} s ({:.1f} MB), arena {:.3f} s "
+		    "({:.1f} MB)\n",
+		    workload.name, *global_time, *pool_time,
+		    megabytes(pool.bytesReserved()), *arena_time,
+		    megabytes(arena.bytesReserved()));
+	}
+	return 0;
+}
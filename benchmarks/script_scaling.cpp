@@ -0,0 +1,74 @@
+// compiles and runs a generated script of the given size in megabytes, the
+// script is a single chunk of rules like the ones of a generated rule engine
+// so it needs wide constant indices and jumps over megabytes of code
+#include <cpplox/compiler.hpp>
+#include <cpplox/vm.hpp>
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <string>
+
+namespace {
+
+std::string generateScript(size_t bytes) {
+	std::string source = "var total = 0;\nvar x = 42;\nif (x > 0) {\n";
+	for (size_t rule = 0; source.size() < bytes; ++rule) {
+		source += std::format(
+		    "\tif (x < {0}) {{ total = total + {0}.5; }} else {{ total = total "
+		    "- 0.5; }}\n",
+		    rule % 100);
+	}
+	source += "}\nprint total;\n";
+	return source;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+	                                     start)
+	    .count();
+}
+
+// peak resident set size of the process in megabytes
+double peakMemory() {
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+	size_t megabytes = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1;
+	std::string source = generateScript(megabytes * 1024 * 1024);
+
+	lox::VM vm;
+	auto start = std::chrono::steady_clock::now();
+	lox::Compiler compiler;
+	compiler.heap = &vm.heap;
+	auto script = compiler.compile(source);
+	if (!script) {
+		std::cerr << script.error() << '\n';
+		return 65;
+	}
+	double compileTime = secondsSince(start);
+	double compileMemory = peakMemory();
+
+	start = std::chrono::steady_clock::now();
+	if (vm.interpret(script->get()) != lox::InterpretResult::OK) {
+		return 70;
+	}
+	double runTime = secondsSince(start);
+
+	std::cout << std::format("script: {} MB ({} bytes)\n", megabytes,
+	                         source.size());
+	std::cout << std::format("compile: {:.3f} s, peak memory {:.1f} MB\n",
+	                         compileTime, compileMemory);
+	std::cout << std::format("run: {:.3f} s, peak memory {:.1f} MB\n", runTime,
+	                         peakMemory());
+	return 0;
+}
@@ -1,9 +1,34 @@
 #pragma once
 
+#include <cpplox/compiler.hpp>
+
+#include <string>
 #include <string_view>
 
 namespace lox::cli {
+// how runFile runs the script
+struct RunOptions {
+	// compile hot functions to machine code
+	bool jit = false;
+	// the bytecode the script is compiled to and run as
+	Backend backend = Backend::STACK;
+	// compile function bodies on their first call
+	bool lazy = false;
+	// print the collections of the garbage collector once the script ends
+	bool gc_stats = false;
+	// profile the code is specialised with and the file the profile of this
+	// run is written to, unused when empty
+	std::string profile_in;
+	std::string profile_out;
+};
+
 void repl();
-int runFile(std::string_view path);
-int compileFile(std::string_view path);
+int runFile(std::string_view path, const RunOptions &options = {});
+int compileFile(std::string_view path, const RunOptions &options = {});
+// compiles every function of the file, reporting the errors a lazy run
+// would only find once the function is called
+int checkFile(std::string_view path);
+int countOpCodePairs(std::string_view path);
+int countInstructions(std::string_view path, const RunOptions &options = {});
+int emitCpp(std::string_view path);
 } // namespace lox::cli
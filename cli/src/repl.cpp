@@ -1,14 +1,19 @@
 #include <repl.hpp>
 
+#include <cpplox/aot.hpp>
 #include <cpplox/compiler.hpp>
 #include <cpplox/debug.hpp>
+#include <cpplox/jit.hpp>
+#include <cpplox/profile.hpp>
 #include <cpplox/vm.hpp>
 
+#include <chrono>
 #include <cstddef>
 #include <filesystem>
 #include <format>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <ranges>
 #include <string>
 #include <string_view>
@@ -33,6 +38,11 @@ std::string_view trim(std::string_view sv) {
 
 void repl() {
 	VM vm;
+	debug::TraceHooks tracer;
+	auto updateTracer = [&] {
+		bool tracing = tracer.trace_instruction || tracer.trace_stack;
+		vm.setHooks(tracing ? &tracer : nullptr);
+	};
 	bool interpret = true;
 	std::string line;
 	std::cout << "Lox REPL\n";
@@ -52,14 +62,16 @@ void repl() {
 				} else if (line == "#clear") {
 					std::cout << "\033[2J\033[1;1H";
 				} else if (line == "#debug_trace") {
-					vm.debug_trace_instruction = !vm.debug_trace_instruction;
+					tracer.trace_instruction = !tracer.trace_instruction;
+					updateTracer();
 					std::cout << std::format(
 					    "Debug trace is {}\n",
-					    vm.debug_trace_instruction ? "on" : "off");
+					    tracer.trace_instruction ? "on" : "off");
 				} else if (line == "#debug_stack") {
-					vm.debug_trace_stack = !vm.debug_trace_stack;
+					tracer.trace_stack = !tracer.trace_stack;
+					updateTracer();
 					std::cout << std::format("Debug stack is {}\n",
-					                         vm.debug_trace_stack ? "on" : "off");
+					                         tracer.trace_stack ? "on" : "off");
 
 				} else if (line == "#interpret") {
 					interpret = !interpret;
@@ -88,64 +100,170 @@ void repl() {
 	}
 }
 
-int runFile(std::string_view path) {
+std::optional<std::string> readSource(std::string_view path) {
 	// check if the file exists
 	if (!std::filesystem::exists(path)) {
 		std::cerr << std::format("File '{}' does not exist\n", path);
-		return 1;
+		return std::nullopt;
 	}
 	std::ifstream file(path.data());
 	if (!file.is_open()) {
 		std::cerr << std::format("Could not open file '{}'\n", path);
+		return std::nullopt;
+	}
+	size_t size = std::filesystem::file_size(path);
+	std::string source;
+	source.reserve(size);
+	std::copy(std::istreambuf_iterator<char>(file),
+	          std::istreambuf_iterator<char>(), std::back_inserter(source));
+	return source;
+}
+
+int runFile(std::string_view path, const RunOptions &options) {
+	auto source = readSource(path);
+	if (!source) {
 		return 1;
 	}
-	{
-		size_t size = std::filesystem::file_size(path);
-		std::string source;
-		source.reserve(size);
-		std::copy(std::istreambuf_iterator<char>(file),
-		          std::istreambuf_iterator<char>(), std::back_inserter(source));
-		VM vm;
-		InterpretResult result = vm.interpret(source);
-		if (result == InterpretResult::COMPILE_ERROR) {
-			return 65;
+	VM vm;
+	if (options.jit) {
+		if (!jit::supported) {
+			std::cerr << "The JIT is not available in this build, running "
+			             "the interpreter\n";
 		}
-		if (result == InterpretResult::RUNTIME_ERROR) {
-			return 70;
+		vm.jit_threshold = jit::default_threshold;
+	}
+	vm.backend = options.backend;
+	vm.lazy = options.lazy;
+	// a missing or stale profile only costs the warm up it would save
+	profile::Profile profile;
+	if (!options.profile_in.empty()) {
+		std::ifstream in(options.profile_in);
+		auto read = in ? profile::Profile::read(in)
+		               : std::unexpected(std::string("could not open it"));
+		if (read.has_value()) {
+			profile = std::move(*read);
+			vm.profile = &profile;
+		} else {
+			std::cerr << std::format("Ignoring profile '{}': {}\n",
+			                         options.profile_in, read.error());
+		}
+	}
+	profile::Recorder recorder;
+	if (!options.profile_out.empty()) {
+		vm.setHooks(&recorder);
+	}
+	InterpretResult result = vm.interpret(*source);
+	if (result == InterpretResult::COMPILE_ERROR) {
+		return 65;
+	}
+	if (options.gc_stats) {
+		const auto &stats = vm.heap.stats();
+		std::cerr << std::format(
+		    "gc: {} collections, {} objects allocated, {} freed, {} of {} "
+		    "bytes freed, pauses {:.3f} ms total, {:.3f} ms max\n",
+		    stats.collections, stats.objects_allocated, stats.objects_freed,
+		    stats.bytes_freed, stats.bytes_allocated,
+		    std::chrono::duration<double, std::milli>(stats.total_pause)
+		        .count(),
+		    std::chrono::duration<double, std::milli>(stats.max_pause)
+		        .count());
+	}
+	if (!options.profile_out.empty()) {
+		std::ofstream out(options.profile_out);
+		recorder.profile().write(out);
+		if (!out) {
+			std::cerr << std::format("Could not write profile '{}'\n",
+			                         options.profile_out);
 		}
 	}
+	if (result == InterpretResult::RUNTIME_ERROR) {
+		return 70;
+	}
 
 	return 0;
 }
 
-int compileFile(std::string_view path) {
-	// check if the file exists
-	if (!std::filesystem::exists(path)) {
-		std::cerr << std::format("File '{}' does not exist\n", path);
+int compileFile(std::string_view path, const RunOptions &options) {
+	auto source = readSource(path);
+	if (!source) {
 		return 1;
 	}
-	std::ifstream file(path.data());
-	if (!file.is_open()) {
-		std::cerr << std::format("Could not open file '{}'\n", path);
+	Compiler compiler;
+	compiler.backend = options.backend;
+	auto script = compiler.compile(*source);
+	if (!script) {
+		std::cerr << script.error() << '\n';
+		return 65;
+	} else {
+		auto &chunk = *script->get().chunk.get();
+		debug::ChunkDisassembly(chunk, path);
+		if (chunk.registers() != nullptr) {
+			debug::RegChunkDisassembly(chunk, path);
+		}
+	}
+
+	return 0;
+}
+
+int checkFile(std::string_view path) {
+	auto source = readSource(path);
+	if (!source) {
 		return 1;
 	}
-	{
-		size_t size = std::filesystem::file_size(path);
-		std::string source;
-		source.reserve(size);
-		std::copy(std::istreambuf_iterator<char>(file),
-		          std::istreambuf_iterator<char>(), std::back_inserter(source));
-		Compiler compiler;
-		auto script = compiler.compile(source);
-		if (!script) {
-			std::cerr << script.error() << '\n';
-			return 65;
-		} else {
-			auto &chunk = *script->get().chunk.get();
-			debug::ChunkDisassembly(chunk, path);
-		}
+	Compiler compiler;
+	auto script = compiler.compile(*source);
+	if (!script) {
+		std::cerr << script.error() << '\n';
+		return 65;
+	}
+	return 0;
+}
+
+int countOpCodePairs(std::string_view path) {
+	auto source = readSource(path);
+	if (!source) {
+		return 1;
+	}
+	VM vm;
+	debug::OpCodePairHooks counter;
+	vm.setHooks(&counter);
+	InterpretResult result = vm.interpret(*source);
+	if (result == InterpretResult::COMPILE_ERROR) {
+		return 65;
 	}
+	counter.report(std::cout);
+	return result == InterpretResult::RUNTIME_ERROR ? 70 : 0;
+}
 
+int countInstructions(std::string_view path, const RunOptions &options) {
+	auto source = readSource(path);
+	if (!source) {
+		return 1;
+	}
+	VM vm;
+	vm.backend = options.backend;
+	debug::InstructionCountHooks counter;
+	vm.setHooks(&counter);
+	InterpretResult result = vm.interpret(*source);
+	if (result == InterpretResult::COMPILE_ERROR) {
+		return 65;
+	}
+	std::cout << std::format("Executed instructions: {}\n", counter.executed);
+	return result == InterpretResult::RUNTIME_ERROR ? 70 : 0;
+}
+
+int emitCpp(std::string_view path) {
+	auto source = readSource(path);
+	if (!source) {
+		return 1;
+	}
+	Compiler compiler;
+	auto script = compiler.compile(*source);
+	if (!script) {
+		std::cerr << script.error() << '\n';
+		return 65;
+	}
+	aot::emit(script->get(), *source, std::cout);
 	return 0;
 }
 
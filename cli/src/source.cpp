@@ -7,19 +7,91 @@
 #include <format>
 #include <iostream>
 
+namespace {
+enum class Mode {
+	RUN,
+	COMPILE,
+	CHECK,
+	OPCODE_PAIRS,
+	COUNT_INSTRUCTIONS,
+	EMIT_CPP
+};
+
+[[noreturn]] void usage(const char *program) {
+	std::cerr << std::format(
+	    "Usage: {} [-c | --check | --opcode-pairs | --count-instructions | "
+	    "--emit-cpp] [--jit] [--lazy] [--gc-stats] [--backend=stack|reg] "
+	    "[--profile-in=file] [--profile-out=file] [path]\n",
+	    program);
+	exit(64);
+}
+} // namespace
+
 int main(int argc, char *argv[]) {
 	if (argc == 1) {
 		lox::cli::repl();
-	} else if (argc == 2) {
-		return lox::cli::runFile(argv[1]);
-	} else {
-		// if the first argument is "-c" then only compile the file and print
-		// the bytecode
-		if (argc == 3 && std::string_view(argv[1]) == "-c") {
-			return lox::cli::compileFile(argv[2]);
+		return 0;
+	}
+	Mode mode = Mode::RUN;
+	lox::cli::RunOptions options;
+	int index = 1;
+	for (; index < argc - 1; ++index) {
+		std::string_view option = argv[index];
+		if (option == "-c") {
+			// only compile the file and print the bytecode
+			mode = Mode::COMPILE;
+		} else if (option == "--check") {
+			// only compile the file, reporting errors in every function
+			mode = Mode::CHECK;
+		} else if (option == "--opcode-pairs") {
+			// run the file and report the executed opcode pairs
+			mode = Mode::OPCODE_PAIRS;
+		} else if (option == "--count-instructions") {
+			// run the file and report how many instructions were executed
+			mode = Mode::COUNT_INSTRUCTIONS;
+		} else if (option == "--emit-cpp") {
+			// print the file translated to a C++ program
+			mode = Mode::EMIT_CPP;
+		} else if (option == "--jit") {
+			// run the file compiling hot functions to machine code
+			options.jit = true;
+		} else if (option == "--lazy") {
+			// compile function bodies on their first call
+			options.lazy = true;
+		} else if (option == "--gc-stats") {
+			// report the garbage collections of the run
+			options.gc_stats = true;
+		} else if (option == "--backend=reg") {
+			// compile to and run register instructions
+			options.backend = lox::Backend::REGISTER;
+		} else if (option == "--backend=stack") {
+			options.backend = lox::Backend::STACK;
+		} else if (option.starts_with("--profile-in=")) {
+			// specialise the code with the profile of an earlier run
+			options.profile_in = option.substr(option.find('=') + 1);
+		} else if (option.starts_with("--profile-out=")) {
+			// record a profile of the run
+			options.profile_out = option.substr(option.find('=') + 1);
 		} else {
-			std::cerr << std::format("Usage: {} [path]\n", argv[0]);
-			exit(64);
+			usage(argv[0]);
 		}
 	}
+	std::string_view path = argv[index];
+	if (path.starts_with("-")) {
+		usage(argv[0]);
+	}
+	switch (mode) {
+	case Mode::RUN:
+		return lox::cli::runFile(path, options);
+	case Mode::COMPILE:
+		return lox::cli::compileFile(path, options);
+	case Mode::CHECK:
+		return lox::cli::checkFile(path);
+	case Mode::OPCODE_PAIRS:
+		return lox::cli::countOpCodePairs(path);
+	case Mode::COUNT_INSTRUCTIONS:
+		return lox::cli::countInstructions(path, options);
+	case Mode::EMIT_CPP:
+		return lox::cli::emitCpp(path);
+	}
 }
@@ -0,0 +1,47 @@
+#pragma once
+#include <cpplox/arithmetic.hpp>
+#include <cpplox/chunk.hpp>
+#include <cpplox/jit.hpp>
+#include <cpplox/obj.hpp>
+#include <cpplox/value.hpp>
+
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string_view>
+
+// ahead of time compilation, lox --emit-cpp translates a script to a C++
+// translation unit that links against cpplox. the unit keeps the script, its
+// runtime objects are made by compiling it when the executable starts, and
+// one C++ function per lox function takes the place of the JIT machine code
+namespace lox::aot {
+
+// the chunk a generated function runs on, filled in when the executable
+// starts so the function reads the global slots and constants of the VM
+struct Binding {
+	const Instruction *code = nullptr;
+	const Value *constants = nullptr;
+};
+
+// a generated function with the key of the code it was generated from, see
+// profile::keyOf. code that compiles differently in the executable finds no
+// function and is interpreted
+struct Function {
+	std::string_view name;
+	uint64_t hash;
+	Binding *binding;
+	jit::Code::Function run;
+	// instructions the function can start from
+	std::span<const uint32_t> entries;
+};
+
+// writes the translation unit of the script, functions the verifier rejects
+// and very long ones are left to the interpreter
+void emit(const ObjFunction &script, std::string_view source,
+          std::ostream &out);
+
+// the main of the generated executables, compiles the source, gives every
+// chunk its generated function and runs it with the exit codes of lox
+int run(std::string_view source, std::span<const Function> functions);
+
+} // namespace lox::aot
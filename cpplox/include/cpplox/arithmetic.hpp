@@ -0,0 +1,61 @@
+#pragma once
+#include <cpplox/value.hpp>
+
+#include <cmath>
+#include <cstdint>
+
+namespace lox {
+
+// arithmetic on numbers, the integer overloads are exact and hand results
+// out of the integer range to Value::integer, which rounds them the way the
+// double arithmetic would
+struct Add {
+	Value operator()(int64_t a, int64_t b) const {
+		return Value::integer(a + b);
+	}
+	double operator()(double a, double b) const { return a + b; }
+};
+
+struct Subtract {
+	Value operator()(int64_t a, int64_t b) const {
+		return Value::integer(a - b);
+	}
+	double operator()(double a, double b) const { return a - b; }
+};
+
+struct Multiply {
+	Value operator()(int64_t a, int64_t b) const {
+		// small factors always give a product in the integer range
+		constexpr int64_t small = int64_t{1} << 24;
+		if (a > -small && a < small && b > -small && b < small &&
+		    (a * b != 0 || (a >= 0 && b >= 0))) [[likely]] {
+			return Value{a * b};
+		}
+		// the exact product may not fit 64 bits, but it is only needed when
+		// it is in the integer range. a zero product with a negative factor
+		// is -0, which only the double can represent
+		double product = static_cast<double>(a) * static_cast<double>(b);
+		if (product > Value::max_int || product < Value::min_int ||
+		    (product == 0 && std::signbit(product))) {
+			return Value{product};
+		}
+		return Value::integer(a * b);
+	}
+	double operator()(double a, double b) const { return a * b; }
+};
+
+// division always produces a double
+struct Divide {
+	double operator()(double a, double b) const { return a / b; }
+};
+
+// applies the operation to two numbers, on integers only when both are
+template <typename Operation>
+Value numberResult(const Value &a, const Value &b, Operation operation) {
+	if (a.isInt() && b.isInt()) {
+		return operation(a.asInt(), b.asInt());
+	}
+	return operation(a.asNumber(), b.asNumber());
+}
+
+} // namespace lox
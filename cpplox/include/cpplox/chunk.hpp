@@ -1,70 +1,169 @@
 #pragma once
+#include <cpplox/opcodes.hpp>
+#include <cpplox/regchunk.hpp>
 #include <cpplox/value.hpp>
 
+#include <array>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <span>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 namespace lox {
 
-enum class OpCode {
-	OP_CONSTANT,
-	OP_CONSTANT_LONG,
-	OP_NIL,
-	OP_TRUE,
-	OP_FALSE,
-	OP_POP,
-	OP_GET_LOCAL,
-	OP_GET_LOCAL_LONG,
-	OP_SET_LOCAL,
-	OP_SET_LOCAL_LONG,
-	OP_GET_GLOBAL,
-	OP_GET_GLOBAL_LONG,
-	OP_DEFINE_GLOBAL,
-	OP_DEFINE_GLOBAL_LONG,
-	OP_SET_GLOBAL_LONG,
-	OP_SET_GLOBAL,
-	OP_EQUAL,
-	OP_NOT_EQUAL,
-	OP_GREATER,
-	OP_GREATER_EQUAL,
-	OP_LESS,
-	OP_LESS_EQUAL,
-	OP_ADD,
-	OP_SUBTRACT,
-	OP_MULTIPLY,
-	OP_DIVIDE,
-	OP_NOT,
-	OP_NEGATE,
-	OP_PRINT,
-	OP_JUMP,
-	OP_JUMP_IF_FALSE,
-	OP_LOOP,
-	OP_CALL,
-	OP_CLOSURE,
-	OP_CLOSURE_LONG,
-	OP_RETURN,
+class Shape;
+struct ObjClass;
+struct LazyFunction;
+
+namespace jit {
+class Code;
+}
+
+// instruction with its operands already widened, the OP_WIDE prefix is folded
+// into the instruction it modifies and jumps hold the index of the target
+// instruction
+struct Instruction {
+	OpCode op;
+	uint32_t operand = 0;
+	// second operand of OP_ADD_LOCALS and OP_INCREMENT_LOCAL, the slot of
+	// the global once the VM has loaded the code for the global instructions
+	uint32_t operand2 = 0;
+	// offset of the instruction in the bytecode, including its prefix, used
+	// for lines and tracing
+	uint32_t offset = 0;
+	// index of the inline cache of the property instructions
+	uint32_t cache = 0;
+};
+
+// inline cache of a property instruction, filled by the VM with the shapes
+// it has seen at the site and where the property was found for each
+struct PropertyCache {
+	struct Entry {
+		const Shape *shape = nullptr;
+		// slot of the field, unused when the property is a method
+		uint32_t slot = 0;
+		const ObjFunction *method = nullptr;
+		// shape of the instance once OP_SET_PROPERTY added the field, null
+		// when the field already existed
+		Shape *transition = nullptr;
+		// class of the shapes and the method, marked along with the chunk
+		// so another class can not reuse their addresses while the entry
+		// exists
+		Value owner;
+	};
+	// sites that see more shapes keep replacing their last entry
+	static constexpr size_t ways = 4;
+
+	// the entry of the shape, nullptr when the site has not seen it
+	const Entry *find(const Shape *shape) const {
+		for (size_t i = 0; i < count; ++i) {
+			if (entries[i].shape == shape) {
+				return &entries[i];
+			}
+		}
+		return nullptr;
+	}
+	const Entry *add(Entry entry);
+
+	std::array<Entry, ways> entries;
+	size_t count = 0;
+};
+
+// how a closure captures one of its upvalues when it is created
+struct Capture {
+	// slot of a local of the enclosing frame, or index of an upvalue of the
+	// enclosing closure
+	uint32_t index = 0;
+	bool isLocal = false;
+
+	bool operator==(const Capture &other) const = default;
 };
 
 class Chunk {
   public:
+	// the code, its lines, constants and decoded form are allocated from the
+	// resource
+	explicit Chunk(
+	    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
 	void write(std::byte byte, size_t line);
 	void writeConstant(const Value &value, size_t line);
+	// index of the constant. interned strings are added once, every name
+	// and literal with the same characters shares their constant
 	size_t addConstant(const Value &value);
+	// index of the capture, added the first time it is seen
+	size_t addCapture(Capture capture);
 	bool patchByte(size_t offset, std::byte byte);
+	// drops the bytecode and its lines but keeps the constants, used to
+	// rewrite the code in place
+	void clearCode();
 
 	std::span<const std::byte> code() const;
 	std::size_t getLine(std::size_t offset) const;
 	std::span<const Value> constants() const;
+	// upvalues of the closures made from this code, in the order the
+	// upvalue instructions index them
+	std::span<const Capture> captures() const;
+	// decoded form of code(), built on first use and shared between copies.
+	// the VM quickens it in place, a quickened instruction behaves like its
+	// generic form so the copies never observe the difference
+	std::span<Instruction> instructions() const;
+	// inline caches of the decoded property instructions, built and shared
+	// along with them
+	std::span<PropertyCache> caches() const;
+	// the caches built so far, empty until the code is decoded
+	std::span<const PropertyCache> builtCaches() const;
+	// deepest stack the code needs above the first argument slot, only
+	// known once the verifier has accepted the code
+	std::optional<size_t> maxStack() const;
+	void setMaxStack(size_t depth);
+	// machine code the JIT compiled from instructions(), nullptr until the
+	// code got hot. dropped along with the instructions
+	const jit::Code *native() const;
+	void setNative(std::shared_ptr<const jit::Code> code) const;
+	// register form of the code, made by the compiler for the register
+	// backend and nullptr otherwise. the VM resolves its globals in place
+	RegChunk *registers() const;
+	void setRegisters(std::shared_ptr<RegChunk> code);
+	// counts a call or a loop iteration, true once when the count reaches
+	// the threshold
+	bool countHot(uint32_t threshold) const;
+	// hotness an earlier run counted for the code, once it reaches the
+	// threshold the first count already reports the code hot
+	void warm(uint64_t hotness) const;
+	// body the lazy compiler skipped, nullptr once the chunk holds its code.
+	// the first call compiles it into the chunk, see Compiler::compileBody
+	const LazyFunction *lazy() const;
+	void setLazy(std::shared_ptr<const LazyFunction> body);
+	// true the first time the collection of the epoch reaches the code, so
+	// the functions sharing it mark its constants once, see Heap
+	bool mark(uint64_t epoch) const;
 
 	bool operator==(const Chunk &other) const;
 
   private:
-	std::vector<std::byte> m_code;
-	// RLE encoding of line numbers
-	std::vector<std::tuple<size_t, size_t>> m_lines;
-	std::vector<Value> m_constants;
+	std::pmr::vector<std::byte> m_code;
+	// RLE encoding of line numbers, each run holds its line and the offset
+	// of its first byte so lookups can binary search
+	std::pmr::vector<std::tuple<size_t, size_t>> m_lines;
+	std::pmr::vector<Value> m_constants;
+	// index of each string constant
+	std::pmr::unordered_map<const Obj *, size_t> m_strings;
+	std::pmr::vector<Capture> m_captures;
+	mutable std::shared_ptr<std::pmr::vector<Instruction>> m_instructions;
+	mutable std::shared_ptr<std::pmr::vector<PropertyCache>> m_caches;
+	mutable std::shared_ptr<const jit::Code> m_native;
+	std::shared_ptr<RegChunk> m_registers;
+	std::shared_ptr<const LazyFunction> m_lazy;
+	mutable uint32_t m_hotness = 0;
+	mutable uint64_t m_warmth = 0;
+	std::optional<size_t> m_max_stack;
+	mutable uint64_t m_marked = 0;
 };
 
 } // namespace lox
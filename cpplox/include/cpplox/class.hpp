@@ -0,0 +1,68 @@
+#pragma once
+#include <cpplox/obj.hpp>
+#include <cpplox/value.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace lox {
+
+// hashes std::string keys and the string_view names they are looked up by
+// alike, so finding a name does not copy it
+struct NameHash {
+	using is_transparent = void;
+	size_t operator()(std::string_view name) const {
+		return std::hash<std::string_view>{}(name);
+	}
+};
+template <typename T>
+using NameMap = std::unordered_map<std::string, T, NameHash, std::equal_to<>>;
+
+// layout of the fields of an instance. instances of a class that added the
+// same fields in the same order share their shape, so a property instruction
+// that has seen the shape before knows the slot without hashing the name
+class Shape {
+  public:
+	// slot of the field, nullopt when the instances do not have it
+	std::optional<uint32_t> find(std::string_view name) const;
+	// shape of the instances once they add the field, created on first use
+	// and owned by this shape
+	Shape *withField(std::string_view name);
+	size_t size() const;
+
+  private:
+	NameMap<uint32_t> m_slots;
+	NameMap<std::unique_ptr<Shape>> m_transitions;
+};
+
+struct ObjClass {
+	explicit ObjClass(std::string_view name);
+
+	// the method, nullptr when the class does not have it
+	const ObjFunction *findMethod(std::string_view name) const;
+	std::string toString() const;
+
+	std::string name;
+	// the methods of the superclass are copied in when the class inherits,
+	// so lookups never walk the hierarchy. the map never moves its values,
+	// frames and caches point into it
+	NameMap<ObjFunction> methods;
+	// init, looked up on every instantiation
+	const ObjFunction *initializer = nullptr;
+	// keeps the inherited methods reachable through super alive, nil
+	// without one
+	Value superclass;
+	// shape of the instances before they get any field, every shape of the
+	// instances of the class descends from it
+	Shape root;
+};
+
+} // namespace lox
@@ -1,6 +1,7 @@
 #pragma once
 #include <cpplox/chunk.hpp>
 #include <cpplox/compiler.hpp>
+#include <cpplox/heap.hpp>
 #include <cpplox/obj.hpp>
 #include <cpplox/scanner.hpp>
 
@@ -9,12 +10,41 @@
 #include <cstdint>
 #include <expected>
 #include <functional>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <vector>
 
 namespace lox {
-enum class FunctionType { TYPE_FUNCTION, TYPE_SCRIPT };
+namespace profile {
+class Profile;
+}
+
+enum class FunctionType {
+	TYPE_FUNCTION,
+	TYPE_INITIALIZER,
+	TYPE_METHOD,
+	TYPE_SCRIPT
+};
+// code the compiler makes for the VM to run, the stack code is always made
+// and the register backend translates it to register code as well
+enum class Backend { STACK, REGISTER };
+
+// function body the lazy compiler skipped, held by the chunk of the function
+// until its first call compiles it
+struct LazyFunction {
+	// the whole script, shared by every body skipped in it
+	std::shared_ptr<const std::string> source;
+	// offset of the '(' that starts the parameters, and its line
+	size_t offset = 0;
+	size_t line = 1;
+	FunctionType type = FunctionType::TYPE_FUNCTION;
+	Backend backend = Backend::STACK;
+	const profile::Profile *profile = nullptr;
+	// heap the constants of the body are allocated in
+	Heap *heap = nullptr;
+};
+
 class Compiler {
 
 	enum class Precedence {
@@ -58,6 +88,8 @@ class Compiler {
 		Token name;
 		int depth;
 		bool initialized = false;
+		// closed into an upvalue instead of popped when it goes out of scope
+		bool isCaptured = false;
 	};
 
 	struct CompilerScope {
@@ -65,6 +97,13 @@ class Compiler {
 		std::vector<Local> locals;
 	};
 
+	// class whose body is being compiled, shared by the compilers of its
+	// methods and of the functions nested in them
+	struct ClassScope {
+		ClassScope *enclosing = nullptr;
+		bool hasSuperclass = false;
+	};
+
 	Chunk &currentChunk();
 	void errorAt(Token token, std::string_view message);
 	void error(std::string_view message);
@@ -75,10 +114,14 @@ class Compiler {
 	bool match(Token::TokenType type);
 	void emmitByte(std::byte byte);
 	void emmitBytes(std::span<std::byte> bytes);
+	void emmitOperand(size_t value, size_t width);
 	void emmitLoop(size_t loopStart);
 	size_t emmitJump(OpCode opCode);
 	void emmitReturn();
-	std::vector<std::byte> makeConstant(const Value &value);
+	// emits the instruction with its index operand, widened when needed
+	void emmitIndexed(OpCode instruction, size_t index);
+	void emmitInvoke(OpCode instruction, size_t name, uint8_t argCount);
+	size_t makeConstant(const Value &value);
 	void emmitConstant(const Value &value);
 	void patchJump(size_t offset);
 	ObjFunction &endCompiler();
@@ -86,6 +129,9 @@ class Compiler {
 	void endScope();
 	void binary(bool canAssign);
 	void call(bool canAssign);
+	void dot(bool canAssign);
+	void this_(bool canAssign);
+	void super_(bool canAssign);
 	void literal(bool canAssign);
 	void grouping(bool canAssign);
 	void number(bool canAssign);
@@ -95,8 +141,19 @@ class Compiler {
 	void unary(bool canAssign);
 	void parsePrecedence(Precedence precedence);
 	size_t identifierConstant(Token name);
+	// the string interned in the heap of the constants
+	Value stringValue(std::string_view text);
+	Heap &objects();
+	// makes the function being compiled a root of the heap until the
+	// compiler is destroyed
+	void rootFunction();
+	// token for the names the compiler declares itself
+	Token syntheticToken(std::string_view text);
 	bool identifiersEqual(const Token &a, const Token &b);
 	int resolveLocal(const Token &name);
+	// index of the upvalue of a variable of an enclosing function, -1 when
+	// it is a global
+	int resolveUpvalue(const Token &name);
 	void addLocal(Token name);
 	void declareVariable();
 	size_t parseVariable(std::string_view errorMessage);
@@ -109,6 +166,16 @@ class Compiler {
 	void expression();
 	void block();
 	void functionDefinition(FunctionType type);
+	// compiles the parameters and the body of the function being compiled
+	void functionBody();
+	// skips the function the parser is at and adds it with its body left
+	// for the first call. false when the body names a local of an enclosing
+	// function or `super`, or does not parse, which needs it compiled now
+	bool skipFunction(FunctionType type);
+	// the identifier names a local of this or an enclosing function
+	bool namesEnclosingLocal(const Token &name);
+	void method();
+	void classDeclaration();
 	void funDeclaration();
 	void varDeclaration();
 	void expressionStatement();
@@ -123,19 +190,47 @@ class Compiler {
 
   public:
 	Compiler(Compiler *enclosing = nullptr, FunctionType type = FunctionType::TYPE_SCRIPT);
+	Compiler(const Compiler &) = delete;
+	Compiler &operator=(const Compiler &) = delete;
+	~Compiler();
 	auto compile(std::string_view source,
 	             FunctionType type = FunctionType::TYPE_SCRIPT)
 	    -> std::expected<std::reference_wrapper<ObjFunction>, std::string>;
+	// compiles the body the lazy compiler skipped into the chunk of the
+	// function, every copy of the function shares it. false when the body
+	// has compile errors, which are reported like the ones of compile
+	static bool compileBody(const ObjFunction &function);
 
 	bool debug_print_code = false;
+	Backend backend = Backend::STACK;
+	// runtime profile of an earlier run the code is specialised with, not
+	// owned by the compiler
+	const profile::Profile *profile = nullptr;
+	// leaves the bodies of functions that capture nothing to their first
+	// call, compile keeps a copy of the source for them. errors in bodies
+	// that are never called are not reported
+	bool lazy = false;
+	// heap the string and function constants are allocated in, usually the
+	// one of the VM that runs the code. without one they are allocated in a
+	// heap of the compiler and only live as long as it does
+	Heap *heap = nullptr;
 
   private:
 	Compiler *enclosing = nullptr;
+	// heap of a top-level compiler given none, created on first use
+	std::unique_ptr<Heap> own_heap;
+	// heap the function is a root of, null until compiling starts
+	Heap *rooted = nullptr;
 	Parser parser;
+	// the source the lazy compiler scans, null otherwise
+	std::shared_ptr<const std::string> source;
 	Scanner scanner;
 	CompilerScope scope;
 	ObjFunction function;
 	FunctionType type = FunctionType::TYPE_FUNCTION;
+	ClassScope *currentClass = nullptr;
+	// size of the code right after the last OP_CALL, 0 when there is none
+	size_t lastCallEnd = 0;
 };
 
 } // namespace lox
@@ -0,0 +1,12 @@
+#pragma once
+
+// build configuration that changes the layout of public types, it must be the
+// same for the library and every consumer of its headers
+
+#ifndef CPPLOX_NAN_BOXING
+#define CPPLOX_NAN_BOXING false
+#endif
+
+namespace lox::config {
+	constexpr bool nan_boxing = CPPLOX_NAN_BOXING;
+};
@@ -1,28 +1,91 @@
 #pragma once
 #include <cstddef>
+#include <map>
+#include <ostream>
 #include <string_view>
+#include <utility>
 
 #include <cpplox/chunk.hpp>
+#include <cpplox/vm.hpp>
 
 namespace lox::debug {
 
-size_t getAddress(std::span<const std::byte>::iterator &ip);
+std::string_view OpCodeName(OpCode instruction);
+
+// reads an operand of width bytes following the opcode at ip
+size_t getAddress(std::span<const std::byte>::iterator &ip, size_t width);
 
 void ConstantInstruction(std::string_view name, const lox::Chunk &chunk,
-                         std::span<const std::byte>::iterator &ip);
+                         std::span<const std::byte>::iterator &ip,
+                         size_t width = 1);
 
 void SimpleInstruction(std::string_view name,
                        std::span<const std::byte>::iterator &ip);
 
 void ByteInstruction(std::string_view name, const lox::Chunk &chunk,
-                     std::span<const std::byte>::iterator &ip);
+                     std::span<const std::byte>::iterator &ip,
+                     size_t width = 1);
+
+// instruction with two single byte operands
+void TwoByteInstruction(std::string_view name, const lox::Chunk &chunk,
+                        std::span<const std::byte>::iterator &ip);
+
+// instruction with a local slot followed by a constant index
+void LocalConstantInstruction(std::string_view name, const lox::Chunk &chunk,
+                              std::span<const std::byte>::iterator &ip);
 
 void JumpInstruction(std::string_view name, const lox::Chunk &chunk,
-                     std::span<const std::byte>::iterator &ip, int sign);
+                     std::span<const std::byte>::iterator &ip, int sign,
+                     size_t width = 2);
 
 void InstructionDisassembly(const lox::Chunk &chunk,
                             std::span<const std::byte>::iterator &ip);
 
 void ChunkDisassembly(const lox::Chunk &chunk, std::string_view name);
 
+// the register code of the chunk, registers are written rN and constants kN
+void RegInstructionDisassembly(const lox::Chunk &chunk, size_t index);
+
+void RegChunkDisassembly(const lox::Chunk &chunk, std::string_view name);
+
+// prints the stack and/or the instruction about to be executed
+class TraceHooks : public VMHooks {
+  public:
+	void beforeInstruction(const VM &vm, const Chunk &chunk,
+	                       const Instruction &instruction) override;
+	void beforeRegisterInstruction(const VM &vm, const Chunk &chunk,
+	                               const RegInstruction &instruction) override;
+
+	bool trace_instruction = false;
+	bool trace_stack = false;
+};
+
+// counts the executed instructions and how often an instruction is directly
+// followed by its neighbour in the code, taken jumps and calls do not count
+class OpCodePairHooks : public VMHooks {
+  public:
+	void beforeInstruction(const VM &vm, const Chunk &chunk,
+	                       const Instruction &instruction) override;
+
+	// writes the most frequent opcodes and pairs as markdown tables
+	void report(std::ostream &out, size_t limit = 20) const;
+
+  private:
+	size_t total = 0;
+	std::map<OpCode, size_t> opcodes;
+	std::map<std::pair<OpCode, OpCode>, size_t> pairs;
+	const Instruction *previous = nullptr;
+};
+
+// counts the executed instructions of either backend
+class InstructionCountHooks : public VMHooks {
+  public:
+	void beforeInstruction(const VM &vm, const Chunk &chunk,
+	                       const Instruction &instruction) override;
+	void beforeRegisterInstruction(const VM &vm, const Chunk &chunk,
+	                               const RegInstruction &instruction) override;
+
+	size_t executed = 0;
+};
+
 } // namespace lox::debug
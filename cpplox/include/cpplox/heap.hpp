@@ -0,0 +1,107 @@
+#pragma once
+#include <cpplox/obj.hpp>
+#include <cpplox/value.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace lox {
+
+struct ObjClass;
+
+struct HeapStats {
+	size_t collections = 0;
+	// totals since the heap was made, objects are counted with the memory
+	// they hold when they are allocated
+	size_t bytes_allocated = 0;
+	size_t bytes_freed = 0;
+	size_t objects_allocated = 0;
+	size_t objects_freed = 0;
+	std::chrono::nanoseconds total_pause{0};
+	std::chrono::nanoseconds max_pause{0};
+
+	// bytes of the objects not freed yet, garbage included
+	size_t bytesLive() const { return bytes_allocated - bytes_freed; }
+};
+
+// owns the objects values point to and frees them with a mark and sweep
+// collection. the heap does not know its roots, the owner marks them
+// between beginCollection and endCollection and only collects at points
+// where every value it holds is reachable from them, allocating never
+// collects on its own
+class Heap {
+  public:
+	// the objects and what they hold are allocated from the resource, which
+	// has to outlive the heap
+	explicit Heap(
+	    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+	Heap(const Heap &) = delete;
+	Heap &operator=(const Heap &) = delete;
+	~Heap();
+
+	// the value of the object, freed once a collection finds it unreachable
+	Value allocate(Obj &&object);
+	// the string of the characters, made the first time they are interned
+	// and shared by every later call. the table does not keep the strings
+	// alive, a collection drops the ones it frees
+	Value intern(std::string_view chars);
+	// the same, the characters are kept when the string is new
+	Value intern(std::pmr::string chars);
+
+	// true once the objects allocated since the last collection outgrew
+	// its threshold
+	bool wantsCollection() const {
+		return m_stats.bytesLive() > std::max(m_next_collection, min_threshold);
+	}
+	void beginCollection();
+	void mark(const Value &value);
+	void mark(const ObjFunction &function);
+	// traces everything marked and frees the objects it did not reach
+	void endCollection();
+
+	// functions being compiled, their constants are marked by every
+	// collection until they are removed
+	void addRoot(const ObjFunction *function);
+	void removeRoot(const ObjFunction *function);
+
+	const HeapStats &stats() const { return m_stats; }
+	std::pmr::memory_resource *resource() const { return m_resource; }
+
+	// the next collection runs once the heap grew to this factor of what
+	// the last one kept, and never below the minimum
+	double growth_factor = 2.0;
+	size_t min_threshold = size_t{1} << 20;
+
+  private:
+	// the interned string of the characters, nullptr when there is none
+	Obj *findString(std::string_view chars, size_t hash) const;
+	Value addString(std::pmr::string chars, size_t hash);
+	// drops the string from the table once it is freed
+	void forgetString(const Obj &string, size_t hash);
+	void trace(const Obj &object);
+	void trace(const ObjClass &klass);
+	void sweep();
+
+	std::pmr::memory_resource *m_resource;
+	Obj *m_objects = nullptr;
+	std::vector<const Obj *> m_gray;
+	std::vector<const ObjFunction *> m_roots;
+	// interned strings by their hash
+	std::pmr::unordered_multimap<size_t, Obj *> m_strings;
+	// marks are epochs unique to each collection of any heap, so marking an
+	// object of another heap never leaves it looking marked to its own
+	uint64_t m_epoch = 0;
+	// what the last collection kept times the growth factor
+	size_t m_next_collection = 0;
+	std::chrono::steady_clock::time_point m_collection_start;
+	HeapStats m_stats;
+};
+
+} // namespace lox
@@ -0,0 +1,68 @@
+#pragma once
+#include <cpplox/chunk.hpp>
+#include <cpplox/value.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// the generated code works on NaN boxed values in place, so the JIT is only
+// built for that representation on x86-64 Linux
+#if CPPLOX_NAN_BOXING && defined(__x86_64__) && defined(__linux__)
+#define CPPLOX_JIT 1
+#else
+#define CPPLOX_JIT 0
+#endif
+
+namespace lox::jit {
+
+constexpr bool supported = CPPLOX_JIT;
+
+// calls and loop iterations after which the VM compiles a function when the
+// JIT is enabled
+constexpr uint32_t default_threshold = 1000;
+
+// registers of the interpreter the machine code works on, the stack top is
+// written back when it returns
+struct State {
+	Value *slots;
+	Value *stackTop;
+	Value *globals;
+};
+
+// machine code of a chunk, one template per decoded instruction. numbers,
+// booleans and nil are handled in place, anything else and every call,
+// return and closure leaves the machine code at the instruction so the
+// interpreter runs it
+class Code {
+  public:
+	// the C++ function lox --emit-cpp translated the chunk to, it keeps the
+	// contract of the machine code
+	using Function = uint32_t (*)(State &state, uint32_t index);
+
+	Code(std::byte *memory, size_t size, std::vector<uint32_t> entries);
+	Code(Function function, std::vector<uint32_t> entries);
+	Code(const Code &) = delete;
+	Code &operator=(const Code &) = delete;
+	~Code();
+
+	// false for instructions the machine code leaves to the interpreter
+	bool enters(size_t index) const;
+	// runs from the instruction, returns the index of the instruction the
+	// interpreter continues with
+	uint32_t run(State &state, size_t index) const;
+
+  private:
+	std::byte *m_memory = nullptr;
+	size_t m_size = 0;
+	Function m_function = nullptr;
+	// offset of the template of each instruction, UINT32_MAX when the
+	// instruction is left to the interpreter
+	std::vector<uint32_t> m_entries;
+};
+
+// nullptr when the JIT is not supported or the memory could not be mapped
+std::shared_ptr<const Code> compile(const Chunk &chunk);
+
+} // namespace lox::jit
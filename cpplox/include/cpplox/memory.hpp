@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+
+namespace lox {
+
+// hands out memory from blocks it never frees one by one, the blocks go back
+// to the upstream resource all at once when the arena is released. nothing
+// the VM frees is reused, so it suits short runs that make little garbage.
+// the arena has to outlive every VM and compiler using it
+class ArenaResource : public std::pmr::memory_resource {
+  public:
+	explicit ArenaResource(
+	    size_t block_size = size_t{64} << 10,
+	    std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
+	ArenaResource(const ArenaResource &) = delete;
+	ArenaResource &operator=(const ArenaResource &) = delete;
+	~ArenaResource() override;
+
+	// frees every block, the memory handed out before must no longer be used
+	void release();
+	// bytes handed out since the last release, and the bytes of the blocks
+	// taken from upstream to hold them
+	size_t bytesAllocated() const { return m_allocated; }
+	size_t bytesReserved() const { return m_reserved; }
+
+  private:
+	struct Block {
+		Block *next;
+		size_t size;
+	};
+
+	void *do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void *, size_t, size_t) override {}
+	bool do_is_equal(const std::pmr::memory_resource &other) const
+	    noexcept override {
+		return this == &other;
+	}
+
+	std::pmr::memory_resource *m_upstream;
+	// size of the next block, it doubles with every block
+	size_t m_block_size;
+	Block *m_blocks = nullptr;
+	std::byte *m_current = nullptr;
+	std::byte *m_end = nullptr;
+	size_t m_allocated = 0;
+	size_t m_reserved = 0;
+};
+
+// keeps a free list for each power of two size up to max_size, so the
+// objects, strings and vectors of a VM reuse the memory of the ones freed
+// before them. larger requests go straight to the upstream resource. the
+// pool has to outlive every VM and compiler using it
+class PoolResource : public std::pmr::memory_resource {
+  public:
+	static constexpr size_t min_size = 16;
+	static constexpr size_t max_size = 1024;
+
+	explicit PoolResource(
+	    std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
+	PoolResource(const PoolResource &) = delete;
+	PoolResource &operator=(const PoolResource &) = delete;
+	~PoolResource() override;
+
+	// bytes handed out and not deallocated yet, rounded up to their size
+	// class, and the bytes taken from upstream including the large requests
+	size_t bytesInUse() const { return m_in_use; }
+	size_t bytesReserved() const { return m_reserved; }
+
+  private:
+	struct Block {
+		Block *next;
+	};
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+	};
+	static constexpr size_t class_count = 7;
+	// blocks carved from upstream at once for a size class
+	static constexpr size_t chunk_size = size_t{64} << 10;
+
+	void *do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void *pointer, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource &other) const
+	    noexcept override {
+		return this == &other;
+	}
+	// fills the free list of the size class with a new chunk
+	void refill(size_t index);
+
+	std::pmr::memory_resource *m_upstream;
+	std::array<Block *, class_count> m_free{};
+	Chunk *m_chunks = nullptr;
+	size_t m_in_use = 0;
+	size_t m_reserved = 0;
+};
+
+} // namespace lox
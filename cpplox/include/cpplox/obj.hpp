@@ -3,11 +3,15 @@
 #include <cpplox/value.hpp>
 
 #include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <memory>
+#include <memory_resource>
 #include <span>
 #include <string>
+#include <string_view>
 #include <variant>
+#include <vector>
 
 namespace lox {
 
@@ -23,10 +27,49 @@ class Obj;
 struct ObjFunction;
 struct ObjNative;
 struct ObjClosure;
+struct ObjUpvalue;
+struct ObjClass;
+class Shape;
 class Value;
 
-using NativeFn = Value (*)(size_t argCount,
-                           std::span<std::reference_wrapper<Value>> args);
+// the characters never change once the string is made, so the hash is
+// computed once. the heap interns strings, equal strings it made are the
+// same object. long concatenations are ropes instead, which only copy the
+// characters of the two strings once something reads them
+class ObjString {
+  public:
+	ObjString(std::pmr::string chars, size_t hash);
+	// rope of the two strings, it is not interned
+	ObjString(Value left, Value right);
+
+	static size_t hashOf(std::string_view chars);
+
+	// reading the characters or the hash of a rope flattens it
+	const std::pmr::string &chars() const;
+	size_t hash() const;
+	size_t size() const { return m_size; }
+	// the strings of a rope that was not flattened yet, nil otherwise
+	bool isRope() const { return !m_left.isNil(); }
+	const Value &left() const { return m_left; }
+	const Value &right() const { return m_right; }
+
+	// ropes and the strings of different heaps are not interned together,
+	// so equal strings are not always the same object
+	bool operator==(const ObjString &other) const;
+
+  private:
+	// copies the characters of the strings of the rope in order and drops
+	// them, without recursing so deep ropes can not overflow the stack
+	void flatten() const;
+
+	mutable std::pmr::string m_chars;
+	mutable size_t m_hash = 0;
+	size_t m_size;
+	mutable Value m_left;
+	mutable Value m_right;
+};
+
+using NativeFn = Value (*)(size_t argCount, std::span<Value> args);
 
 struct ObjNative {
 	NativeFn function = nullptr;
@@ -37,11 +80,23 @@ struct ObjNative {
 struct ObjFunction {
 	std::string name;
 	size_t arity = 0;
-	std::unique_ptr<Chunk> chunk;
+	// the compiled code is shared by every copy of the function, it does not
+	// change once compiled apart from the caches the VM fills when loading it
+	std::shared_ptr<Chunk> chunk;
+	// cells of the captured variables, shared with every copy of the closure
+	// and empty for functions that capture nothing
+	std::vector<std::shared_ptr<ObjUpvalue>> upvalues;
+	// methods get their receiver as local 0, in the slot of the callee
+	// right below the arguments
+	bool isMethod = false;
 	Object obj;
 
 	ObjFunction();
+	// the chunk and its code are allocated from the resource
+	explicit ObjFunction(std::pmr::memory_resource *resource);
+	// functions are the same when they share their code and their upvalues
 	bool operator==(const ObjFunction &other) const;
+	// shallow copy, the result shares the code and the upvalues
 	ObjFunction clone() const;
 	std::string toString() const;
 };
@@ -54,21 +109,57 @@ struct ObjClosure {
 	bool operator==(const ObjClosure &other) const;
 
 	size_t arity() const { return function.get().arity; }
-	const std::unique_ptr<Chunk> &chunk() const { return function.get().chunk; }
+	const std::shared_ptr<Chunk> &chunk() const { return function.get().chunk; }
 
 	ObjClosure clone() const;
 	std::string toString() const;
 };
 
+// method read from an instance, calling it runs the method with the
+// instance as its receiver
+struct ObjBoundMethod {
+	// the instance
+	Value receiver;
+	// owned by the class of the receiver or one of its superclasses
+	const ObjFunction *method;
+
+	bool operator==(const ObjBoundMethod &other) const;
+	std::string toString() const;
+};
+
+struct ObjInstance {
+	// the fields are allocated from the resource
+	ObjInstance(Value klass, std::pmr::memory_resource *resource);
+
+	std::string toString() const;
+
+	// the class, which the instance keeps alive
+	Value klass;
+	// owned by the class
+	Shape *shape;
+	// values of the fields in the order of the shape
+	std::pmr::vector<Value> fields;
+};
+
+// allocated by a Heap, values point to it and every copy of the value
+// shares it
 class Obj {
-	using Obj_t = std::variant<std::string, ObjFunction, ObjNative, ObjClosure>;
+	// classes stay behind a pointer so their maps do not grow every
+	// object, the object is their only owner
+	using Obj_t = std::variant<ObjString, ObjFunction, ObjNative, ObjClosure,
+	                           std::shared_ptr<ObjClass>, ObjInstance,
+	                           ObjBoundMethod>;
 
   public:
 	Obj() = default;
-	Obj(std::string value);
+	Obj(ObjString value);
 	Obj(const ObjFunction &value);
+	Obj(ObjFunction &&value);
 	Obj(const ObjNative &value);
 	Obj(const ObjClosure &value);
+	Obj(std::shared_ptr<ObjClass> value);
+	Obj(ObjInstance &&value);
+	Obj(const ObjBoundMethod &value);
 	Obj(const Obj &other) = delete;
 	Obj(Obj &&other) noexcept;
 
@@ -79,8 +170,16 @@ class Obj {
 
 	std::string toString() const;
 
-	Obj clone() const;
 	Obj_t value;
+
+  private:
+	friend class Heap;
+
+	// epoch of the last collection that marked the object, see Heap
+	mutable uint64_t marked = 0;
+	size_t size = 0;
+	// next object allocated by the same heap
+	Obj *next = nullptr;
 };
 
 } // namespace lox
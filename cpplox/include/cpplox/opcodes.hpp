@@ -0,0 +1,220 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace lox {
+
+// every opcode with its operands and stack effect, the enum, the descriptor
+// table and the dispatch table of the VM are all generated from this list
+// X(name, first operand, second operand, pops, pushes, scratch, flags)
+// pops does not include the arguments counted by a COUNT operand, scratch
+// are the values pushed temporarily while the instruction runs
+#define CPPLOX_OPCODES(X)                                                      \
+	X(OP_CONSTANT, CONSTANT, NONE, 0, 1, 0, NONE)                              \
+	X(OP_NIL, NONE, NONE, 0, 1, 0, NONE)                                       \
+	X(OP_TRUE, NONE, NONE, 0, 1, 0, NONE)                                      \
+	X(OP_FALSE, NONE, NONE, 0, 1, 0, NONE)                                     \
+	X(OP_POP, NONE, NONE, 1, 0, 0, NONE)                                       \
+	X(OP_GET_LOCAL, LOCAL, NONE, 0, 1, 0, NONE)                                \
+	X(OP_SET_LOCAL, LOCAL, NONE, 1, 1, 0, NONE)                                \
+	X(OP_GET_GLOBAL, CONSTANT, NONE, 0, 1, 0, NONE)                            \
+	X(OP_DEFINE_GLOBAL, CONSTANT, NONE, 1, 0, 0, NONE)                         \
+	X(OP_SET_GLOBAL, CONSTANT, NONE, 1, 1, 0, NONE)                            \
+	X(OP_GET_UPVALUE, UPVALUE, NONE, 0, 1, 0, NONE)                            \
+	X(OP_SET_UPVALUE, UPVALUE, NONE, 1, 1, 0, NONE)                            \
+	X(OP_EQUAL, NONE, NONE, 2, 1, 0, NONE)                                     \
+	X(OP_NOT_EQUAL, NONE, NONE, 2, 1, 0, NONE)                                 \
+	X(OP_GREATER, NONE, NONE, 2, 1, 0, NONE)                                   \
+	X(OP_GREATER_EQUAL, NONE, NONE, 2, 1, 0, NONE)                             \
+	X(OP_LESS, NONE, NONE, 2, 1, 0, NONE)                                      \
+	X(OP_LESS_EQUAL, NONE, NONE, 2, 1, 0, NONE)                                \
+	X(OP_ADD, NONE, NONE, 2, 1, 0, NONE)                                       \
+	X(OP_SUBTRACT, NONE, NONE, 2, 1, 0, NONE)                                  \
+	X(OP_MULTIPLY, NONE, NONE, 2, 1, 0, NONE)                                  \
+	X(OP_DIVIDE, NONE, NONE, 2, 1, 0, NONE)                                    \
+	X(OP_NOT, NONE, NONE, 1, 1, 0, NONE)                                       \
+	X(OP_NEGATE, NONE, NONE, 1, 1, 0, NONE)                                    \
+	X(OP_PRINT, NONE, NONE, 1, 0, 0, NONE)                                     \
+	X(OP_JUMP, JUMP, NONE, 0, 0, 0, TERMINAL)                                  \
+	X(OP_JUMP_IF_FALSE, JUMP, NONE, 1, 1, 0, NONE)                             \
+	X(OP_LOOP, LOOP, NONE, 0, 0, 0, TERMINAL)                                  \
+	X(OP_CALL, COUNT, NONE, 1, 1, 0, NONE)                                     \
+	/* call in tail position, reuses the frame of the caller */                \
+	X(OP_TAIL_CALL, COUNT, NONE, 1, 1, 0, NONE)                                \
+	X(OP_CLOSURE, CONSTANT, NONE, 0, 1, 0, NONE)                               \
+	/* pops a local captured by a closure, moving it into its upvalue */       \
+	X(OP_CLOSE_UPVALUE, NONE, NONE, 1, 0, 0, NONE)                             \
+	X(OP_CLASS, CONSTANT, NONE, 0, 1, 0, NONE)                                 \
+	/* copies the methods of the superclass into the class above it and pops   \
+	 * the class */                                                            \
+	X(OP_INHERIT, NONE, NONE, 2, 1, 0, NONE)                                   \
+	X(OP_METHOD, CONSTANT, NONE, 2, 1, 0, NONE)                                \
+	X(OP_GET_PROPERTY, CONSTANT, NONE, 1, 1, 0, CACHED)                        \
+	X(OP_SET_PROPERTY, CONSTANT, NONE, 2, 1, 0, CACHED)                        \
+	X(OP_GET_SUPER, CONSTANT, NONE, 2, 1, 0, CACHED)                           \
+	/* calls a method of the receiver below the arguments, without the bound   \
+	 * method OP_GET_PROPERTY and OP_CALL would make */                        \
+	X(OP_INVOKE, CONSTANT, COUNT, 1, 1, 0, CACHED)                             \
+	X(OP_SUPER_INVOKE, CONSTANT, COUNT, 2, 1, 0, CACHED)                       \
+	X(OP_RETURN, NONE, NONE, 1, 0, 0, TERMINAL)                                \
+	/* prefix that widens the operands of the next instruction to 32 bits */   \
+	X(OP_WIDE, NONE, NONE, 0, 0, 0, PREFIX)                                    \
+	/* superinstructions fused by the peephole pass, see                       \
+	 * benchmarks/opcode_pairs.md */                                           \
+	X(OP_JUMP_IF_FALSE_POP, JUMP, NONE, 1, 0, 0, NONE)                         \
+	X(OP_LESS_JUMP, JUMP, NONE, 2, 0, 0, NONE)                                 \
+	X(OP_ADD_LOCALS, LOCAL, LOCAL, 0, 1, 1, NONE)                              \
+	X(OP_ADD_CONSTANT, CONSTANT, NONE, 1, 1, 1, NONE)                          \
+	X(OP_INCREMENT_LOCAL, LOCAL, CONSTANT, 0, 0, 2, NONE)                      \
+	X(OP_SET_LOCAL_POP, LOCAL, NONE, 1, 0, 0, NONE)                            \
+	/* quickened forms, the VM rewrites the decoded instructions to these      \
+	 * once it has seen the operand types */                                   \
+	X(OP_ADD_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                              \
+	X(OP_SUBTRACT_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                         \
+	X(OP_MULTIPLY_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                         \
+	X(OP_DIVIDE_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                           \
+	X(OP_GREATER_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                          \
+	X(OP_GREATER_EQUAL_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                    \
+	X(OP_LESS_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                             \
+	X(OP_LESS_EQUAL_NUM, NONE, NONE, 2, 1, 0, QUICKENED)                       \
+	X(OP_ADD_STR, NONE, NONE, 2, 1, 0, QUICKENED)                              \
+	X(OP_ADD_INT, NONE, NONE, 2, 1, 0, QUICKENED)                              \
+	X(OP_SUBTRACT_INT, NONE, NONE, 2, 1, 0, QUICKENED)                         \
+	X(OP_MULTIPLY_INT, NONE, NONE, 2, 1, 0, QUICKENED)                         \
+	X(OP_GREATER_INT, NONE, NONE, 2, 1, 0, QUICKENED)                          \
+	X(OP_GREATER_EQUAL_INT, NONE, NONE, 2, 1, 0, QUICKENED)                    \
+	X(OP_LESS_INT, NONE, NONE, 2, 1, 0, QUICKENED)                             \
+	X(OP_LESS_EQUAL_INT, NONE, NONE, 2, 1, 0, QUICKENED)
+
+enum class OpCode : uint8_t {
+#define CPPLOX_OPCODE_ENUM(name, ...) name,
+	CPPLOX_OPCODES(CPPLOX_OPCODE_ENUM)
+#undef CPPLOX_OPCODE_ENUM
+};
+
+enum class OperandKind : uint8_t {
+	NONE,
+	// index into the constants of the chunk
+	CONSTANT,
+	// slot relative to the first argument of the frame
+	LOCAL,
+	// index into the upvalues of the running closure
+	UPVALUE,
+	// number of arguments of a call
+	COUNT,
+	// forward jump offset, from the end of the instruction
+	JUMP,
+	// backward jump offset, from the end of the instruction
+	LOOP,
+};
+
+enum class OpCodeFlags : uint8_t {
+	NONE,
+	// control never continues with the next instruction
+	TERMINAL,
+	// modifies the next instruction instead of running on its own
+	PREFIX,
+	// only ever written into the decoded instructions by the VM
+	QUICKENED,
+	// looks up a property by name, the decoded instruction gets an inline
+	// cache in Chunk::caches()
+	CACHED,
+};
+
+struct OpCodeInfo {
+	std::string_view name;
+	std::array<OperandKind, 2> operands;
+	uint8_t pops;
+	uint8_t pushes;
+	uint8_t scratch;
+	OpCodeFlags flags;
+
+	constexpr size_t operandCount() const {
+		return (operands[0] != OperandKind::NONE) +
+		       (operands[1] != OperandKind::NONE);
+	}
+	// the OP_WIDE prefix widens every operand to 32 bits, without it jump
+	// offsets take 16 bits and everything else a single byte
+	constexpr size_t operandWidth(size_t operand, bool wide) const {
+		auto kind = operands[operand];
+		return wide                                                    ? 4
+		       : kind == OperandKind::JUMP || kind == OperandKind::LOOP ? 2
+		                                                               : 1;
+	}
+	// size of the encoded instruction, without the prefix
+	constexpr size_t size(bool wide) const {
+		size_t size = 1;
+		for (size_t i = 0; i < operandCount(); ++i) {
+			size += operandWidth(i, wide);
+		}
+		return size;
+	}
+	constexpr bool isJump() const {
+		return operands[0] == OperandKind::JUMP ||
+		       operands[0] == OperandKind::LOOP;
+	}
+	constexpr bool isTerminal() const {
+		return flags == OpCodeFlags::TERMINAL;
+	}
+};
+
+inline constexpr std::array opcodes = std::to_array<OpCodeInfo>({
+#define CPPLOX_OPCODE_INFO(name, first, second, pops, pushes, scratch, flags) \
+	{#name,                                                                    \
+	 {OperandKind::first, OperandKind::second},                                \
+	 pops,                                                                     \
+	 pushes,                                                                   \
+	 scratch,                                                                  \
+	 OpCodeFlags::flags},
+    CPPLOX_OPCODES(CPPLOX_OPCODE_INFO)
+#undef CPPLOX_OPCODE_INFO
+});
+
+// bytes outside of the table decode as unknown instructions
+constexpr bool isOpCode(std::byte byte) {
+	return static_cast<size_t>(byte) < opcodes.size();
+}
+
+constexpr const OpCodeInfo &opcodeInfo(OpCode instruction) {
+	return opcodes[static_cast<size_t>(instruction)];
+}
+
+// the instruction the compiler emits for a quickened form
+constexpr OpCode genericForm(OpCode instruction) {
+	switch (instruction) {
+	case OpCode::OP_ADD_NUM:
+	case OpCode::OP_ADD_INT:
+	case OpCode::OP_ADD_STR:
+		return OpCode::OP_ADD;
+	case OpCode::OP_SUBTRACT_NUM:
+	case OpCode::OP_SUBTRACT_INT:
+		return OpCode::OP_SUBTRACT;
+	case OpCode::OP_MULTIPLY_NUM:
+	case OpCode::OP_MULTIPLY_INT:
+		return OpCode::OP_MULTIPLY;
+	case OpCode::OP_DIVIDE_NUM:
+		return OpCode::OP_DIVIDE;
+	case OpCode::OP_GREATER_NUM:
+	case OpCode::OP_GREATER_INT:
+		return OpCode::OP_GREATER;
+	case OpCode::OP_GREATER_EQUAL_NUM:
+	case OpCode::OP_GREATER_EQUAL_INT:
+		return OpCode::OP_GREATER_EQUAL;
+	case OpCode::OP_LESS_NUM:
+	case OpCode::OP_LESS_INT:
+		return OpCode::OP_LESS;
+	case OpCode::OP_LESS_EQUAL_NUM:
+	case OpCode::OP_LESS_EQUAL_INT:
+		return OpCode::OP_LESS_EQUAL;
+	default:
+		return instruction;
+	}
+}
+
+static_assert(opcodeInfo(OpCode::OP_ADD_INT).name == "OP_ADD_INT");
+static_assert(opcodeInfo(OpCode::OP_CONSTANT).size(true) == 5);
+
+} // namespace lox
@@ -0,0 +1,12 @@
+#pragma once
+#include <cpplox/chunk.hpp>
+
+namespace lox::peephole {
+
+// replaces the hottest opcode sequences with their superinstruction, a
+// sequence is only fused when no jump lands inside of it. the code is then
+// re-encoded with the short form of every jump that fits in 16 bits, the
+// compiler emits forward jumps wide because it does not know their distance
+void optimize(Chunk &chunk);
+
+} // namespace lox::peephole
@@ -6,10 +6,14 @@
 #ifndef CPPLOX_CONSTANT_DEBUG_TRACE_STACK
 #define CPPLOX_CONSTANT_DEBUG_TRACE_STACK false
 #endif
+#ifndef CPPLOX_CONSTANT_THREADED_DISPATCH
+#define CPPLOX_CONSTANT_THREADED_DISPATCH true
+#endif
 
 
 namespace lox::constants {
 	constexpr bool debug_trace_instruction = CPPLOX_CONSTANT_DEBUG_TRACE_INSTRUCTION;
 	constexpr bool debug_trace_stack = CPPLOX_CONSTANT_DEBUG_TRACE_STACK;
+	constexpr bool threaded_dispatch = CPPLOX_CONSTANT_THREADED_DISPATCH;
 };
 
@@ -0,0 +1,92 @@
+#pragma once
+#include <cpplox/chunk.hpp>
+#include <cpplox/opcodes.hpp>
+#include <cpplox/vm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <istream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lox::profile {
+
+// identifies the code a profile was recorded for, the hash covers the
+// bytecode and the constants so a profile of code that changed since is
+// ignored. the top level code is named <script>
+struct Key {
+	std::string name;
+	uint64_t hash = 0;
+
+	auto operator<=>(const Key &other) const = default;
+};
+
+Key keyOf(std::string_view name, const Chunk &chunk);
+
+// what a run observed in one function, instructions are indices into the
+// decoded instructions of its chunk
+struct FunctionProfile {
+	// calls and loop iterations, the count the JIT compares to its threshold
+	uint64_t hotness = 0;
+	// the quickened form each arithmetic and comparison instruction ended
+	// the run in
+	std::map<uint32_t, OpCode> types;
+	// times each conditional jump was taken and fell through
+	std::map<uint32_t, std::pair<uint64_t, uint64_t>> branches;
+	// functions each call site called and how often
+	std::map<std::pair<uint32_t, Key>, uint64_t> targets;
+};
+
+class Profile {
+  public:
+	// the profile of the function, nullptr when there is none for its
+	// current code
+	const FunctionProfile *find(std::string_view name,
+	                            const Chunk &chunk) const;
+	// pre-specialises the decoded instructions of the chunk with the types
+	// of the profile and marks it hot for the JIT, code without a profile
+	// is left as it is
+	void apply(std::string_view name, const Chunk &chunk) const;
+
+	// line based text, one function line followed by its instructions
+	void write(std::ostream &out) const;
+	static auto read(std::istream &in) -> std::expected<Profile, std::string>;
+
+	std::map<Key, FunctionProfile> functions;
+};
+
+// records a profile of the code the VM runs. only the stack backend
+// reports branches and types, the register backend reports calls
+class Recorder : public VMHooks {
+  public:
+	void beforeInstruction(const VM &vm, const Chunk &chunk,
+	                       const Instruction &instruction) override;
+	void onCall(const VM &vm, const CallFrame &frame) override;
+
+	// the profile of everything run so far, types are read from the
+	// instructions the VM quickened
+	Profile profile() const;
+
+  private:
+	struct Seen {
+		Key key;
+		// keeps the chunk alive for the types once its functions are gone
+		std::shared_ptr<const Chunk> chunk;
+		FunctionProfile profile;
+	};
+	Seen &seen(const ObjFunction &function);
+
+	std::unordered_map<const Chunk *, Seen> functions;
+	// the function of the last instruction, most instructions follow one of
+	// the same function
+	Seen *current = nullptr;
+};
+
+} // namespace lox::profile
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace lox {
+
+// every instruction of the register backend with the kind of its operands,
+// the enum, the descriptor table and the dispatch table of the register
+// loop are generated from this list. a register is a slot of the frame
+// window, counted from its first local like the stack positions it replaces
+// X(name, a, b, c)
+#define CPPLOX_REG_OPCODES(X)                                                  \
+	X(OP_MOVE, REGISTER, RK, NONE)                                             \
+	X(OP_NIL, REGISTER, NONE, NONE)                                            \
+	X(OP_TRUE, REGISTER, NONE, NONE)                                           \
+	X(OP_FALSE, REGISTER, NONE, NONE)                                          \
+	/* the slot of the global is resolved when the VM loads the code */        \
+	X(OP_GET_GLOBAL, REGISTER, CONSTANT, GLOBAL)                               \
+	X(OP_DEFINE_GLOBAL, RK, CONSTANT, GLOBAL)                                  \
+	X(OP_SET_GLOBAL, RK, CONSTANT, GLOBAL)                                     \
+	X(OP_GET_UPVALUE, REGISTER, UPVALUE, NONE)                                 \
+	X(OP_SET_UPVALUE, UPVALUE, RK, NONE)                                       \
+	X(OP_EQUAL, REGISTER, RK, RK)                                              \
+	X(OP_NOT_EQUAL, REGISTER, RK, RK)                                          \
+	X(OP_GREATER, REGISTER, RK, RK)                                            \
+	X(OP_GREATER_EQUAL, REGISTER, RK, RK)                                      \
+	X(OP_LESS, REGISTER, RK, RK)                                               \
+	X(OP_LESS_EQUAL, REGISTER, RK, RK)                                         \
+	X(OP_ADD, REGISTER, RK, RK)                                                \
+	X(OP_SUBTRACT, REGISTER, RK, RK)                                           \
+	X(OP_MULTIPLY, REGISTER, RK, RK)                                           \
+	X(OP_DIVIDE, REGISTER, RK, RK)                                             \
+	X(OP_NOT, REGISTER, RK, NONE)                                              \
+	X(OP_NEGATE, REGISTER, RK, NONE)                                           \
+	X(OP_PRINT, RK, NONE, NONE)                                                \
+	X(OP_JUMP, TARGET, NONE, NONE)                                             \
+	X(OP_JUMP_IF_FALSE, TARGET, RK, NONE)                                      \
+	/* compare and jump when the comparison is false */                        \
+	X(OP_EQUAL_JUMP, TARGET, RK, RK)                                           \
+	X(OP_NOT_EQUAL_JUMP, TARGET, RK, RK)                                       \
+	X(OP_GREATER_JUMP, TARGET, RK, RK)                                         \
+	X(OP_GREATER_EQUAL_JUMP, TARGET, RK, RK)                                   \
+	X(OP_LESS_JUMP, TARGET, RK, RK)                                            \
+	X(OP_LESS_EQUAL_JUMP, TARGET, RK, RK)                                      \
+	/* the callee is in a, the arguments in the registers after it and the    \
+	 * result replaces the callee */                                           \
+	X(OP_CALL, REGISTER, COUNT, NONE)                                          \
+	X(OP_TAIL_CALL, REGISTER, COUNT, NONE)                                     \
+	X(OP_CLOSURE, REGISTER, CONSTANT, NONE)                                    \
+	/* closes the upvalues of a and every register above it */                 \
+	X(OP_CLOSE_UPVALUE, REGISTER, NONE, NONE)                                  \
+	X(OP_CLASS, REGISTER, CONSTANT, NONE)                                      \
+	/* copies the methods of the superclass in a into the class in b */        \
+	X(OP_INHERIT, REGISTER, REGISTER, NONE)                                    \
+	X(OP_METHOD, REGISTER, REGISTER, CONSTANT)                                 \
+	/* the property instructions take their inline cache from the stack        \
+	 * instruction they were made from */                                      \
+	X(OP_GET_PROPERTY, REGISTER, REGISTER, CONSTANT)                           \
+	X(OP_SET_PROPERTY, REGISTER, RK, CONSTANT)                                 \
+	/* binds the method of the superclass in c to the instance in b */         \
+	X(OP_GET_SUPER, REGISTER, REGISTER, REGISTER)                              \
+	X(OP_INVOKE, REGISTER, COUNT, CONSTANT)                                    \
+	/* the superclass is in the register after the arguments */                \
+	X(OP_SUPER_INVOKE, REGISTER, COUNT, CONSTANT)                              \
+	X(OP_RETURN, RK, NONE, NONE)
+
+enum class RegOp : uint8_t {
+#define CPPLOX_REG_OPCODE_ENUM(name, ...) name,
+	CPPLOX_REG_OPCODES(CPPLOX_REG_OPCODE_ENUM)
+#undef CPPLOX_REG_OPCODE_ENUM
+};
+
+enum class RegOperandKind : uint8_t {
+	NONE,
+	// slot of the frame window
+	REGISTER,
+	// register, or constant when constant_operand is set
+	RK,
+	// index into the constants of the chunk
+	CONSTANT,
+	// slot of the global, resolved when the VM loads the code
+	GLOBAL,
+	// index into the upvalues of the running closure
+	UPVALUE,
+	// number of arguments of a call
+	COUNT,
+	// index of the instruction a jump continues with
+	TARGET,
+};
+
+struct RegOpInfo {
+	std::string_view name;
+	std::array<RegOperandKind, 3> operands;
+};
+
+inline constexpr std::array reg_opcodes = std::to_array<RegOpInfo>({
+#define CPPLOX_REG_OPCODE_INFO(name, a, b, c)                                  \
+	{#name, {RegOperandKind::a, RegOperandKind::b, RegOperandKind::c}},
+    CPPLOX_REG_OPCODES(CPPLOX_REG_OPCODE_INFO)
+#undef CPPLOX_REG_OPCODE_INFO
+});
+
+constexpr const RegOpInfo &regOpInfo(RegOp instruction) {
+	return reg_opcodes[static_cast<size_t>(instruction)];
+}
+
+// marks an RK operand that names a constant instead of a register
+constexpr uint32_t constant_operand = uint32_t{1} << 31;
+
+// three address instruction, a is the register written unless its kind
+// says otherwise
+struct RegInstruction {
+	RegOp op;
+	uint32_t a = 0;
+	uint32_t b = 0;
+	uint32_t c = 0;
+	// index of the decoded stack instruction it was made from, used for
+	// lines, errors and inline caches
+	uint32_t source = 0;
+};
+
+// register form of a chunk, it shares the constants and captures of the
+// chunk it was made from
+struct RegChunk {
+	std::vector<RegInstruction> code;
+	// registers the code uses above the first local of the frame
+	size_t registers = 0;
+};
+
+static_assert(regOpInfo(RegOp::OP_RETURN).name == "OP_RETURN");
+
+} // namespace lox
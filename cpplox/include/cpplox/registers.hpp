@@ -0,0 +1,20 @@
+#pragma once
+#include <cpplox/chunk.hpp>
+#include <cpplox/regchunk.hpp>
+
+#include <cstddef>
+#include <memory>
+
+namespace lox::registers {
+
+// translates the decoded stack code into register code. each stack position
+// becomes the register of the same index, so locals are registers already.
+// pushes of locals and constants are not copied but folded into the
+// instruction that consumes them, results are written straight into the
+// local they are assigned to and comparisons fuse with the jump that tests
+// them. values are only moved into their register at jump targets and
+// before instructions that can run other code. arity counts the receiver of
+// methods, returns nullptr when the code does not verify
+std::shared_ptr<RegChunk> generate(const Chunk &chunk, size_t arity);
+
+} // namespace lox::registers
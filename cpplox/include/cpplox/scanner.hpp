@@ -88,6 +88,8 @@ class Scanner {
   public:
 	Scanner() = default;
 	Scanner(std::string_view source);
+	// scans the source from the offset, which is on the given line
+	Scanner(std::string_view source, size_t offset, size_t line);
 	Token scanToken();
 
   private:
@@ -1,6 +1,8 @@
 #pragma once
-#include <cpplox/obj.hpp>
+#include <cpplox/config.hpp>
 
+#include <bit>
+#include <cstdint>
 #include <string>
 #include <string_view>
 #include <variant>
@@ -12,30 +14,211 @@ struct ObjFunction;
 struct ObjFunction;
 struct ObjNative;
 
+namespace jit {
+struct Bits;
+}
+
 class Value {
-	using Value_t = std::variant<bool, double, Obj, std::monostate>;
+#if !CPPLOX_NAN_BOXING
+	struct Undefined {};
+	using Value_t =
+	    std::variant<bool, double, int64_t, Obj *, std::monostate, Undefined>;
+#endif
 
   public:
+	// integers are a faster representation of the integral numbers, they
+	// are limited to the range where every value is exact as a double so
+	// they behave exactly like the double they stand for
+#if CPPLOX_NAN_BOXING
+	static constexpr int64_t max_int = (int64_t{1} << 48) - 1;
+#else
+	static constexpr int64_t max_int = int64_t{1} << 53;
+#endif
+	static constexpr int64_t min_int = -max_int;
+
 	Value();
 	Value(bool value);
 	Value(double value);
-	Value(const std::string_view value);
-	Value(const NativeFn& function);
-	// functions are owned by the object, so we need to move them
-	Value(ObjFunction &&value);
-	Value(const Value &other);
-	Value(Value &&other) noexcept;
-
-	Value &operator=(const Value &other);
-	Value &operator=(Value &&other) noexcept;
+	// the value must be within [min_int, max_int], see integer()
+	Value(int64_t value);
+	// objects are allocated by a Heap, the value only points to them
+	explicit Value(Obj *object);
+	// strings are objects as well, they would otherwise convert to bool
+	Value(const char *) = delete;
+	Value(std::string_view) = delete;
 
-	Value clone() const;
+	// the integer if it is in range, the double it rounds to otherwise
+	static Value integer(int64_t value);
+	// marks global slots that have not been defined yet, lox code never
+	// sees it
+	static Value undefined();
 
 	std::string toString() const;
 	bool isTruthy() const;
 	bool equals(const Value &other) const;
 
+	bool isNil() const;
+	bool isBool() const;
+	// integers and doubles are both numbers
+	bool isNumber() const;
+	bool isInt() const;
+	bool isObj() const;
+	bool isUndefined() const;
+
+	bool asBool() const;
+	// the value of either kind of number as a double
+	double asNumber() const;
+	int64_t asInt() const;
+	Obj &asObj();
+	const Obj &asObj() const;
+
+#if CPPLOX_NAN_BOXING
+  private:
+	// the JIT generates code that tests these bits in place
+	friend struct jit::Bits;
+
+	// numbers are stored as plain doubles, every other value lives in the
+	// payload of a quiet NaN: nil and booleans as small tags, objects as
+	// the pointer to their heap allocation with the sign bit set
+	static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+	static constexpr uint64_t QNAN = 0x7ffc000000000000;
+	static constexpr uint64_t TAG_NIL = 1;
+	static constexpr uint64_t TAG_FALSE = 2;
+	static constexpr uint64_t TAG_TRUE = 3;
+	static constexpr uint64_t TAG_UNDEFINED = 4;
+	static constexpr uint64_t NIL_VAL = QNAN | TAG_NIL;
+	static constexpr uint64_t FALSE_VAL = QNAN | TAG_FALSE;
+	static constexpr uint64_t TRUE_VAL = QNAN | TAG_TRUE;
+	static constexpr uint64_t UNDEFINED_VAL = QNAN | TAG_UNDEFINED;
+	// integers are stored as 49 bit two's complement next to this tag
+	static constexpr uint64_t TAG_INT = uint64_t{1} << 49;
+	static constexpr uint64_t INT_MASK = TAG_INT - 1;
+
+	Obj *objPtr() const;
+
+	uint64_t bits = NIL_VAL;
+#else
 	Value_t value;
+#endif
 };
 
+inline Value Value::integer(int64_t value) {
+	if (value < min_int || value > max_int) {
+		return Value{static_cast<double>(value)};
+	}
+	return Value{value};
+}
+
+#if CPPLOX_NAN_BOXING
+
+inline Value::Value() : bits(NIL_VAL) {}
+
+inline Value::Value(bool value) : bits(value ? TRUE_VAL : FALSE_VAL) {}
+
+inline Value::Value(double value) : bits(std::bit_cast<uint64_t>(value)) {}
+
+inline Value::Value(int64_t value)
+    : bits(QNAN | TAG_INT | (static_cast<uint64_t>(value) & INT_MASK)) {}
+
+inline Value::Value(Obj *object)
+    : bits(SIGN_BIT | QNAN | reinterpret_cast<uint64_t>(object)) {}
+
+inline Value Value::undefined() {
+	Value result;
+	result.bits = UNDEFINED_VAL;
+	return result;
+}
+
+inline bool Value::isNil() const { return bits == NIL_VAL; }
+
+inline bool Value::isUndefined() const { return bits == UNDEFINED_VAL; }
+
+inline bool Value::isBool() const { return (bits | 1) == TRUE_VAL; }
+
+inline bool Value::isInt() const {
+	return (bits & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT);
+}
+
+inline bool Value::isNumber() const {
+	return (bits & QNAN) != QNAN || isInt();
+}
+
+inline bool Value::isObj() const {
+	return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+}
+
+inline bool Value::asBool() const { return bits == TRUE_VAL; }
+
+inline int64_t Value::asInt() const {
+	// sign extend the 49 bit payload
+	return static_cast<int64_t>(bits << 15) >> 15;
+}
+
+inline double Value::asNumber() const {
+	if ((bits & QNAN) != QNAN) [[likely]] {
+		return std::bit_cast<double>(bits);
+	}
+	return static_cast<double>(asInt());
+}
+
+inline Obj *Value::objPtr() const {
+	return reinterpret_cast<Obj *>(bits & ~(SIGN_BIT | QNAN));
+}
+
+inline Obj &Value::asObj() { return *objPtr(); }
+
+inline const Obj &Value::asObj() const { return *objPtr(); }
+
+inline bool Value::isTruthy() const {
+	return !(bits == NIL_VAL || bits == FALSE_VAL);
+}
+
+#else
+
+inline Value Value::undefined() {
+	Value result;
+	result.value = Undefined{};
+	return result;
+}
+
+inline bool Value::isNil() const {
+	return std::holds_alternative<std::monostate>(value);
+}
+
+inline bool Value::isUndefined() const {
+	return std::holds_alternative<Undefined>(value);
+}
+
+inline bool Value::isBool() const { return std::holds_alternative<bool>(value); }
+
+inline bool Value::isNumber() const {
+	return std::holds_alternative<double>(value) ||
+	       std::holds_alternative<int64_t>(value);
+}
+
+inline bool Value::isInt() const {
+	return std::holds_alternative<int64_t>(value);
+}
+
+inline bool Value::isObj() const {
+	return std::holds_alternative<Obj *>(value);
+}
+
+inline bool Value::asBool() const { return std::get<bool>(value); }
+
+inline int64_t Value::asInt() const { return std::get<int64_t>(value); }
+
+inline double Value::asNumber() const {
+	if (auto *number = std::get_if<double>(&value)) [[likely]] {
+		return *number;
+	}
+	return static_cast<double>(*std::get_if<int64_t>(&value));
+}
+
+inline Obj &Value::asObj() { return *std::get<Obj *>(value); }
+
+inline const Obj &Value::asObj() const { return *std::get<Obj *>(value); }
+
+#endif
+
 } // namespace lox
@@ -0,0 +1,29 @@
+#pragma once
+#include <cpplox/chunk.hpp>
+#include <cpplox/obj.hpp>
+
+#include <cstddef>
+#include <expected>
+#include <string>
+#include <vector>
+
+namespace lox::verifier {
+
+// abstract interpretation of the stack depth over the decoded instructions:
+// every path reaches an instruction with the same depth, no instruction pops
+// below the frame, jumps land on instructions and constant and local indices
+// are in bounds. arity counts the receiver of methods, returns the maximum
+// depth above the first slot of the frame
+auto verify(const Chunk &chunk, size_t arity)
+    -> std::expected<size_t, std::string>;
+
+// depth on entry of each decoded instruction, SIZE_MAX for instructions no
+// path reaches. fails like verify
+auto stackDepths(const Chunk &chunk, size_t arity)
+    -> std::expected<std::vector<size_t>, std::string>;
+
+// verifies a function and the functions nested in its constants, recording
+// the maximum depth in each chunk. returns false on the first rejected chunk
+bool verifyFunction(const ObjFunction &function);
+
+} // namespace lox::verifier
@@ -1,73 +1,262 @@
 #pragma once
 #include <cpplox/chunk.hpp>
+#include <cpplox/compiler.hpp>
+#include <cpplox/heap.hpp>
 #include <cpplox/obj.hpp>
 #include <cpplox/value.hpp>
 
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
+#include <string>
 #include <string_view>
 #include <unordered_map>
+#include <vector>
 
 namespace lox {
 enum class InterpretResult { OK, COMPILE_ERROR, RUNTIME_ERROR };
 
+// variable captured by a closure, it points at its slot in the VM stack
+// while the variable is in scope and holds the value once it is closed
+struct ObjUpvalue {
+	explicit ObjUpvalue(Value *slot) : location(slot) {}
+
+	Value *location;
+	Value closed;
+};
+
 struct CallFrame {
 
-	CallFrame(const ObjClosure &closure, size_t stackOffset)
-	    : closure(closure), ip(closure.function.get().chunk->code().begin()),
-	      stackOffset(stackOffset) {}
+	CallFrame(const ObjClosure &closure, Value *slots)
+	    : closure(closure),
+	      ip(closure.function.get().chunk->instructions().data()),
+	      registerIp(registerCode(closure)), slots(slots) {}
 
 	// move constructor
 	CallFrame(CallFrame &&other) noexcept
-	    : closure(other.closure), ip(other.ip), stackOffset(other.stackOffset) {
-		other.ip = other.closure.function.get().chunk->code().begin();
-		other.stackOffset = 0;
+	    : closure(other.closure), ip(other.ip), registerIp(other.registerIp),
+	      slots(other.slots), elided(other.elided) {
+		other.ip = other.closure.function.get().chunk->instructions().data();
+		other.slots = nullptr;
 	}
 
 	// callframes are not copyable
 	CallFrame(const CallFrame &) = delete;
 
+	// slot of the callee, which the result replaces when the frame returns.
+	// the receiver of a method takes the place of the callee
+	Value *base() const {
+		return closure.function.get().isMethod ? slots : slots - 1;
+	}
+
 	const ObjClosure closure;
-	std::span<const std::byte>::iterator ip;
-	size_t stackOffset = 0;
+	// next instruction to execute in the decoded chunk. frames running
+	// register code keep it past the stack instruction their current one
+	// was made from, for the error trace
+	Instruction *ip;
+	// next instruction of the register code, nullptr without one
+	RegInstruction *registerIp;
+	// first local of the frame in the VM stack, the callee sits right below
+	// unless the frame is a method, whose receiver is its first local
+	Value *slots = nullptr;
+	// frames replaced by tail calls on the way to this one
+	size_t elided = 0;
+
+  private:
+	static RegInstruction *registerCode(const ObjClosure &closure) {
+		auto *registers = closure.chunk()->registers();
+		return registers != nullptr ? registers->code.data() : nullptr;
+	}
+};
+
+class VM;
+
+// callbacks invoked by the interpreter loop, the VM only runs the
+// instrumented loop while hooks are installed so they cost nothing otherwise
+class VMHooks {
+  public:
+	virtual ~VMHooks() = default;
+
+	virtual void beforeInstruction(const VM & /*vm*/, const Chunk & /*chunk*/,
+	                               const Instruction & /*instruction*/) {}
+	// the same for the register backend
+	virtual void
+	beforeRegisterInstruction(const VM & /*vm*/, const Chunk & /*chunk*/,
+	                          const RegInstruction & /*instruction*/) {}
+	// called once the frame of a lox function has been pushed, a tail call
+	// replaces the frame of the caller without an onReturn for it
+	virtual void onCall(const VM & /*vm*/, const CallFrame & /*frame*/) {}
+	// called before the frame is popped, with the value being returned
+	virtual void onReturn(const VM & /*vm*/, const CallFrame & /*frame*/,
+	                      const Value & /*result*/) {}
+	virtual void onRuntimeError(const VM & /*vm*/,
+	                            std::string_view /*message*/) {}
+};
+
+// hook policies for the interpreter loop
+struct HooksDisabled {
+	static constexpr bool enabled = false;
+};
+struct HooksEnabled {
+	static constexpr bool enabled = true;
+};
+
+// check policies for the interpreter loop, code accepted by the verifier
+// runs without the stack, local and constant bounds checks
+struct ChecksDisabled {
+	static constexpr bool enabled = false;
+};
+struct ChecksEnabled {
+	static constexpr bool enabled = true;
+};
+
+// JIT policies for the interpreter loop, only the loop without hooks and
+// checks enters machine code
+struct JitDisabled {
+	static constexpr bool enabled = false;
+};
+struct JitEnabled {
+	static constexpr bool enabled = true;
 };
 
 class VM {
 	void defineNative(std::string_view name, NativeFn function);
+	// slot of the global, a new undefined one the first time it is named
+	uint32_t globalSlot(std::string_view name);
+	// decodes the function and the functions nested in its constants and
+	// resolves the globals they name to slots of this VM
+	void load(const ObjFunction &function);
+	// compiles the body the lazy compiler skipped on the first call and
+	// loads it, false once a runtime error has been raised
+	bool compileLazy(const ObjFunction &function);
+	// counts a call of the function, including a tail call, and compiles it
+	// to machine code once it got hot
+	void countCall(const ObjFunction &function);
 	void runtimeError(std::string_view message);
+	InterpretResult reportError();
+
+	// false once a runtime error has been raised
+	bool binaryOp(OpCode instruction);
+	// the result of the binary instruction on the operands, nullopt once a
+	// runtime error has been raised
+	std::optional<Value> binaryResult(OpCode instruction, const Value &va,
+	                                  const Value &vb);
+	template <typename Operation>
+	bool numberOp(Instruction &instruction, OpCode generic,
+	              Operation operation);
+	template <typename Operation>
+	bool integerOp(Instruction &instruction, OpCode generic,
+	               Operation operation);
+	bool addStrings(Instruction &instruction);
 
-	// gets the byte and increments the instruction pointer
-	std::byte readByte(std::span<const std::byte>::iterator &ip);
-	// increments the instruction pointer and then returns the current byte
-	std::byte nextByte(std::span<const std::byte>::iterator &ip);
-	// returns the current byte
-	std::byte peekByte(std::span<const std::byte>::iterator &ip);
+	// the stack is allocated once, these do not check for underflow
+	bool push(Value value);
+	Value pop();
+	Value &peek(size_t distance = 0);
+	size_t stackSize() const;
+	void resetStack();
 
-	void binaryOp(std::span<const std::byte>::iterator &ip);
+	// the object and its control block allocated from the resource of the
+	// heap
+	template <typename T, typename... Args>
+	std::shared_ptr<T> makeShared(Args &&...args);
+	// the open upvalue of the slot, created the first time it is captured
+	std::shared_ptr<ObjUpvalue> captureUpvalue(Value *slot);
+	// allocates a closure of the function constant over the captures its
+	// chunk names, from the slots of the running frame or the upvalues of
+	// its closure, and returns the constant itself when it captures
+	// nothing. the captures have been checked by the caller. the closure
+	// is built here so the interpreter loops hold nothing with a destructor
+	// in a handler a computed goto leaves
+	Value makeClosure(const Value &constant, Value *slots,
+	                  std::span<const std::shared_ptr<ObjUpvalue>> upvalues);
+	// closes the upvalues of every slot from last to the top of the stack
+	void closeUpvalues(const Value *last);
 
+	bool reserveStack(const ObjFunction &function, const Value *slots);
 	bool call(const ObjClosure &function, size_t argCount);
 	bool callValue(const Value &callee, size_t argCount);
 
-	size_t readIndex(std::span<const std::byte>::iterator &ip);
-	auto readConstant(std::span<const std::byte>::iterator &ip)
-	    -> std::optional<std::reference_wrapper<const Value>>;
+	template <typename Hooks, typename Checks, typename Jit = JitDisabled>
 	InterpretResult run();
+	// interpreter loop of the register backend, it only runs verified code
+	template <typename Hooks> InterpretResult runRegisters();
 
   public:
-	VM();
+	// the objects, code, stack, frames and globals of the VM are allocated
+	// from the resource, which has to outlive the VM. see ArenaResource and
+	// PoolResource for the ones the library provides
+	explicit VM(
+	    std::pmr::memory_resource *resource = std::pmr::get_default_resource());
 
 	InterpretResult interpret(const ObjFunction &function);
 	InterpretResult interpret(std::string_view source);
-	bool debug_trace_instruction;
-	bool debug_trace_stack;
-	size_t max_callframes_size = 1024;
+	// hooks are not owned by the VM, nullptr removes them
+	void setHooks(VMHooks *hooks);
+	VMHooks *getHooks() const;
+	std::span<const Value> stackView() const;
+	std::span<const CallFrame> frames() const;
+	// frees the objects the stack, the frames, the globals and the
+	// functions being compiled do not reach. the VM collects on its own at
+	// calls and loops once the heap asks for it
+	void collectGarbage();
+
+	// objects of the code this VM runs, heap.stats() has the collections
+	// and the pauses and growth_factor sets how often they run
+	Heap heap;
+	// frames and value slots are allocated once, on the first interpret call
+	size_t max_callframes_size = 1 << 14;
+	size_t max_stack_size = 1 << 17;
+	// a runtime error prints this many of the innermost and of the
+	// outermost frames, the ones in between are counted in a single line
+	size_t trace_frames = 16;
+	// calls and loop iterations after which a function is compiled to
+	// machine code, 0 disables the JIT. builds without jit::supported
+	// ignore it
+	uint32_t jit_threshold = 0;
+	// concatenations of at least this many characters make a rope, whose
+	// characters are only copied once print, a comparison or a native reads
+	// them. see ObjString
+	size_t rope_threshold = 256;
+	// enters the native code chunks were given before they were loaded,
+	// set by the executables lox --emit-cpp makes. it runs in every build
+	bool native_code = false;
+	// code interpret(source) compiles and runs. the register backend runs
+	// the stack code instead when any of it did not verify, the JIT only
+	// compiles stack code
+	Backend backend = Backend::STACK;
+	// profile interpret(source) specialises the code with, not owned by
+	// the VM
+	const profile::Profile *profile = nullptr;
+	// interpret(source) compiles function bodies on their first call, see
+	// Compiler::lazy
+	bool lazy = false;
 
   private:
+	VMHooks *hooks = nullptr;
+	// tracer installed by the DEBUG_trace_* build options
+	std::unique_ptr<VMHooks> default_hooks;
 	bool had_error = false;
-	std::vector<std::unique_ptr<CallFrame>> callFrames;
-	std::vector<std::unique_ptr<Value>> stack;
-	std::unordered_map<std::string, Value> globals;
-	std::span<const std::byte>::iterator ip;
+	// false once the verifier rejected code loaded into this VM
+	bool verified_code = true;
+	// false once code without register code was loaded into this VM
+	bool register_code = true;
+	std::string error_message;
+	std::pmr::vector<CallFrame> callFrames;
+	std::pmr::vector<Value> stack;
+	Value *stackTop = nullptr;
+	// end of the slots written since the last collection, the ones above
+	// the top are cleared by it so no popped value outlives its object
+	const Value *stack_high = nullptr;
+	// upvalues still pointing into the stack, sorted by their slot
+	std::pmr::vector<std::shared_ptr<ObjUpvalue>> open_upvalues;
+	// globals are resolved to their slot when the code is loaded, the names
+	// are only kept for natives, later REPL lines and error messages
+	std::pmr::unordered_map<std::pmr::string, uint32_t> global_slots;
+	std::pmr::vector<std::pmr::string> global_names;
+	std::pmr::vector<Value> globals;
 };
 } // namespace lox
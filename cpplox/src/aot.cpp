@@ -0,0 +1,507 @@
+#include <cpplox/aot.hpp>
+#include <cpplox/compiler.hpp>
+#include <cpplox/opcodes.hpp>
+#include <cpplox/profile.hpp>
+#include <cpplox/verifier.hpp>
+#include <cpplox/vm.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+namespace lox::aot {
+
+namespace {
+
+// longer functions are left to the interpreter, C++ compilers take time
+// and memory that grow faster than the length of the function
+constexpr size_t max_instructions = 10000;
+
+// calls the visitor with the function and the functions nested in its
+// constants
+template <typename Visitor>
+void forEachFunction(const ObjFunction &function, Visitor &visitor) {
+	visitor(function);
+	for (const auto &constant : function.chunk->constants()) {
+		if (!constant.isObj()) {
+			continue;
+		}
+		if (const auto *nested =
+		        std::get_if<ObjFunction>(&constant.asObj().value);
+		    nested) {
+			forEachFunction(*nested, visitor);
+		}
+	}
+}
+
+// C++ string literal of the text, split after every newline. octal escapes
+// take at most three digits, so they never run into the next character
+std::string literal(std::string_view text) {
+	std::string result = "\"";
+	for (char c : text) {
+		auto byte = static_cast<unsigned char>(c);
+		if (c == '"' || c == '\\') {
+			result += '\\';
+			result += c;
+		} else if (c == '\n') {
+			result += "\\n\"\n    \"";
+		} else if (byte < 0x20 || byte >= 0x7f) {
+			result += std::format("\\{:03o}", byte);
+		} else {
+			result += c;
+		}
+	}
+	return result + '"';
+}
+
+// the constant as a C++ expression, nullopt for objects, which are read
+// from the constants of the chunk
+std::optional<std::string> immediate(const Value &value) {
+	if (value.isInt()) {
+		return std::format("lox::Value{{int64_t{{{}}}}}", value.asInt());
+	}
+	if (value.isNumber()) {
+		// the bits keep every double exact, NaN and -0 included
+		return std::format("lox::Value{{std::bit_cast<double>(0x{:x}ull)}}",
+		                   std::bit_cast<uint64_t>(value.asNumber()));
+	}
+	if (value.isBool()) {
+		return value.asBool() ? "lox::Value{true}" : "lox::Value{false}";
+	}
+	if (value.isNil()) {
+		return "lox::Value{}";
+	}
+	return std::nullopt;
+}
+
+std::string_view operation(OpCode instruction) {
+	switch (instruction) {
+	case OpCode::OP_GREATER:
+		return "std::greater<>{}";
+	case OpCode::OP_GREATER_EQUAL:
+		return "std::greater_equal<>{}";
+	case OpCode::OP_LESS:
+		return "std::less<>{}";
+	case OpCode::OP_LESS_EQUAL:
+		return "std::less_equal<>{}";
+	case OpCode::OP_ADD:
+		return "lox::Add{}";
+	case OpCode::OP_SUBTRACT:
+		return "lox::Subtract{}";
+	case OpCode::OP_MULTIPLY:
+		return "lox::Multiply{}";
+	default:
+		return "lox::Divide{}";
+	}
+}
+
+// translates the decoded instructions of a chunk to the body of one C++
+// function. every stack position the verifier proved is a named reference to
+// its slot, so the compiler sees a fixed frame instead of a moving stack top.
+// copying the frame to locals where the function starts and back where it
+// leaves cost more at every call than the loops won from it. instructions
+// that call, capture, close or return, and operands of other types than the
+// fast paths cover, leave to the interpreter before they changed anything
+class Translator {
+  public:
+	Translator(const Chunk &chunk, std::vector<size_t> depths,
+	           size_t registers)
+	    : chunk(chunk), instructions(chunk.instructions()),
+	      depths(std::move(depths)), registers(registers) {}
+
+	void write(std::ostream &out, size_t index, std::string_view name) {
+		findLabels();
+		std::string body;
+		for (size_t i = 0; i < instructions.size(); ++i) {
+			if (depths[i] != unknown) {
+				body += translate(i);
+			}
+		}
+
+		out << std::format("// {}\nstatic lox::aot::Binding lox_binding_{};\n",
+		                   name, index);
+		out << std::format(
+		    "static constexpr std::array<uint32_t, {}> lox_entries_{} = {{",
+		    entries.size(), index);
+		for (auto entry : entries) {
+			out << std::format("{}, ", entry);
+		}
+		out << "};\n";
+		out << std::format("static uint32_t lox_function_{}(lox::jit::State "
+		                   "&state, uint32_t index) {{\n",
+		                   index);
+		out << std::format(
+		    "\t[[maybe_unused]] const lox::Instruction *code = "
+		    "lox_binding_{0}.code;\n"
+		    "\t[[maybe_unused]] const lox::Value *constants = "
+		    "lox_binding_{0}.constants;\n"
+		    "\tlox::Value *slots = state.slots;\n",
+		    index);
+		for (size_t i = 0; i < registers; ++i) {
+			out << std::format("\t[[maybe_unused]] lox::Value &r{0} = slots[{0}];\n",
+			                   i);
+		}
+		out << "\tswitch (index) {\n";
+		for (auto entry : entries) {
+			out << std::format("\tcase {}:\n\t\tgoto i{};\n", entry, entry);
+		}
+		out << "\tdefault:\n\t\treturn index;\n\t}\n";
+		out << body;
+		for (auto exit : exits) {
+			out << std::format("x{}:\n", exit);
+			out << std::format("\tstate.stackTop = slots + {};\n", depths[exit]);
+			out << std::format("\treturn {};\n", exit);
+		}
+		out << "}\n\n";
+	}
+
+  private:
+	static constexpr size_t unknown = SIZE_MAX;
+
+	static bool handled(OpCode instruction) {
+		switch (genericForm(instruction)) {
+		case OpCode::OP_CONSTANT:
+		case OpCode::OP_NIL:
+		case OpCode::OP_TRUE:
+		case OpCode::OP_FALSE:
+		case OpCode::OP_POP:
+		case OpCode::OP_GET_LOCAL:
+		case OpCode::OP_SET_LOCAL:
+		case OpCode::OP_GET_GLOBAL:
+		case OpCode::OP_DEFINE_GLOBAL:
+		case OpCode::OP_SET_GLOBAL:
+		case OpCode::OP_EQUAL:
+		case OpCode::OP_NOT_EQUAL:
+		case OpCode::OP_GREATER:
+		case OpCode::OP_GREATER_EQUAL:
+		case OpCode::OP_LESS:
+		case OpCode::OP_LESS_EQUAL:
+		case OpCode::OP_ADD:
+		case OpCode::OP_SUBTRACT:
+		case OpCode::OP_MULTIPLY:
+		case OpCode::OP_DIVIDE:
+		case OpCode::OP_NOT:
+		case OpCode::OP_NEGATE:
+		case OpCode::OP_PRINT:
+		case OpCode::OP_JUMP:
+		case OpCode::OP_JUMP_IF_FALSE:
+		case OpCode::OP_LOOP:
+		case OpCode::OP_JUMP_IF_FALSE_POP:
+		case OpCode::OP_LESS_JUMP:
+		case OpCode::OP_ADD_LOCALS:
+		case OpCode::OP_ADD_CONSTANT:
+		case OpCode::OP_INCREMENT_LOCAL:
+		case OpCode::OP_SET_LOCAL_POP:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// the interpreter enters native code when a frame starts or continues
+	// after a call and when a loop jumps back. the entries and the targets
+	// of jumps get a label
+	void findLabels() {
+		auto enter = [&](size_t index) {
+			if (index < instructions.size() && depths[index] != unknown &&
+			    handled(instructions[index].op)) {
+				entries.insert(index);
+			}
+		};
+		enter(0);
+		for (size_t i = 0; i < instructions.size(); ++i) {
+			auto op = instructions[i].op;
+			if (op == OpCode::OP_CALL || op == OpCode::OP_INVOKE ||
+			    op == OpCode::OP_SUPER_INVOKE) {
+				enter(i + 1);
+			} else if (op == OpCode::OP_LOOP) {
+				enter(instructions[i].operand);
+			}
+			if (opcodeInfo(op).isJump()) {
+				labels.insert(instructions[i].operand);
+			}
+		}
+		labels.insert(entries.begin(), entries.end());
+	}
+
+	std::string reg(size_t position) const {
+		return std::format("r{}", position);
+	}
+
+	std::string leave(size_t index) {
+		exits.insert(index);
+		return std::format("goto x{};", index);
+	}
+
+	// both operands are numbers or the instruction leaves
+	std::string numbers(size_t index, const std::string &a,
+	                    const std::string &b) {
+		return std::format("\tif (!{}.isNumber() || !{}.isNumber()) {}\n", a,
+		                   b, leave(index));
+	}
+
+	std::string translate(size_t index) {
+		const auto &instruction = instructions[index];
+		size_t depth = depths[index];
+		auto op = genericForm(instruction.op);
+		std::string code =
+		    labels.contains(index)
+		        ? std::format("i{}: // {}\n", index,
+		                      opcodeInfo(instruction.op).name)
+		        : std::format("\t// {}\n", opcodeInfo(instruction.op).name);
+		std::string top = depth > 0 ? reg(depth - 1) : "";
+		std::string second = depth > 1 ? reg(depth - 2) : "";
+		std::string push = reg(depth);
+		auto constant = [&](uint32_t operand) {
+			auto value = immediate(chunk.constants()[operand]);
+			return value ? *value : std::format("constants[{}]", operand);
+		};
+		auto global =
+		    std::format("state.globals[code[{}].operand2]", index);
+		auto jump = std::format("goto i{};", instruction.operand);
+
+		switch (op) {
+		case OpCode::OP_CONSTANT:
+			code += std::format("\t{} = {};\n", push,
+			                    constant(instruction.operand));
+			break;
+		case OpCode::OP_NIL:
+			code += std::format("\t{} = lox::Value{{}};\n", push);
+			break;
+		case OpCode::OP_TRUE:
+		case OpCode::OP_FALSE:
+			code += std::format("\t{} = lox::Value{{{}}};\n", push,
+			                    op == OpCode::OP_TRUE);
+			break;
+		case OpCode::OP_POP:
+			// the value is dead, its local is overwritten by the next push
+			break;
+		case OpCode::OP_GET_LOCAL:
+			code += std::format("\t{} = {};\n", push, reg(instruction.operand));
+			break;
+		case OpCode::OP_SET_LOCAL:
+			if (instruction.operand != depth - 1) {
+				code += std::format("\t{} = {};\n", reg(instruction.operand),
+				                    top);
+			}
+			break;
+		case OpCode::OP_GET_GLOBAL:
+			code += std::format("\tif ({}.isUndefined()) {}\n", global,
+			                    leave(index));
+			code += std::format("\t{} = {};\n", push, global);
+			break;
+		case OpCode::OP_DEFINE_GLOBAL:
+			code += std::format("\t{} = std::move({});\n", global, top);
+			break;
+		case OpCode::OP_SET_GLOBAL:
+			code += std::format("\tif ({}.isUndefined()) {}\n", global,
+			                    leave(index));
+			code += std::format("\t{} = {};\n", global, top);
+			break;
+		case OpCode::OP_EQUAL:
+		case OpCode::OP_NOT_EQUAL:
+			code += std::format("\t{0} = lox::Value{{{2}{0}.equals({1})}};\n",
+			                    second, top,
+			                    op == OpCode::OP_NOT_EQUAL ? "!" : "");
+			break;
+		case OpCode::OP_DIVIDE:
+			// division by zero is reported by the interpreter
+			code += std::format("\tif ({}.isNumber() && {}.asNumber() == 0) "
+			                    "{}\n",
+			                    top, top, leave(index));
+			[[fallthrough]];
+		case OpCode::OP_GREATER:
+		case OpCode::OP_GREATER_EQUAL:
+		case OpCode::OP_LESS:
+		case OpCode::OP_LESS_EQUAL:
+		case OpCode::OP_ADD:
+		case OpCode::OP_SUBTRACT:
+		case OpCode::OP_MULTIPLY:
+			code += numbers(index, second, top);
+			code += std::format("\t{0} = lox::numberResult({0}, {1}, {2});\n",
+			                    second, top, operation(op));
+			break;
+		case OpCode::OP_NOT:
+			code += std::format("\t{0} = lox::Value{{!{0}.isTruthy()}};\n", top);
+			break;
+		case OpCode::OP_NEGATE:
+			code += std::format("\tif (!{}.isNumber()) {}\n", top, leave(index));
+			// integer zero negates to -0, which only the double can hold
+			code += std::format("\t{0} = {0}.isInt() && {0}.asInt() != 0 ? "
+			                    "lox::Value{{-{0}.asInt()}} : "
+			                    "lox::Value{{-{0}.asNumber()}};\n",
+			                    top);
+			break;
+		case OpCode::OP_PRINT:
+			code += std::format(
+			    "\tstd::cout << std::format(\"{{}}\\n\", {}.toString());\n", top);
+			break;
+		case OpCode::OP_JUMP:
+		case OpCode::OP_LOOP:
+			code += std::format("\t{}\n", jump);
+			break;
+		case OpCode::OP_JUMP_IF_FALSE:
+		case OpCode::OP_JUMP_IF_FALSE_POP:
+			code += std::format("\tif (!{}.isTruthy()) {}\n", top, jump);
+			break;
+		case OpCode::OP_LESS_JUMP:
+			code += numbers(index, second, top);
+			code += std::format("\tif (!lox::numberResult({}, {}, "
+			                    "std::less<>{{}}).isTruthy()) {}\n",
+			                    second, top, jump);
+			break;
+		case OpCode::OP_ADD_LOCALS: {
+			auto a = reg(instruction.operand);
+			auto b = reg(instruction.operand2);
+			code += numbers(index, a, b);
+			code += std::format("\t{} = lox::numberResult({}, {}, lox::Add{{}});\n",
+			                    push, a, b);
+			break;
+		}
+		case OpCode::OP_ADD_CONSTANT:
+		case OpCode::OP_INCREMENT_LOCAL: {
+			auto target = op == OpCode::OP_ADD_CONSTANT
+			                  ? top
+			                  : reg(instruction.operand);
+			auto operand = op == OpCode::OP_ADD_CONSTANT ? instruction.operand
+			                                             : instruction.operand2;
+			if (!chunk.constants()[operand].isNumber()) {
+				code += std::format("\t{}\n", leave(index));
+				break;
+			}
+			code += std::format("\tif (!{}.isNumber()) {}\n", target,
+			                    leave(index));
+			code += std::format("\t{0} = lox::numberResult({0}, {1}, "
+			                    "lox::Add{{}});\n",
+			                    target, constant(operand));
+			break;
+		}
+		case OpCode::OP_SET_LOCAL_POP:
+			if (instruction.operand != depth - 1) {
+				code += std::format("\t{} = std::move({});\n",
+				                    reg(instruction.operand), top);
+			}
+			break;
+		default:
+			code += std::format("\t{}\n", leave(index));
+			break;
+		}
+		return code;
+	}
+
+	const Chunk &chunk;
+	std::span<const Instruction> instructions;
+	std::vector<size_t> depths;
+	size_t registers;
+	std::set<size_t> entries;
+	std::set<size_t> labels;
+	std::set<size_t> exits;
+};
+
+} // namespace
+
+void emit(const ObjFunction &script, std::string_view source,
+          std::ostream &out) {
+	out << "// generated by lox --emit-cpp, links against cpplox\n"
+	       "#include <cpplox/aot.hpp>\n\n"
+	       "#include <array>\n"
+	       "#include <bit>\n"
+	       "#include <cstdint>\n"
+	       "#include <format>\n"
+	       "#include <functional>\n"
+	       "#include <iostream>\n"
+	       "#include <string_view>\n"
+	       "#include <utility>\n\n";
+	std::vector<std::string> table;
+	auto translate = [&](const ObjFunction &function) {
+		const auto &chunk = *function.chunk;
+		if (chunk.instructions().size() > max_instructions) {
+			return;
+		}
+		// the receiver of a method sits in the slot below its arguments
+		size_t arity = function.arity + function.isMethod;
+		auto registers = verifier::verify(chunk, arity);
+		auto depths = verifier::stackDepths(chunk, arity);
+		if (!registers.has_value() || !depths.has_value()) {
+			return;
+		}
+		auto key = profile::keyOf(function.name, chunk);
+		size_t index = table.size();
+		Translator(chunk, std::move(*depths), *registers)
+		    .write(out, index, key.name);
+		table.push_back(std::format(
+		    "\t{{{}, 0x{:x}ull, &lox_binding_{}, lox_function_{}, "
+		    "lox_entries_{}}},\n",
+		    literal(key.name), key.hash, index, index, index));
+	};
+	forEachFunction(script, translate);
+
+	out << std::format("static const std::array<lox::aot::Function, {}> "
+	                   "lox_functions = {{{{\n",
+	                   table.size());
+	for (const auto &entry : table) {
+		out << entry;
+	}
+	out << "}};\n\n";
+	out << std::format("static const char lox_source[] =\n    {};\n\n",
+	                   literal(source));
+	out << "int main() {\n"
+	       "\treturn lox::aot::run(\n"
+	       "\t    std::string_view(lox_source, sizeof(lox_source) - 1),\n"
+	       "\t    lox_functions);\n"
+	       "}\n";
+}
+
+int run(std::string_view source, std::span<const Function> functions) {
+	VM vm;
+	vm.native_code = true;
+	Compiler compiler;
+	compiler.heap = &vm.heap;
+	auto script = compiler.compile(source);
+	if (!script.has_value()) {
+		return 65;
+	}
+	auto &function = script->get();
+	function.name = "<script>";
+	auto bind = [&](const ObjFunction &nested) {
+		auto key = profile::keyOf(nested.name, *nested.chunk);
+		auto match = std::ranges::find_if(functions, [&](const Function &f) {
+			return f.name == key.name && f.hash == key.hash;
+		});
+		if (match == functions.end()) {
+			return;
+		}
+		auto instructions = nested.chunk->instructions();
+		match->binding->code = instructions.data();
+		match->binding->constants = nested.chunk->constants().data();
+		std::vector<uint32_t> entries(instructions.size(), UINT32_MAX);
+		for (auto entry : match->entries) {
+			if (entry < entries.size()) {
+				entries[entry] = 0;
+			}
+		}
+		nested.chunk->setNative(
+		    std::make_shared<jit::Code>(match->run, std::move(entries)));
+	};
+	forEachFunction(function, bind);
+
+	switch (vm.interpret(function)) {
+	case InterpretResult::COMPILE_ERROR:
+		return 65;
+	case InterpretResult::RUNTIME_ERROR:
+		return 70;
+	default:
+		return 0;
+	}
+}
+
+} // namespace lox::aot
@@ -1,16 +1,33 @@
 #include <cpplox/chunk.hpp>
+#include <cpplox/jit.hpp>
+#include <cpplox/obj.hpp>
 
+#include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
 #include <span>
+#include <utility>
+#include <variant>
 
 namespace lox {
+
+Chunk::Chunk(std::pmr::memory_resource *resource)
+    : m_code(resource), m_lines(resource), m_constants(resource),
+      m_strings(resource), m_captures(resource) {}
+
 void Chunk::write(std::byte byte, size_t line) {
+	m_instructions.reset();
+	m_caches.reset();
+	m_native.reset();
+	m_registers.reset();
+	m_max_stack.reset();
 	m_code.push_back(static_cast<std::byte>(byte));
 	if (m_lines.empty() || std::get<0>(m_lines.back()) != line) {
-		m_lines.push_back({line, 1});
-	} else {
-		++std::get<1>(m_lines.back());
+		m_lines.push_back({line, m_code.size() - 1});
 	}
 }
 void Chunk::writeConstant(const Value &value, size_t line) {
@@ -19,42 +36,213 @@ void Chunk::writeConstant(const Value &value, size_t line) {
 		write(static_cast<std::byte>(OpCode::OP_CONSTANT), line);
 		write(static_cast<std::byte>(index), line);
 	} else {
-		write(static_cast<std::byte>(OpCode::OP_CONSTANT_LONG), line);
-		write(static_cast<std::byte>(index >> 8), line);
-		write(static_cast<std::byte>(index & 0x00ff), line);
+		write(static_cast<std::byte>(OpCode::OP_WIDE), line);
+		write(static_cast<std::byte>(OpCode::OP_CONSTANT), line);
+		for (size_t i = 4; i-- > 0;) {
+			write(static_cast<std::byte>(index >> (8 * i) & 0xff), line);
+		}
 	}
 }
 
 size_t Chunk::addConstant(const Value &value) {
-	m_constants.emplace_back(value.clone());
+	if (value.isObj() &&
+	    std::holds_alternative<ObjString>(value.asObj().value)) {
+		auto [it, inserted] =
+		    m_strings.try_emplace(&value.asObj(), m_constants.size());
+		if (!inserted) {
+			return it->second;
+		}
+	}
+	m_constants.push_back(value);
 	return m_constants.size() - 1;
 }
 
+size_t Chunk::addCapture(Capture capture) {
+	if (auto it = std::ranges::find(m_captures, capture);
+	    it != m_captures.end()) {
+		return std::distance(m_captures.begin(), it);
+	}
+	m_captures.push_back(capture);
+	return m_captures.size() - 1;
+}
+
+void Chunk::clearCode() {
+	m_instructions.reset();
+	m_caches.reset();
+	m_native.reset();
+	m_registers.reset();
+	m_max_stack.reset();
+	m_code.clear();
+	m_lines.clear();
+}
+
 bool Chunk::patchByte(size_t offset, std::byte byte) {
 	if (offset >= m_code.size()) {
 		return false;
 	}
+	m_instructions.reset();
+	m_caches.reset();
+	m_native.reset();
+	m_registers.reset();
+	m_max_stack.reset();
 	m_code[offset] = byte;
 	return true;
 }
 
 std::span<const std::byte> Chunk::code() const { return m_code; }
 std::size_t Chunk::getLine(std::size_t offset) const {
-	size_t line = 1;
-	for (const auto &[lineNumber, count] : m_lines) {
-		if (offset < count) {
-			return lineNumber;
-		}
-		offset -= count;
+	if (offset >= m_code.size()) {
+		return 1;
 	}
-	return line;
+	// last run that starts at or before the offset
+	auto run = std::ranges::upper_bound(
+	    m_lines, offset, {}, [](const auto &run) { return std::get<1>(run); });
+	return std::get<0>(*std::prev(run));
 }
 std::span<const Value> Chunk::constants() const { return m_constants; }
 
+std::span<const Capture> Chunk::captures() const { return m_captures; }
+
+std::span<Instruction> Chunk::instructions() const {
+	if (m_instructions) {
+		return *m_instructions;
+	}
+	auto *resource = m_code.get_allocator().resource();
+	std::pmr::vector<Instruction> instructions(resource);
+	uint32_t caches = 0;
+	// byte offset just past each instruction, jumps are relative to it
+	std::vector<size_t> ends;
+	// instruction index for each byte offset, including the end of the code
+	std::vector<uint32_t> indices(m_code.size() + 1, UINT32_MAX);
+	for (size_t offset = 0; offset < m_code.size();) {
+		size_t start = offset;
+		bool wide = m_code[offset] == static_cast<std::byte>(OpCode::OP_WIDE);
+		if (wide && offset + 1 < m_code.size()) {
+			++offset;
+		}
+		// unknown bytes and dangling prefixes decode as OP_WIDE, which the VM
+		// rejects when it reaches them
+		auto instruction = isOpCode(m_code[offset])
+		                       ? static_cast<OpCode>(m_code[offset])
+		                       : OpCode::OP_WIDE;
+		if (instruction == OpCode::OP_WIDE) {
+			wide = false;
+		}
+		const auto &info = opcodeInfo(instruction);
+		++offset;
+		std::array<uint32_t, 2> operands{};
+		for (size_t i = 0; i < info.operandCount(); ++i) {
+			for (size_t byte = 0; byte < info.operandWidth(i, wide); ++byte) {
+				uint32_t value = offset < m_code.size()
+				                     ? static_cast<uint8_t>(m_code[offset])
+				                     : 0;
+				operands[i] = operands[i] << 8 | value;
+				++offset;
+			}
+		}
+		indices[start] = instructions.size();
+		instructions.push_back({.op = instruction,
+		                        .operand = operands[0],
+		                        .operand2 = operands[1],
+		                        .offset = static_cast<uint32_t>(start)});
+		if (info.flags == OpCodeFlags::CACHED) {
+			instructions.back().cache = caches++;
+		}
+		ends.push_back(offset);
+	}
+	indices[m_code.size()] = instructions.size();
+	// guard at the end of the stream, malformed jumps and code that does not
+	// end in a return leave the function with nil instead of running off
+	size_t end = instructions.size();
+	uint32_t last = m_code.empty() ? 0 : m_code.size() - 1;
+	instructions.push_back({.op = OpCode::OP_NIL, .offset = last});
+	instructions.push_back({.op = OpCode::OP_RETURN, .offset = last});
+
+	for (size_t i = 0; i < end; ++i) {
+		auto &instruction = instructions[i];
+		auto kind = opcodeInfo(instruction.op).operands[0];
+		size_t target;
+		if (kind == OperandKind::JUMP) {
+			target = ends[i] + instruction.operand;
+		} else if (kind == OperandKind::LOOP) {
+			target = ends[i] - instruction.operand;
+		} else {
+			continue;
+		}
+		bool valid = target < indices.size() && indices[target] != UINT32_MAX;
+		instruction.operand = valid ? indices[target] : end;
+	}
+
+	std::pmr::polymorphic_allocator<> allocator{resource};
+	m_instructions = std::allocate_shared<std::pmr::vector<Instruction>>(
+	    allocator, std::move(instructions));
+	m_caches =
+	    std::allocate_shared<std::pmr::vector<PropertyCache>>(allocator, caches);
+	return *m_instructions;
+}
+
+std::span<PropertyCache> Chunk::caches() const {
+	if (!m_caches) {
+		instructions();
+	}
+	return *m_caches;
+}
+
+std::span<const PropertyCache> Chunk::builtCaches() const {
+	if (!m_caches) {
+		return {};
+	}
+	return *m_caches;
+}
+
+const PropertyCache::Entry *PropertyCache::add(Entry entry) {
+	size_t index = count < ways ? count++ : ways - 1;
+	entries[index] = std::move(entry);
+	return &entries[index];
+}
+
+std::optional<size_t> Chunk::maxStack() const { return m_max_stack; }
+
+void Chunk::setMaxStack(size_t depth) { m_max_stack = depth; }
+
+const jit::Code *Chunk::native() const { return m_native.get(); }
+
+void Chunk::setNative(std::shared_ptr<const jit::Code> code) const {
+	m_native = std::move(code);
+}
+
+RegChunk *Chunk::registers() const { return m_registers.get(); }
+
+void Chunk::setRegisters(std::shared_ptr<RegChunk> code) {
+	m_registers = std::move(code);
+}
+
+bool Chunk::countHot(uint32_t threshold) const {
+	if (m_warmth >= threshold) {
+		m_warmth = 0;
+		m_hotness = threshold;
+		return true;
+	}
+	return ++m_hotness == threshold;
+}
+
+void Chunk::warm(uint64_t hotness) const { m_warmth = hotness; }
+
+const LazyFunction *Chunk::lazy() const { return m_lazy.get(); }
+
+void Chunk::setLazy(std::shared_ptr<const LazyFunction> body) {
+	m_lazy = std::move(body);
+}
+
+bool Chunk::mark(uint64_t epoch) const {
+	return std::exchange(m_marked, epoch) != epoch;
+}
+
 bool Chunk::operator==(const Chunk &other) const {
 	if (m_code.size() != other.m_code.size() ||
 	    m_constants.size() != other.m_constants.size() ||
-	    m_lines.size() != other.m_lines.size()) {
+	    m_lines.size() != other.m_lines.size() ||
+	    m_captures != other.m_captures) {
 		return false;
 	}
 	for (size_t i = 0; i < m_code.size(); ++i) {
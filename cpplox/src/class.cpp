@@ -0,0 +1,54 @@
+#include <cpplox/class.hpp>
+#include <cpplox/value.hpp>
+
+#include <format>
+
+namespace lox {
+
+std::optional<uint32_t> Shape::find(std::string_view name) const {
+	if (auto it = m_slots.find(name); it != m_slots.end()) {
+		return it->second;
+	}
+	return std::nullopt;
+}
+
+Shape *Shape::withField(std::string_view name) {
+	if (auto it = m_transitions.find(name); it != m_transitions.end()) {
+		return it->second.get();
+	}
+	// every shape holds all of its slots, lookups never walk the chain
+	auto next = std::make_unique<Shape>();
+	next->m_slots = m_slots;
+	next->m_slots.emplace(name, static_cast<uint32_t>(m_slots.size()));
+	return m_transitions.emplace(name, std::move(next)).first->second.get();
+}
+
+size_t Shape::size() const { return m_slots.size(); }
+
+ObjClass::ObjClass(std::string_view name) : name(name) {}
+
+const ObjFunction *ObjClass::findMethod(std::string_view name) const {
+	if (auto it = methods.find(name); it != methods.end()) {
+		return &it->second;
+	}
+	return nullptr;
+}
+
+std::string ObjClass::toString() const { return name; }
+
+namespace {
+
+ObjClass &classOf(const Value &klass) {
+	return *std::get<std::shared_ptr<ObjClass>>(klass.asObj().value);
+}
+
+} // namespace
+
+ObjInstance::ObjInstance(Value klass, std::pmr::memory_resource *resource)
+    : klass(klass), shape(&classOf(klass).root), fields(resource) {}
+
+std::string ObjInstance::toString() const {
+	return std::format("{} instance", classOf(klass).name);
+}
+
+} // namespace lox
@@ -2,9 +2,13 @@
 #include <cpplox/compiler.hpp>
 #include <cpplox/debug.hpp>
 #include <cpplox/obj.hpp>
+#include <cpplox/peephole.hpp>
+#include <cpplox/profile.hpp>
+#include <cpplox/registers.hpp>
 #include <cpplox/scanner.hpp>
 #include <cpplox/value.hpp>
 
+#include <charconv>
 #include <cstddef>
 #include <cstdint>
 #include <format>
@@ -13,10 +17,10 @@
 #include <ranges>
 #include <vector>
 
+// integer from_chars is available everywhere, only the floating point one
+// is missing on apple clang
 #if defined(__APPLE__) && defined(__clang__)
 #include <cstdio>
-#else
-#include <charconv>
 #endif
 
 namespace lox {
@@ -34,6 +38,14 @@ Compiler::Compiler(Compiler *enclosing, FunctionType type)
 		parser = enclosing->parser;
 		// copy the scanner state from the enclosing compiler
 		scanner = enclosing->scanner;
+		currentClass = enclosing->currentClass;
+		backend = enclosing->backend;
+		profile = enclosing->profile;
+		lazy = enclosing->lazy;
+		source = enclosing->source;
+		heap = &enclosing->objects();
+		function = ObjFunction{heap->resource()};
+		rootFunction();
 	}
 
 	if (type != FunctionType::TYPE_SCRIPT) {
@@ -41,6 +53,33 @@ Compiler::Compiler(Compiler *enclosing, FunctionType type)
 	}
 }
 
+Compiler::~Compiler() {
+	if (rooted != nullptr) {
+		rooted->removeRoot(&function);
+	}
+}
+
+Heap &Compiler::objects() {
+	if (heap != nullptr) {
+		return *heap;
+	}
+	if (own_heap == nullptr) {
+		own_heap = std::make_unique<Heap>();
+	}
+	return *own_heap;
+}
+
+void Compiler::rootFunction() {
+	if (rooted == nullptr) {
+		rooted = &objects();
+		rooted->addRoot(&function);
+	}
+}
+
+Value Compiler::stringValue(std::string_view text) {
+	return objects().intern(text);
+}
+
 Compiler::parseRuleArray &Compiler::getRules() {
 	static parseRuleArray rules;
 	return rules;
@@ -65,6 +104,8 @@ void Compiler::initializeRules() {
 	// TOKEN_RIGHT_BRACE
 	// TOKEN_COMMA
 	// TOKEN_DOT
+	rules[static_cast<size_t>(Token::TokenType::TOKEN_DOT)] = {
+	    nullptr, &Compiler::dot, Precedence::PREC_CALL};
 	// TOKEN_MINUS
 	rules[static_cast<size_t>(Token::TokenType::TOKEN_MINUS)] = {
 	    &Compiler::unary, &Compiler::binary, Precedence::PREC_TERM};
@@ -143,7 +184,11 @@ void Compiler::initializeRules() {
 	// TOKEN_PRINT
 	// TOKEN_RETURN
 	// TOKEN_SUPER
+	rules[static_cast<size_t>(Token::TokenType::TOKEN_SUPER)] = {
+	    &Compiler::super_, nullptr, Precedence::PREC_NONE};
 	// TOKEN_THIS
+	rules[static_cast<size_t>(Token::TokenType::TOKEN_THIS)] = {
+	    &Compiler::this_, nullptr, Precedence::PREC_NONE};
 	// TOKEN_TRUE
 	rules[static_cast<size_t>(Token::TokenType::TOKEN_TRUE)] = {
 	    &Compiler::literal, nullptr, Precedence::PREC_NONE};
@@ -225,76 +270,124 @@ void Compiler::emmitBytes(std::span<std::byte> bytes) {
 	}
 }
 
-void Compiler::emmitLoop(size_t loopStart) {
-	emmitByte(static_cast<std::byte>(OpCode::OP_LOOP));
-
-	Chunk &chunk = currentChunk();
+void Compiler::emmitOperand(size_t value, size_t width) {
+	// operands are stored big endian
+	for (size_t i = width; i-- > 0;) {
+		emmitByte(static_cast<std::byte>(value >> (8 * i) & 0xff));
+	}
+}
 
-	size_t offset = chunk.code().size() - loopStart + 2;
-	if (offset > UINT16_MAX) {
+void Compiler::emmitLoop(size_t loopStart) {
+	const auto &info = opcodeInfo(OpCode::OP_LOOP);
+	size_t end = currentChunk().code().size();
+	// the distance is already known, so the short form is used if it fits
+	bool wide = end + info.size(false) - loopStart > UINT16_MAX;
+	size_t offset = wide ? end + 1 + info.size(true) - loopStart
+	                     : end + info.size(false) - loopStart;
+	if (offset > UINT32_MAX) {
 		error("Loop body too large");
 	}
 
-	chunk.write(static_cast<std::byte>(offset >> 8), parser.previous.line);
-	chunk.write(static_cast<std::byte>(offset & 0xff), parser.previous.line);
+	if (wide) {
+		emmitByte(static_cast<std::byte>(OpCode::OP_WIDE));
+	}
+	emmitByte(static_cast<std::byte>(OpCode::OP_LOOP));
+	emmitOperand(offset, info.operandWidth(0, wide));
 }
 
 size_t Compiler::emmitJump(OpCode instruction) {
+	// the distance is not known yet, so forward jumps start out wide and the
+	// peephole pass shrinks them once the code is complete
+	emmitByte(static_cast<std::byte>(OpCode::OP_WIDE));
 	emmitByte(static_cast<std::byte>(instruction));
-	emmitByte(static_cast<std::byte>(0xff));
-	emmitByte(static_cast<std::byte>(0xff));
-	return currentChunk().code().size() - 2;
+	emmitOperand(UINT32_MAX, 4);
+	return currentChunk().code().size() - 4;
 }
 
 void Compiler::emmitReturn() {
-	emmitByte(static_cast<std::byte>(OpCode::OP_NIL));
+	// initializers return the instance they initialized
+	if (type == FunctionType::TYPE_INITIALIZER) {
+		emmitIndexed(OpCode::OP_GET_LOCAL, 0);
+	} else {
+		emmitByte(static_cast<std::byte>(OpCode::OP_NIL));
+	}
 	emmitByte(static_cast<std::byte>(OpCode::OP_RETURN));
 }
 
-std::vector<std::byte> Compiler::makeConstant(const Value &value) {
-	auto index = currentChunk().addConstant(value);
-	// depending on the index size we use OP_CONSTANT or OP_CONSTANT_LONG
-	auto opcode =
-	    index > UINT8_MAX ? OpCode::OP_CONSTANT_LONG : OpCode::OP_CONSTANT;
-	// check that we did not exeed the 2byte limit
-	if (index > UINT16_MAX) {
+void Compiler::emmitIndexed(OpCode instruction, size_t index) {
+	// indices that do not fit a byte get the OP_WIDE prefix and 32 bits
+	if (index > UINT32_MAX) {
+		error("Too many constants in one chunk");
+		return;
+	}
+	bool wide = index > UINT8_MAX;
+	if (wide) {
+		emmitByte(static_cast<std::byte>(OpCode::OP_WIDE));
+	}
+	emmitByte(static_cast<std::byte>(instruction));
+	emmitOperand(index, opcodeInfo(instruction).operandWidth(0, wide));
+}
+
+void Compiler::emmitInvoke(OpCode instruction, size_t name, uint8_t argCount) {
+	// the prefix widens the argument count along with the name
+	if (name > UINT32_MAX) {
 		error("Too many constants in one chunk");
-		return {static_cast<std::byte>(OpCode::OP_RETURN)};
+		return;
 	}
-	// then push the opcode along with the byte(s) of the constant
-	std::vector<std::byte> bytes;
-	bytes.push_back(static_cast<std::byte>(opcode));
-	// for OP_CONSTANT_LONG we need to push 2 bytes and for OP_CONSTANT 1 byte
-	if (opcode == OpCode::OP_CONSTANT_LONG) {
-		bytes.push_back(static_cast<std::byte>(index >> 8));
+	const auto &info = opcodeInfo(instruction);
+	bool wide = name > UINT8_MAX;
+	if (wide) {
+		emmitByte(static_cast<std::byte>(OpCode::OP_WIDE));
 	}
-	bytes.push_back(static_cast<std::byte>(index & 0xff));
-	return bytes;
+	emmitByte(static_cast<std::byte>(instruction));
+	emmitOperand(name, info.operandWidth(0, wide));
+	emmitOperand(argCount, info.operandWidth(1, wide));
+}
+
+size_t Compiler::makeConstant(const Value &value) {
+	return currentChunk().addConstant(value);
 }
 
 void Compiler::emmitConstant(const Value &value) {
-	auto bytes = makeConstant(value);
-	emmitBytes(bytes);
+	emmitIndexed(OpCode::OP_CONSTANT, makeConstant(value));
 }
 
 void Compiler::patchJump(size_t offset) {
 	Chunk &chunk = currentChunk();
-	// -2 to adjust for the bytecode for the jump offset itself
-	size_t jump = chunk.code().size() - offset - 2;
-	if (jump > UINT16_MAX) {
+	// -4 to adjust for the bytecode for the jump offset itself
+	size_t jump = chunk.code().size() - offset - 4;
+	if (jump > UINT32_MAX) {
 		error("Too much code to jump over");
 	}
-	chunk.patchByte(offset, static_cast<std::byte>(jump >> 8));
-	chunk.patchByte(offset + 1, static_cast<std::byte>(jump & 0xff));
+	for (size_t i = 0; i < 4; ++i) {
+		chunk.patchByte(offset + i,
+		                static_cast<std::byte>(jump >> (8 * (3 - i)) & 0xff));
+	}
 }
 
 ObjFunction &Compiler::endCompiler() {
 	ObjFunction &function = this->function;
+	emmitReturn();
+	if (!parser.hadError) {
+		peephole::optimize(currentChunk());
+		if (backend == Backend::REGISTER) {
+			// the receiver of a method sits in the slot below its arguments
+			currentChunk().setRegisters(registers::generate(
+			    currentChunk(), function.arity + function.isMethod));
+		}
+		// after the register code, which is made from the generic forms
+		if (profile != nullptr) {
+			profile->apply(function.name, currentChunk());
+		}
+	}
 	if (debug_print_code && !parser.hadError) {
-		debug::ChunkDisassembly(
-		    currentChunk(), function.name.empty() ? "<script>" : function.name);
+		std::string_view name =
+		    function.name.empty() ? "<script>" : function.name;
+		debug::ChunkDisassembly(currentChunk(), name);
+		if (currentChunk().registers() != nullptr) {
+			debug::RegChunkDisassembly(currentChunk(), name);
+		}
 	}
-	emmitReturn();
 	if (enclosing != nullptr) {
 		// restore the parser and scanner state to the enclosing compiler
 		enclosing->parser = parser;
@@ -309,7 +402,9 @@ void Compiler::endScope() {
 	scope.depth--;
 
 	while (!scope.locals.empty() && scope.locals.back().depth > scope.depth) {
-		emmitByte(static_cast<std::byte>(OpCode::OP_POP));
+		emmitByte(static_cast<std::byte>(scope.locals.back().isCaptured
+		                                     ? OpCode::OP_CLOSE_UPVALUE
+		                                     : OpCode::OP_POP));
 		scope.locals.pop_back();
 	}
 }
@@ -375,6 +470,54 @@ void Compiler::call(bool canAssign) {
 	uint8_t argCount = argumentList();
 	emmitByte(static_cast<std::byte>(OpCode::OP_CALL));
 	emmitByte(static_cast<std::byte>(argCount));
+	lastCallEnd = currentChunk().code().size();
+}
+
+void Compiler::dot(bool canAssign) {
+	consume(Token::TokenType::TOKEN_IDENTIFIER,
+	        "Expect property name after '.'");
+	size_t name = identifierConstant(parser.previous);
+
+	if (canAssign && match(Token::TokenType::TOKEN_EQUAL)) {
+		expression();
+		emmitIndexed(OpCode::OP_SET_PROPERTY, name);
+	} else if (match(Token::TokenType::TOKEN_LEFT_PAREN)) {
+		uint8_t argCount = argumentList();
+		emmitInvoke(OpCode::OP_INVOKE, name, argCount);
+	} else {
+		emmitIndexed(OpCode::OP_GET_PROPERTY, name);
+	}
+}
+
+void Compiler::this_(bool canAssign) {
+	if (currentClass == nullptr) {
+		error("Can't use 'this' outside of a class.");
+		return;
+	}
+	variable(false);
+}
+
+void Compiler::super_(bool canAssign) {
+	if (currentClass == nullptr) {
+		error("Can't use 'super' outside of a class.");
+	} else if (!currentClass->hasSuperclass) {
+		error("Can't use 'super' in a class with no superclass.");
+	}
+
+	consume(Token::TokenType::TOKEN_DOT, "Expect '.' after 'super'");
+	consume(Token::TokenType::TOKEN_IDENTIFIER,
+	        "Expect superclass method name");
+	size_t name = identifierConstant(parser.previous);
+
+	namedVariable(syntheticToken("this"), false);
+	if (match(Token::TokenType::TOKEN_LEFT_PAREN)) {
+		uint8_t argCount = argumentList();
+		namedVariable(syntheticToken("super"), false);
+		emmitInvoke(OpCode::OP_SUPER_INVOKE, name, argCount);
+	} else {
+		namedVariable(syntheticToken("super"), false);
+		emmitIndexed(OpCode::OP_GET_SUPER, name);
+	}
 }
 
 void Compiler::grouping(bool canAssign) {
@@ -383,6 +526,19 @@ void Compiler::grouping(bool canAssign) {
 }
 
 void Compiler::number(bool canAssign) {
+	std::string_view lexeme = parser.previous.lexeme;
+	// integral literals in the integer range are stored as integers
+	if (lexeme.find('.') == std::string_view::npos) {
+		int64_t integer;
+		auto result = std::from_chars(lexeme.data(),
+		                              lexeme.data() + lexeme.size(), integer);
+		if (result.ec == std::errc{} &&
+		    result.ptr == lexeme.data() + lexeme.size() &&
+		    integer <= Value::max_int) {
+			emmitConstant(Value{integer});
+			return;
+		}
+	}
 	double value;
 // apparently for apple clang 16, there is not support for std::from_chars
 // for float types, so we use sscanf as a fallback instead
@@ -410,42 +566,26 @@ void Compiler::number(bool canAssign) {
 }
 
 void Compiler::namedVariable(Token name, bool canAssign) {
-	std::vector<std::byte> bytes;
 	OpCode getOp, setOp;
 	int arg = resolveLocal(name);
-	// depending on the size we use OP_GET_GLOBAL or OP_GET_GLOBAL_LONG
-	if (arg > UINT16_MAX) {
-		error("Too many variables in one chunk");
-		return;
-	}
-
 	if (arg != -1) {
-		getOp =
-		    arg > UINT8_MAX ? OpCode::OP_GET_LOCAL_LONG : OpCode::OP_GET_LOCAL;
-		setOp =
-		    arg > UINT8_MAX ? OpCode::OP_SET_LOCAL_LONG : OpCode::OP_SET_LOCAL;
+		getOp = OpCode::OP_GET_LOCAL;
+		setOp = OpCode::OP_SET_LOCAL;
+	} else if (arg = resolveUpvalue(name); arg != -1) {
+		getOp = OpCode::OP_GET_UPVALUE;
+		setOp = OpCode::OP_SET_UPVALUE;
 	} else {
 		arg = identifierConstant(name);
-		getOp = arg > UINT8_MAX ? OpCode::OP_GET_GLOBAL_LONG
-		                        : OpCode::OP_GET_GLOBAL;
-		setOp = arg > UINT8_MAX ? OpCode::OP_SET_GLOBAL_LONG
-		                        : OpCode::OP_SET_GLOBAL;
+		getOp = OpCode::OP_GET_GLOBAL;
+		setOp = OpCode::OP_SET_GLOBAL;
 	}
 
-	OpCode opcode;
 	if (canAssign && match(Token::TokenType::TOKEN_EQUAL)) {
 		expression();
-		opcode = setOp;
+		emmitIndexed(setOp, arg);
 	} else {
-		opcode = getOp;
-	}
-
-	bytes.push_back(static_cast<std::byte>(opcode));
-	if (opcode == OpCode::OP_GET_GLOBAL_LONG) {
-		bytes.push_back(static_cast<std::byte>(arg >> 8));
+		emmitIndexed(getOp, arg);
 	}
-	bytes.push_back(static_cast<std::byte>(arg & 0xff));
-	emmitBytes(bytes);
 }
 
 void Compiler::variable(bool canAssign) {
@@ -456,7 +596,7 @@ void Compiler::string(bool canAssign) {
 	// remove the quotes from the string
 	auto str =
 	    parser.previous.lexeme.substr(1, parser.previous.lexeme.size() - 2);
-	emmitConstant(Value{str});
+	emmitConstant(stringValue(str));
 }
 
 void Compiler::unary(bool canAssign) {
@@ -499,20 +639,13 @@ void Compiler::parsePrecedence(Precedence precedence) {
 }
 
 size_t Compiler::identifierConstant(Token name) {
-	std::vector<std::byte> value = makeConstant(Value{name.lexeme});
-	// we reconstruct the bytes to an size_t
-	// ignore the first byte which is the opcode
-	value.erase(value.begin());
-	// then check that we did not exeed the size_t limit
-	if (value.size() > sizeof(size_t)) {
-		error("Too many constants in one chunk");
-		return 0;
-	}
-	size_t index = 0;
-	for (auto byte : value) {
-		index = (index << 8) | static_cast<size_t>(byte);
-	}
-	return index;
+	return makeConstant(stringValue(name.lexeme));
+}
+
+Token Compiler::syntheticToken(std::string_view text) {
+	return Token{.type = Token::TokenType::TOKEN_IDENTIFIER,
+	             .lexeme = text,
+	             .line = parser.previous.line};
 }
 
 bool Compiler::identifiersEqual(const Token &a, const Token &b) {
@@ -534,6 +667,29 @@ int Compiler::resolveLocal(const Token &token) {
 	return -1;
 }
 
+int Compiler::resolveUpvalue(const Token &name) {
+	if (enclosing == nullptr) {
+		return -1;
+	}
+	// a local of the enclosing function is captured from its frame, anything
+	// further out through the upvalues of the enclosing closure
+	Capture capture;
+	if (int local = enclosing->resolveLocal(name); local != -1) {
+		enclosing->scope.locals[local].isCaptured = true;
+		capture = {.index = static_cast<uint32_t>(local), .isLocal = true};
+	} else if (int upvalue = enclosing->resolveUpvalue(name); upvalue != -1) {
+		capture = {.index = static_cast<uint32_t>(upvalue), .isLocal = false};
+	} else {
+		return -1;
+	}
+	size_t index = currentChunk().addCapture(capture);
+	if (index >= UINT16_MAX) {
+		error("Too many closure variables in function");
+		return 0;
+	}
+	return static_cast<int>(index);
+}
+
 void Compiler::addLocal(Token name) {
 	if (scope.locals.size() == UINT16_MAX) {
 		error("Too many local variables in function");
@@ -582,20 +738,7 @@ void Compiler::defineVariable(size_t global) {
 		return;
 	}
 
-	// depending on the size we use OP_DEFINE_GLOBAL or OP_DEFINE_GLOBAL_LONG
-	auto opcode = global > UINT8_MAX ? OpCode::OP_DEFINE_GLOBAL_LONG
-	                                 : OpCode::OP_DEFINE_GLOBAL;
-	if (global > UINT16_MAX) {
-		error("Too many variables in one chunk");
-		return;
-	}
-	std::vector<std::byte> bytes;
-	bytes.push_back(static_cast<std::byte>(opcode));
-	if (opcode == OpCode::OP_DEFINE_GLOBAL_LONG) {
-		bytes.push_back(static_cast<std::byte>(global >> 8));
-	}
-	bytes.push_back(static_cast<std::byte>(global & 0xff));
-	emmitBytes(bytes);
+	emmitIndexed(OpCode::OP_DEFINE_GLOBAL, global);
 }
 
 uint8_t Compiler::argumentList() {
@@ -648,38 +791,188 @@ void Compiler::block() {
 }
 
 void Compiler::functionDefinition(FunctionType type) {
+	if (lazy && skipFunction(type)) {
+		return;
+	}
 	Compiler compiler{this, type};
-	compiler.beginScope();
+	compiler.functionBody();
+	auto &function = compiler.endCompiler();
+	emmitIndexed(OpCode::OP_CLOSURE,
+	             makeConstant(objects().allocate(Obj{function})));
+}
 
-	compiler.consume(Token::TokenType::TOKEN_LEFT_PAREN,
-	                 "Expect '(' after function name");
-	if (!compiler.check(Token::TokenType::TOKEN_RIGHT_PAREN)) {
+void Compiler::functionBody() {
+	beginScope();
+	// the receiver of a method is its first local
+	if (type == FunctionType::TYPE_METHOD ||
+	    type == FunctionType::TYPE_INITIALIZER) {
+		function.isMethod = true;
+		addLocal(syntheticToken("this"));
+		markInitialized();
+	}
+
+	consume(Token::TokenType::TOKEN_LEFT_PAREN,
+	        "Expect '(' after function name");
+	if (!check(Token::TokenType::TOKEN_RIGHT_PAREN)) {
 		do {
-			compiler.function.arity++;
-			if (compiler.function.arity > 255) {
-				compiler.errorAtCurrent("Can't have more than 255 parameters.");
+			function.arity++;
+			if (function.arity > 255) {
+				errorAtCurrent("Can't have more than 255 parameters.");
 			}
-			size_t constant = compiler.parseVariable("Expect parameter name");
-			compiler.defineVariable(constant);
-		} while (compiler.match(Token::TokenType::TOKEN_COMMA));
+			size_t constant = parseVariable("Expect parameter name");
+			defineVariable(constant);
+		} while (match(Token::TokenType::TOKEN_COMMA));
 	}
 
-	compiler.consume(Token::TokenType::TOKEN_RIGHT_PAREN,
-	                 "Expect ')' after parameters");
-	compiler.consume(Token::TokenType::TOKEN_LEFT_BRACE,
-	                 "Expect '{' before function body");
-	compiler.block();
+	consume(Token::TokenType::TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
+	consume(Token::TokenType::TOKEN_LEFT_BRACE,
+	        "Expect '{' before function body");
+	block();
+}
 
-	auto &function = compiler.endCompiler();
-	std::vector<std::byte> bytes = makeConstant(Value{function.clone()});
-	// check the first value to see if we need to use OP_CLOSURE or
-	// OP_CLOSURE_LONG
-	if (static_cast<OpCode>(bytes[0]) == OpCode::OP_CONSTANT) {
-		bytes[0] = static_cast<std::byte>(OpCode::OP_CLOSURE);
-	} else {
-		bytes[0] = static_cast<std::byte>(OpCode::OP_CLOSURE);
+bool Compiler::skipFunction(FunctionType type) {
+	using enum Token::TokenType;
+	if (source == nullptr || !check(TOKEN_LEFT_PAREN)) {
+		return false;
 	}
-	emmitBytes(bytes);
+	// the tokens are read from a copy of the scanner, so a function that has
+	// to be compiled now is compiled from its start and reports its errors
+	Scanner skipper = scanner;
+	Token open = parser.current;
+	size_t arity = 0;
+	Token token = skipper.scanToken();
+	while (token.type != TOKEN_RIGHT_PAREN) {
+		if (token.type != TOKEN_IDENTIFIER || ++arity > 255) {
+			return false;
+		}
+		token = skipper.scanToken();
+		if (token.type == TOKEN_COMMA) {
+			token = skipper.scanToken();
+		} else if (token.type != TOKEN_RIGHT_PAREN) {
+			return false;
+		}
+	}
+	if (skipper.scanToken().type != TOKEN_LEFT_BRACE) {
+		return false;
+	}
+	// brace matching up to the end of the body, looking for the names it
+	// would capture. names shadowed inside the body are counted as well
+	for (size_t depth = 1; depth > 0;) {
+		token = skipper.scanToken();
+		switch (token.type) {
+		case TOKEN_LEFT_BRACE:
+			++depth;
+			break;
+		case TOKEN_RIGHT_BRACE:
+			--depth;
+			break;
+		case TOKEN_IDENTIFIER:
+			if (namesEnclosingLocal(token)) {
+				return false;
+			}
+			break;
+		case TOKEN_THIS:
+			// only a method has a receiver of its own
+			if (type == FunctionType::TYPE_FUNCTION) {
+				return false;
+			}
+			break;
+		case TOKEN_SUPER:
+		case TOKEN_ERROR:
+		case TOKEN_EOF:
+			return false;
+		default:
+			break;
+		}
+	}
+
+	ObjFunction function{objects().resource()};
+	function.name = parser.previous.lexeme;
+	function.arity = arity;
+	function.isMethod = type == FunctionType::TYPE_METHOD ||
+	                    type == FunctionType::TYPE_INITIALIZER;
+	function.chunk->setLazy(std::make_shared<const LazyFunction>(LazyFunction{
+	    .source = source,
+	    .offset = static_cast<size_t>(open.lexeme.data() - source->data()),
+	    .line = open.line,
+	    .type = type,
+	    .backend = backend,
+	    .profile = profile,
+	    .heap = &objects(),
+	}));
+	// continue after the closing brace, as if the body had been compiled
+	scanner = skipper;
+	parser.previous = token;
+	advance();
+	emmitIndexed(OpCode::OP_CLOSURE,
+	             makeConstant(objects().allocate(Obj{std::move(function)})));
+	return true;
+}
+
+bool Compiler::namesEnclosingLocal(const Token &name) {
+	for (Compiler *compiler = this; compiler != nullptr;
+	     compiler = compiler->enclosing) {
+		for (const auto &local : compiler->scope.locals) {
+			if (identifiersEqual(local.name, name)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void Compiler::method() {
+	consume(Token::TokenType::TOKEN_IDENTIFIER, "Expect method name");
+	size_t name = identifierConstant(parser.previous);
+	FunctionType type = parser.previous.lexeme == "init"
+	                        ? FunctionType::TYPE_INITIALIZER
+	                        : FunctionType::TYPE_METHOD;
+	functionDefinition(type);
+	emmitIndexed(OpCode::OP_METHOD, name);
+}
+
+void Compiler::classDeclaration() {
+	consume(Token::TokenType::TOKEN_IDENTIFIER, "Expect class name");
+	Token className = parser.previous;
+	size_t nameConstant = identifierConstant(className);
+	declareVariable();
+
+	emmitIndexed(OpCode::OP_CLASS, nameConstant);
+	defineVariable(nameConstant);
+
+	ClassScope classScope{.enclosing = currentClass};
+	currentClass = &classScope;
+
+	if (match(Token::TokenType::TOKEN_LESS)) {
+		consume(Token::TokenType::TOKEN_IDENTIFIER, "Expect superclass name");
+		variable(false);
+		if (identifiersEqual(className, parser.previous)) {
+			error("A class can't inherit from itself.");
+		}
+		// the superclass stays on the stack as a local the methods capture
+		beginScope();
+		addLocal(syntheticToken("super"));
+		defineVariable(0);
+
+		namedVariable(className, false);
+		emmitByte(static_cast<std::byte>(OpCode::OP_INHERIT));
+		classScope.hasSuperclass = true;
+	}
+
+	// the class stays on the stack while its methods are added
+	namedVariable(className, false);
+	consume(Token::TokenType::TOKEN_LEFT_BRACE, "Expect '{' before class body");
+	while (!check(Token::TokenType::TOKEN_RIGHT_BRACE) &&
+	       !check(Token::TokenType::TOKEN_EOF)) {
+		method();
+	}
+	consume(Token::TokenType::TOKEN_RIGHT_BRACE, "Expect '}' after class body");
+	emmitByte(static_cast<std::byte>(OpCode::OP_POP));
+
+	if (classScope.hasSuperclass) {
+		endScope();
+	}
+	currentClass = classScope.enclosing;
 }
 
 void Compiler::funDeclaration() {
@@ -727,8 +1020,7 @@ void Compiler::forStatement() {
 		consume(Token::TokenType::TOKEN_SEMICOLON,
 		        "Expect ';' after loop condition");
 
-		exitJump = emmitJump(OpCode::OP_JUMP_IF_FALSE);
-		emmitByte(static_cast<std::byte>(OpCode::OP_POP));
+		exitJump = emmitJump(OpCode::OP_JUMP_IF_FALSE_POP);
 	}
 
 	if (!match(Token::TokenType::TOKEN_RIGHT_PAREN)) {
@@ -749,7 +1041,6 @@ void Compiler::forStatement() {
 
 	if (exitJump != -1) {
 		patchJump(exitJump);
-		emmitByte(static_cast<std::byte>(OpCode::OP_POP));
 	}
 
 	endScope();
@@ -760,20 +1051,18 @@ void Compiler::ifStatement() {
 	expression();
 	consume(Token::TokenType::TOKEN_RIGHT_PAREN, "Expect ')' after condition");
 
-	size_t thenJump = emmitJump(OpCode::OP_JUMP_IF_FALSE);
-	emmitByte(static_cast<std::byte>(OpCode::OP_POP));
+	// the condition is popped on both paths by the jump itself
+	size_t thenJump = emmitJump(OpCode::OP_JUMP_IF_FALSE_POP);
 	statement();
 
-	size_t elseJump = emmitJump(OpCode::OP_JUMP);
-
-	patchJump(thenJump);
-	emmitByte(static_cast<std::byte>(OpCode::OP_POP));
-
 	if (match(Token::TokenType::TOKEN_ELSE)) {
+		size_t elseJump = emmitJump(OpCode::OP_JUMP);
+		patchJump(thenJump);
 		statement();
+		patchJump(elseJump);
+	} else {
+		patchJump(thenJump);
 	}
-
-	patchJump(elseJump);
 }
 
 void Compiler::printStatement() {
@@ -790,9 +1079,19 @@ void Compiler::returnStatement() {
 	if (match(Token::TokenType::TOKEN_SEMICOLON)) {
 		emmitReturn();
 	} else {
+		if (type == FunctionType::TYPE_INITIALIZER) {
+			error("Can't return a value from an initializer.");
+		}
 		expression();
 		consume(Token::TokenType::TOKEN_SEMICOLON,
 		        "Expect ';' after return value");
+		// the call is in tail position when nothing was emitted after it,
+		// jumps over it from `and`/`or` still land on the return below
+		Chunk &chunk = currentChunk();
+		if (lastCallEnd == chunk.code().size()) {
+			chunk.patchByte(lastCallEnd - 2,
+			                static_cast<std::byte>(OpCode::OP_TAIL_CALL));
+		}
 		emmitByte(static_cast<std::byte>(OpCode::OP_RETURN));
 	}
 }
@@ -804,13 +1103,11 @@ void Compiler::whileStatement() {
 	expression();
 	consume(Token::TokenType::TOKEN_RIGHT_PAREN, "Expect ')' after condition");
 
-	size_t exitJump = emmitJump(OpCode::OP_JUMP_IF_FALSE);
-	emmitByte(static_cast<std::byte>(OpCode::OP_POP));
+	size_t exitJump = emmitJump(OpCode::OP_JUMP_IF_FALSE_POP);
 	statement();
 	emmitLoop(loopStart);
 
 	patchJump(exitJump);
-	emmitByte(static_cast<std::byte>(OpCode::OP_POP));
 }
 
 void Compiler::synchronize() {
@@ -838,7 +1135,9 @@ void Compiler::synchronize() {
 }
 
 void Compiler::declaration() {
-	if (match(Token::TokenType::TOKEN_FUN)) {
+	if (match(Token::TokenType::TOKEN_CLASS)) {
+		classDeclaration();
+	} else if (match(Token::TokenType::TOKEN_FUN)) {
 		funDeclaration();
 	} else if (match(Token::TokenType::TOKEN_VAR)) {
 		varDeclaration();
@@ -875,10 +1174,15 @@ auto Compiler::compile(std::string_view source, FunctionType type)
     -> std::expected<std::reference_wrapper<ObjFunction>, std::string> {
 	// reset the compiler state
 	parser = Parser{};
-	scanner = Scanner{source};
+	// skipped bodies are compiled later from their own copy of the source
+	this->source =
+	    lazy ? std::make_shared<const std::string>(source) : nullptr;
+	scanner = Scanner{lazy ? std::string_view{*this->source} : source};
 	scope = CompilerScope{};
-	function = ObjFunction{};
+	function = ObjFunction{objects().resource()};
 	this->type = type;
+	currentClass = nullptr;
+	rootFunction();
 	advance();
 
 	while (!match(Token::TokenType::TOKEN_EOF)) {
@@ -891,4 +1195,33 @@ auto Compiler::compile(std::string_view source, FunctionType type)
 	                                       std::string>{function};
 }
 
+bool Compiler::compileBody(const ObjFunction &function) {
+	const LazyFunction &body = *function.chunk->lazy();
+	Compiler compiler{nullptr, body.type};
+	compiler.lazy = true;
+	compiler.source = body.source;
+	compiler.backend = body.backend;
+	compiler.profile = body.profile;
+	compiler.heap = body.heap;
+	compiler.function = ObjFunction{body.heap->resource()};
+	compiler.rootFunction();
+	compiler.scanner = Scanner{*body.source, body.offset, body.line};
+	compiler.function.name = function.name;
+	// methods only need the class for `this`, bodies that use `super` are
+	// never skipped
+	ClassScope classScope;
+	if (function.isMethod) {
+		compiler.currentClass = &classScope;
+	}
+	compiler.advance();
+	compiler.functionBody();
+	auto &compiled = compiler.endCompiler();
+	if (compiler.parser.hadError) {
+		return false;
+	}
+	// replaces the skipped body, the compiler keeps the source alive
+	*function.chunk = std::move(*compiled.chunk);
+	return true;
+}
+
 } // namespace lox
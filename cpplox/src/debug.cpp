@@ -2,14 +2,20 @@
 #include <cpplox/debug.hpp>
 #include <cpplox/terminal.hpp>
 #include <cpplox/value.hpp>
+#include <cpplox/vm.hpp>
 
+#include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <format>
 #include <iostream>
 #include <iterator>
+#include <ranges>
 #include <span>
+#include <string>
 #include <string_view>
+#include <vector>
 
 namespace lox::debug {
 
@@ -19,28 +25,25 @@ std::byte nextByte(std::span<const std::byte>::iterator &ip) { return *++ip; }
 
 std::byte peekByte(std::span<const std::byte>::iterator &ip) { return *ip; }
 
-size_t getAddress(std::span<const std::byte>::iterator &ip) {
-	auto instruction = static_cast<lox::OpCode>(*ip);
-	size_t address = static_cast<uint8_t>(nextByte(ip));
-	[[unlikely]]
-	if (instruction == OpCode::OP_CONSTANT_LONG ||
-	    instruction == OpCode::OP_GET_LOCAL_LONG ||
-	    instruction == OpCode::OP_SET_LOCAL_LONG ||
-	    instruction == OpCode::OP_GET_GLOBAL_LONG ||
-	    instruction == OpCode::OP_DEFINE_GLOBAL_LONG ||
-	    instruction == OpCode::OP_SET_GLOBAL_LONG ||
-	    instruction == OpCode::OP_JUMP ||
-	    instruction == OpCode::OP_JUMP_IF_FALSE ||
-	    instruction == OpCode::OP_LOOP ||
-	    instruction == OpCode::OP_CLOSURE_LONG) {
+std::string_view OpCodeName(OpCode instruction) {
+	if (!isOpCode(static_cast<std::byte>(instruction))) {
+		return "OP_UNKWN";
+	}
+	return opcodeInfo(instruction).name;
+}
+
+size_t getAddress(std::span<const std::byte>::iterator &ip, size_t width) {
+	size_t address = 0;
+	for (size_t i = 0; i < width; ++i) {
 		address = address << 8 | static_cast<uint8_t>(nextByte(ip));
 	}
 	return address;
 }
 
 void ConstantInstruction(std::string_view name, const lox::Chunk &chunk,
-                         std::span<const std::byte>::iterator &ip) {
-	size_t address = getAddress(ip);
+                         std::span<const std::byte>::iterator &ip,
+                         size_t width) {
+	size_t address = getAddress(ip, width);
 
 	std::string valueString = "?INVALID?";
 	if (address < chunk.constants().size()) {
@@ -53,23 +56,91 @@ void ConstantInstruction(std::string_view name, const lox::Chunk &chunk,
 	    cli::terminal::yellow_colored(std::format("{}", valueString)));
 }
 
+void ClosureInstruction(std::string_view name, const lox::Chunk &chunk,
+                        std::span<const std::byte>::iterator &ip,
+                        size_t width) {
+	auto start = ip;
+	ConstantInstruction(name, chunk, ip, width);
+	size_t address = getAddress(start, width);
+	if (address >= chunk.constants().size() ||
+	    !chunk.constants()[address].isObj()) {
+		return;
+	}
+	const auto *function =
+	    std::get_if<ObjFunction>(&chunk.constants()[address].asObj().value);
+	if (function == nullptr) {
+		return;
+	}
+	// one line per captured variable
+	for (const auto &capture : function->chunk->captures()) {
+		std::cout << std::format(
+		    "      {}{:<17} {}\n", cli::terminal::gray_colored("   | "),
+		    capture.isLocal ? "local" : "upvalue",
+		    cli::terminal::gray_colored(std::format("{:<4d}", capture.index)));
+	}
+}
+
+void InvokeInstruction(std::string_view name, const lox::Chunk &chunk,
+                       std::span<const std::byte>::iterator &ip, size_t width,
+                       size_t countWidth) {
+	size_t address = getAddress(ip, width);
+	size_t argCount = getAddress(ip, countWidth);
+
+	std::string valueString = "?INVALID?";
+	if (address < chunk.constants().size()) {
+		valueString = chunk.constants()[address].toString();
+	}
+	std::cout << std::format(
+	    "{:<26} {} ({} args) '{}'\n", cli::terminal::cyan_colored(name),
+	    cli::terminal::gray_colored(std::format("{:<4d}", address)), argCount,
+	    cli::terminal::yellow_colored(valueString));
+}
+
 void SimpleInstruction(std::string_view name,
                        std::span<const std::byte>::iterator &ip) {
 	std::cout << std::format("{}\n", cli::terminal::cyan_colored(name));
 }
 
 void ByteInstruction(std::string_view name, const lox::Chunk &chunk,
-                     std::span<const std::byte>::iterator &ip) {
-	size_t address = getAddress(ip);
+                     std::span<const std::byte>::iterator &ip, size_t width) {
+	size_t address = getAddress(ip, width);
 
 	std::cout << std::format(
 	    "{:<26} {}\n", cli::terminal::cyan_colored(name),
 	    cli::terminal::gray_colored(std::format("{:<4d}", address)));
 }
 
+void TwoByteInstruction(std::string_view name, const lox::Chunk &chunk,
+                        std::span<const std::byte>::iterator &ip) {
+	auto first = static_cast<uint8_t>(nextByte(ip));
+	auto second = static_cast<uint8_t>(nextByte(ip));
+
+	std::cout << std::format(
+	    "{:<26} {} {}\n", cli::terminal::cyan_colored(name),
+	    cli::terminal::gray_colored(std::format("{:<4d}", first)),
+	    cli::terminal::gray_colored(std::format("{:<4d}", second)));
+}
+
+void LocalConstantInstruction(std::string_view name, const lox::Chunk &chunk,
+                              std::span<const std::byte>::iterator &ip) {
+	auto local = static_cast<uint8_t>(nextByte(ip));
+	auto address = static_cast<uint8_t>(nextByte(ip));
+
+	std::string valueString = "?INVALID?";
+	if (address < chunk.constants().size()) {
+		valueString = chunk.constants()[address].toString();
+	}
+	std::cout << std::format(
+	    "{:<26} {} {} '{}'\n", cli::terminal::cyan_colored(name),
+	    cli::terminal::gray_colored(std::format("{:<4d}", local)),
+	    cli::terminal::gray_colored(std::format("{:<4d}", address)),
+	    cli::terminal::yellow_colored(valueString));
+}
+
 void JumpInstruction(std::string_view name, const lox::Chunk &chunk,
-                     std::span<const std::byte>::iterator &ip, int sign) {
-	size_t jump = getAddress(ip);
+                     std::span<const std::byte>::iterator &ip, int sign,
+                     size_t width) {
+	size_t jump = getAddress(ip, width);
 	size_t baseoffset = std::distance(chunk.code().begin(), ip);
 	size_t offset = baseoffset + sign * jump + 1;
 	std::cout << std::format(
@@ -87,7 +158,6 @@ void InstructionDisassembly(const lox::Chunk &chunk,
 	std::cout << std::format(
 	    "{}{}", cli::terminal::orange_colored("#"),
 	    cli::terminal::green_colored(std::format("{:04X} ", offset)));
-	auto instruction = static_cast<lox::OpCode>(peekByte(ip));
 	// print line
 	if (offset > 0 && chunk.getLine(offset) == chunk.getLine(offset - 1)) {
 		std::cout << cli::terminal::gray_colored("   | ");
@@ -95,90 +165,52 @@ void InstructionDisassembly(const lox::Chunk &chunk,
 		std::cout << std::format("{:4d} ", chunk.getLine(offset));
 	}
 
-	switch (instruction) {
-	case OpCode::OP_CONSTANT:
-		return ConstantInstruction("OP_CONSTANT", chunk, ip);
-	case OpCode::OP_CONSTANT_LONG:
-		return ConstantInstruction("OP_CONSTANT_LONG", chunk, ip);
-	case OpCode::OP_NIL:
-		return SimpleInstruction("OP_NIL", ip);
-	case OpCode::OP_TRUE:
-		return SimpleInstruction("OP_TRUE", ip);
-	case OpCode::OP_FALSE:
-		return SimpleInstruction("OP_FALSE", ip);
-	case OpCode::OP_POP:
-		return SimpleInstruction("OP_POP", ip);
-	case OpCode::OP_GET_LOCAL:
-		return ByteInstruction("OP_GET_LOCAL", chunk, ip);
-	case OpCode::OP_GET_LOCAL_LONG:
-		return ByteInstruction("OP_GET_LOCAL_LONG", chunk, ip);
-	case OpCode::OP_SET_LOCAL:
-		return ByteInstruction("OP_SET_LOCAL", chunk, ip);
-	case OpCode::OP_SET_LOCAL_LONG:
-		return ByteInstruction("OP_SET_LOCAL_LONG", chunk, ip);
-	case OpCode::OP_GET_GLOBAL:
-		return ConstantInstruction("OP_GET_GLOBAL", chunk, ip);
-	case OpCode::OP_GET_GLOBAL_LONG:
-		return ConstantInstruction("OP_GET_GLOBAL_LONG", chunk, ip);
-	case OpCode::OP_DEFINE_GLOBAL:
-		return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, ip);
-	case OpCode::OP_DEFINE_GLOBAL_LONG:
-		return ConstantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, ip);
-	case OpCode::OP_SET_GLOBAL:
-		return ConstantInstruction("OP_SET_GLOBAL", chunk, ip);
-	case OpCode::OP_SET_GLOBAL_LONG:
-		return ConstantInstruction("OP_SET_GLOBAL_LONG", chunk, ip);
-	case OpCode::OP_EQUAL:
-		return SimpleInstruction("OP_EQUAL", ip);
-	case OpCode::OP_NOT_EQUAL:
-		return SimpleInstruction("OP_NOT_EQUAL", ip);
-	case OpCode::OP_GREATER:
-		return SimpleInstruction("OP_GREATER", ip);
-	case OpCode::OP_GREATER_EQUAL:
-		return SimpleInstruction("OP_GREATER_EQUAL", ip);
-	case OpCode::OP_LESS:
-		return SimpleInstruction("OP_LESS", ip);
-	case OpCode::OP_LESS_EQUAL:
-		return SimpleInstruction("OP_LESS_EQUAL", ip);
-	case OpCode::OP_ADD:
-		return SimpleInstruction("OP_ADD", ip);
-	case OpCode::OP_SUBTRACT:
-		return SimpleInstruction("OP_SUBTRACT", ip);
-	case OpCode::OP_MULTIPLY:
-		return SimpleInstruction("OP_MULTIPLY", ip);
-	case OpCode::OP_DIVIDE:
-		return SimpleInstruction("OP_DIVIDE", ip);
-	case OpCode::OP_NOT:
-		return SimpleInstruction("OP_NOT", ip);
-	case OpCode::OP_NEGATE:
-		return SimpleInstruction("OP_NEGATE", ip);
-	case OpCode::OP_PRINT:
-		return SimpleInstruction("OP_PRINT", ip);
-	case OpCode::OP_JUMP:
-		return JumpInstruction("OP_JUMP", chunk, ip, 1);
-	case OpCode::OP_JUMP_IF_FALSE:
-		return JumpInstruction("OP_JUMP_IF_FALSE", chunk, ip, 1);
-	case OpCode::OP_LOOP:
-		return JumpInstruction("OP_LOOP", chunk, ip, -1);
-	case OpCode::OP_CALL:
-		return ByteInstruction("OP_CALL", chunk, ip);
-	case OpCode::OP_CLOSURE:
-	case OpCode::OP_CLOSURE_LONG: {
-		auto address = getAddress(ip);
-		auto &value = chunk.constants()[address];
-		std::cout << std::format(
-		    "{:<26} {} {}\n",
-		    cli::terminal::cyan_colored(address > UINT8_MAX //
-		                                    ? "OP_CLOSURE_LONG"
-		                                    : "OP_CLOSURE"),
-		    cli::terminal::gray_colored(std::format("{:<4d}", address)),
-		    cli::terminal::yellow_colored(value.toString()));
+	// the prefix is shown as part of the instruction it widens
+	bool wide = peekByte(ip) == static_cast<std::byte>(OpCode::OP_WIDE) &&
+	            std::next(ip) != chunk.code().end();
+	if (wide) {
+		++ip;
 	}
-	case OpCode::OP_RETURN:
-		return SimpleInstruction("OP_RETURN", ip);
+	if (!isOpCode(peekByte(ip))) {
+		cli::terminal::logError(std::format(
+		    "OP_UNKWN ({:#04X})", static_cast<uint8_t>(peekByte(ip))));
+		return;
+	}
+	auto instruction = static_cast<lox::OpCode>(peekByte(ip));
+	const auto &info = opcodeInfo(instruction);
+	std::string name = wide ? std::format("{} (wide)", info.name)
+	                        : std::string(info.name);
+
+	size_t width = info.operandWidth(0, wide);
+	using enum OperandKind;
+	switch (info.operands[0]) {
+	case NONE:
+		return SimpleInstruction(name, ip);
+	case JUMP:
+		return JumpInstruction(name, chunk, ip, 1, width);
+	case LOOP:
+		return JumpInstruction(name, chunk, ip, -1, width);
+	case CONSTANT:
+		if (instruction == OpCode::OP_CLOSURE) {
+			return ClosureInstruction(name, chunk, ip, width);
+		}
+		if (info.operands[1] == COUNT) {
+			return InvokeInstruction(name, chunk, ip, width,
+			                         info.operandWidth(1, wide));
+		}
+		return ConstantInstruction(name, chunk, ip, width);
+	case COUNT:
+	case UPVALUE:
+		return ByteInstruction(name, chunk, ip, width);
+	case LOCAL:
+		if (info.operands[1] == LOCAL) {
+			return TwoByteInstruction(name, chunk, ip);
+		}
+		if (info.operands[1] == CONSTANT) {
+			return LocalConstantInstruction(name, chunk, ip);
+		}
+		return ByteInstruction(name, chunk, ip, width);
 	}
-	cli::terminal::logError(
-	    std::format("OP_UNKWN ({:#04X})", static_cast<uint8_t>(instruction)));
 }
 
 void ChunkDisassembly(const lox::Chunk &chunk, std::string_view name) {
@@ -190,4 +222,166 @@ void ChunkDisassembly(const lox::Chunk &chunk, std::string_view name) {
 	}
 }
 
+void RegInstructionDisassembly(const lox::Chunk &chunk, size_t index) {
+	const auto &instruction = chunk.registers()->code[index];
+	auto instructions = chunk.instructions();
+	size_t offset = instruction.source < instructions.size()
+	                    ? instructions[instruction.source].offset
+	                    : 0;
+	std::cout << std::format(
+	    "{}{}{:4d} ", cli::terminal::orange_colored("#"),
+	    cli::terminal::green_colored(std::format("{:04d} ", index)),
+	    chunk.getLine(offset));
+
+	auto constant = [&](uint32_t address) {
+		auto constants = chunk.constants();
+		std::string value = address < constants.size()
+		                        ? constants[address].toString()
+		                        : "?INVALID?";
+		return std::format(
+		    "{} '{}'", cli::terminal::gray_colored(std::format("k{}", address)),
+		    cli::terminal::yellow_colored(value));
+	};
+	const auto &info = regOpInfo(instruction.op);
+	std::array operands{instruction.a, instruction.b, instruction.c};
+	std::cout << std::format("{:<26}", cli::terminal::cyan_colored(info.name));
+	for (size_t i = 0; i < operands.size(); ++i) {
+		uint32_t operand = operands[i];
+		using enum RegOperandKind;
+		switch (info.operands[i]) {
+		case NONE:
+			continue;
+		case RK:
+			if (operand & constant_operand) {
+				std::cout << ' ' << constant(operand & ~constant_operand);
+				continue;
+			}
+			[[fallthrough]];
+		case REGISTER:
+			std::cout << ' '
+			          << cli::terminal::gray_colored(std::format("r{}", operand));
+			break;
+		case CONSTANT:
+			std::cout << ' ' << constant(operand);
+			break;
+		case GLOBAL:
+			break;
+		case UPVALUE:
+			std::cout << ' '
+			          << cli::terminal::gray_colored(std::format("u{}", operand));
+			break;
+		case COUNT:
+			std::cout << std::format(" ({} args)", operand);
+			break;
+		case TARGET:
+			std::cout << std::format(
+			    " {} {}", cli::terminal::gray_colored("->"),
+			    cli::terminal::green_colored(std::format("{:04d}", operand)));
+			break;
+		}
+	}
+	std::cout << '\n';
+}
+
+void RegChunkDisassembly(const lox::Chunk &chunk, std::string_view name) {
+	const auto *registers = chunk.registers();
+	std::cout << std::format(
+	    "{:=^34}\n",
+	    std::format(" {} ({} registers) ", name, registers->registers));
+	for (size_t index = 0; index < registers->code.size(); ++index) {
+		RegInstructionDisassembly(chunk, index);
+	}
+}
+
+void TraceHooks::beforeInstruction(const VM &vm, const Chunk &chunk,
+                                   const Instruction &instruction) {
+	if (trace_stack) {
+		std::string_view line_glyph = trace_instruction ? "|" : " ";
+		std::cout << std::format("{}  {}	",
+		                         cli::terminal::orange_colored("#STACK#"),
+		                         cli::terminal::gray_colored(line_glyph));
+		for (auto &slot : vm.stackView()) {
+			std::cout << std::format(
+			    "[ {} ]", cli::terminal::yellow_colored(slot.toString()));
+		}
+		std::cout << "\n";
+	}
+	if (trace_instruction) {
+		auto it = chunk.code().begin() + instruction.offset;
+		InstructionDisassembly(chunk, it);
+	}
+}
+
+void TraceHooks::beforeRegisterInstruction(const VM &vm, const Chunk &chunk,
+                                           const RegInstruction &instruction) {
+	// the frame window holds the registers
+	if (trace_stack && !vm.frames().empty()) {
+		std::string_view line_glyph = trace_instruction ? "|" : " ";
+		std::cout << std::format("{}  {}	",
+		                         cli::terminal::orange_colored("#REGS#"),
+		                         cli::terminal::gray_colored(line_glyph));
+		const Value *slots = vm.frames().back().slots;
+		for (size_t i = 0; i < chunk.registers()->registers; ++i) {
+			std::cout << std::format(
+			    "[ {} ]", cli::terminal::yellow_colored(slots[i].toString()));
+		}
+		std::cout << "\n";
+	}
+	if (trace_instruction) {
+		RegInstructionDisassembly(chunk,
+		                          &instruction - chunk.registers()->code.data());
+	}
+}
+
+void OpCodePairHooks::beforeInstruction(const VM &vm, const Chunk &chunk,
+                                        const Instruction &instruction) {
+	total++;
+	opcodes[instruction.op]++;
+	if (previous != nullptr && previous + 1 == &instruction) {
+		pairs[{previous->op, instruction.op}]++;
+	}
+	previous = &instruction;
+}
+
+void OpCodePairHooks::report(std::ostream &out, size_t limit) const {
+	auto percent = [this](size_t count) {
+		return total == 0 ? 0.0 : 100.0 * count / total;
+	};
+	auto byCount = [](const auto &a, const auto &b) {
+		return a.second > b.second;
+	};
+
+	out << std::format("Executed instructions: {}\n\n", total);
+
+	std::vector<std::pair<OpCode, size_t>> sortedOpcodes(opcodes.begin(),
+	                                                     opcodes.end());
+	std::ranges::sort(sortedOpcodes, byCount);
+	out << "| opcode | count | % |\n|---|---:|---:|\n";
+	for (const auto &[opcode, count] :
+	     sortedOpcodes | std::views::take(limit)) {
+		out << std::format("| {} | {} | {:.2f} |\n", OpCodeName(opcode), count,
+		                   percent(count));
+	}
+
+	std::vector<std::pair<std::pair<OpCode, OpCode>, size_t>> sortedPairs(
+	    pairs.begin(), pairs.end());
+	std::ranges::sort(sortedPairs, byCount);
+	out << "\n| pair | count | % |\n|---|---:|---:|\n";
+	for (const auto &[pair, count] : sortedPairs | std::views::take(limit)) {
+		out << std::format("| {} {} | {} | {:.2f} |\n", OpCodeName(pair.first),
+		                   OpCodeName(pair.second), count, percent(count));
+	}
+}
+
+void InstructionCountHooks::beforeInstruction(const VM &vm,
+                                              const Chunk &chunk,
+                                              const Instruction &instruction) {
+	executed++;
+}
+
+void InstructionCountHooks::beforeRegisterInstruction(
+    const VM &vm, const Chunk &chunk, const RegInstruction &instruction) {
+	executed++;
+}
+
 } // namespace lox::debug
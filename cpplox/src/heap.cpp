@@ -0,0 +1,239 @@
+#include <cpplox/chunk.hpp>
+#include <cpplox/class.hpp>
+#include <cpplox/heap.hpp>
+#include <cpplox/obj.hpp>
+#include <cpplox/value.hpp>
+#include <cpplox/vm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <utility>
+#include <variant>
+
+namespace lox {
+
+namespace {
+
+// epochs of every heap come from the same counter
+std::atomic<uint64_t> next_epoch{0};
+
+// memory the object holds when it is allocated, what it grows by later is
+// not counted
+size_t sizeOf(const Obj &object) {
+	size_t size = sizeof(Obj);
+	std::visit(overloads{
+	               [&size](const ObjString &value) {
+		               // ropes hold no characters until they are read
+		               size += value.isRope() ? 0 : value.chars().capacity();
+	               },
+	               [&size](const ObjFunction &value) {
+		               size += value.upvalues.capacity() *
+		                       sizeof(std::shared_ptr<ObjUpvalue>);
+	               },
+	               [&size](const std::shared_ptr<ObjClass> &) {
+		               size += sizeof(ObjClass);
+	               },
+	               [&size](const ObjInstance &value) {
+		               size += value.fields.capacity() * sizeof(Value);
+	               },
+	               [](const auto &) {},
+	           },
+	           object.value);
+	return size;
+}
+
+} // namespace
+
+Heap::Heap(std::pmr::memory_resource *resource)
+    : m_resource(resource), m_strings(resource) {}
+
+Heap::~Heap() {
+	std::pmr::polymorphic_allocator<Obj> allocator{m_resource};
+	while (m_objects != nullptr) {
+		allocator.delete_object(std::exchange(m_objects, m_objects->next));
+	}
+}
+
+Value Heap::allocate(Obj &&object) {
+	auto *allocated = std::pmr::polymorphic_allocator<Obj>{m_resource}
+	                      .new_object<Obj>(std::move(object));
+	allocated->size = sizeOf(*allocated);
+	allocated->next = m_objects;
+	m_objects = allocated;
+	m_stats.bytes_allocated += allocated->size;
+	++m_stats.objects_allocated;
+	return Value{allocated};
+}
+
+Obj *Heap::findString(std::string_view chars, size_t hash) const {
+	auto [begin, end] = m_strings.equal_range(hash);
+	for (auto it = begin; it != end; ++it) {
+		if (std::get<ObjString>(it->second->value).chars() == chars) {
+			return it->second;
+		}
+	}
+	return nullptr;
+}
+
+Value Heap::addString(std::pmr::string chars, size_t hash) {
+	Value string = allocate(Obj{ObjString{std::move(chars), hash}});
+	m_strings.emplace(hash, &string.asObj());
+	return string;
+}
+
+void Heap::forgetString(const Obj &string, size_t hash) {
+	auto [begin, end] = m_strings.equal_range(hash);
+	auto it = std::find_if(begin, end, [&string](const auto &entry) {
+		return entry.second == &string;
+	});
+	if (it != end) {
+		m_strings.erase(it);
+	}
+}
+
+Value Heap::intern(std::string_view chars) {
+	size_t hash = ObjString::hashOf(chars);
+	if (Obj *string = findString(chars, hash); string != nullptr) {
+		return Value{string};
+	}
+	return addString(std::pmr::string{chars, m_resource}, hash);
+}
+
+Value Heap::intern(std::pmr::string chars) {
+	size_t hash = ObjString::hashOf(chars);
+	if (Obj *string = findString(chars, hash); string != nullptr) {
+		return Value{string};
+	}
+	return addString(std::move(chars), hash);
+}
+
+void Heap::beginCollection() {
+	m_collection_start = std::chrono::steady_clock::now();
+	m_epoch = ++next_epoch;
+}
+
+void Heap::mark(const Value &value) {
+	if (!value.isObj()) {
+		return;
+	}
+	const Obj &object = value.asObj();
+	if (object.marked != m_epoch) {
+		object.marked = m_epoch;
+		m_gray.push_back(&object);
+	}
+}
+
+void Heap::mark(const ObjFunction &function) {
+	// closures made from the same function share the chunk, its constants
+	// and the classes its caches point to are only marked once
+	if (function.chunk != nullptr && function.chunk->mark(m_epoch)) {
+		for (const auto &constant : function.chunk->constants()) {
+			mark(constant);
+		}
+		for (const auto &cache : function.chunk->builtCaches()) {
+			for (size_t i = 0; i < cache.count; ++i) {
+				mark(cache.entries[i].owner);
+			}
+		}
+	}
+	// open upvalues point into the stack, whose slots are marked anyway
+	for (const auto &upvalue : function.upvalues) {
+		mark(*upvalue->location);
+	}
+}
+
+void Heap::trace(const ObjClass &klass) {
+	for (const auto &[name, method] : klass.methods) {
+		mark(method);
+	}
+	mark(klass.superclass);
+}
+
+void Heap::trace(const Obj &object) {
+	std::visit(overloads{
+	               [this](const ObjString &value) {
+		               mark(value.left());
+		               mark(value.right());
+	               },
+	               [this](const ObjFunction &value) { mark(value); },
+	               [this](const ObjClosure &value) {
+		               mark(value.function.get());
+	               },
+	               [this](const std::shared_ptr<ObjClass> &value) {
+		               trace(*value);
+	               },
+	               [this](const ObjInstance &value) {
+		               mark(value.klass);
+		               for (const auto &field : value.fields) {
+			               mark(field);
+		               }
+	               },
+	               [this](const ObjBoundMethod &value) {
+		               mark(value.receiver);
+		               mark(*value.method);
+	               },
+	               // natives hold no values
+	               [](const auto &) {},
+	           },
+	           object.value);
+}
+
+void Heap::endCollection() {
+	for (const auto *function : m_roots) {
+		mark(*function);
+	}
+	while (!m_gray.empty()) {
+		const Obj *object = m_gray.back();
+		m_gray.pop_back();
+		trace(*object);
+	}
+	sweep();
+
+	auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now() - m_collection_start);
+	++m_stats.collections;
+	m_stats.total_pause += pause;
+	m_stats.max_pause = std::max(m_stats.max_pause, pause);
+	m_next_collection =
+	    static_cast<size_t>(m_stats.bytesLive() * growth_factor);
+}
+
+void Heap::sweep() {
+	std::pmr::polymorphic_allocator<Obj> allocator{m_resource};
+	Obj **link = &m_objects;
+	while (*link != nullptr) {
+		Obj *object = *link;
+		if (object->marked == m_epoch) {
+			link = &object->next;
+			continue;
+		}
+		*link = object->next;
+		// ropes are never interned, and reading their hash would flatten
+		// them from strings this sweep may have freed already
+		if (const auto *string = std::get_if<ObjString>(&object->value);
+		    string != nullptr && !string->isRope()) {
+			forgetString(*object, string->hash());
+		}
+		m_stats.bytes_freed += object->size;
+		++m_stats.objects_freed;
+		allocator.delete_object(object);
+	}
+}
+
+void Heap::addRoot(const ObjFunction *function) {
+	m_roots.push_back(function);
+}
+
+void Heap::removeRoot(const ObjFunction *function) {
+	if (auto it = std::ranges::find(m_roots, function); it != m_roots.end()) {
+		m_roots.erase(it);
+	}
+}
+
+} // namespace lox
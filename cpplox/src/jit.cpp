@@ -0,0 +1,909 @@
+#include <cpplox/jit.hpp>
+#include <cpplox/opcodes.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <format>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#if CPPLOX_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace lox::jit {
+
+Code::Code(std::byte *memory, size_t size, std::vector<uint32_t> entries)
+    : m_memory(memory), m_size(size), m_entries(std::move(entries)) {}
+
+Code::Code(Function function, std::vector<uint32_t> entries)
+    : m_function(function), m_entries(std::move(entries)) {}
+
+Code::~Code() {
+#if CPPLOX_JIT
+	if (m_memory != nullptr) {
+		munmap(m_memory, m_size);
+	}
+#endif
+}
+
+bool Code::enters(size_t index) const {
+	return index < m_entries.size() && m_entries[index] != UINT32_MAX;
+}
+
+uint32_t Code::run(State &state, size_t index) const {
+	if (m_function != nullptr) {
+		return m_function(state, static_cast<uint32_t>(index));
+	}
+	// the prologue at the start of the code loads the state and jumps to the
+	// template of the instruction
+	auto function =
+	    reinterpret_cast<uint32_t (*)(State *, const void *)>(m_memory);
+	return function(&state, m_memory + m_entries[index]);
+}
+
+#if CPPLOX_JIT
+
+// the layout of the NaN boxed values, every tag lives in the bits above the
+// payload so the templates test it with a shift and a 32 bit compare
+struct Bits {
+	static constexpr uint64_t nil = Value::NIL_VAL;
+	static constexpr uint64_t false_ = Value::FALSE_VAL;
+	static constexpr uint64_t undefined = Value::UNDEFINED_VAL;
+	static constexpr uint64_t sign = Value::SIGN_BIT;
+	static constexpr uint64_t int_tag = Value::QNAN | Value::TAG_INT;
+	// tag of objects, integers and NaN boxed values above their shift
+	static constexpr uint32_t object_shift = 50;
+	static constexpr uint32_t object = (Value::SIGN_BIT | Value::QNAN) >> 50;
+	static constexpr uint32_t int_shift = 49;
+	static constexpr uint32_t integer = int_tag >> 49;
+	static constexpr uint32_t boxed = Value::QNAN >> 50;
+
+	static uint64_t of(const Value &value) { return value.bits; }
+
+	static_assert(Value::TRUE_VAL == Value::FALSE_VAL + 1);
+	static_assert(uint64_t{object} << object_shift ==
+	              (Value::SIGN_BIT | Value::QNAN));
+	static_assert(~Value::INT_MASK >> int_shift << int_shift ==
+	              ~Value::INT_MASK);
+	static_assert(uint64_t{boxed} << object_shift == Value::QNAN);
+};
+
+namespace {
+
+void printValue(Value *value) {
+	Value printed = std::move(*value);
+	std::cout << std::format("{}\n", printed.toString());
+}
+
+enum Reg : uint8_t {
+	RAX,
+	RCX,
+	RDX,
+	RBX,
+	RSP,
+	RBP,
+	RSI,
+	RDI,
+	R8,
+	R9,
+	R10,
+	R11,
+	R12,
+	R13,
+	R14,
+	R15,
+};
+
+enum Xmm : uint8_t { XMM0, XMM1, XMM2 };
+
+enum class Cond : uint8_t {
+	O = 0x0,
+	B = 0x2,
+	AE = 0x3,
+	E = 0x4,
+	NE = 0x5,
+	BE = 0x6,
+	A = 0x7,
+	P = 0xa,
+	NP = 0xb,
+	L = 0xc,
+	GE = 0xd,
+	LE = 0xe,
+	G = 0xf,
+};
+
+// the register roles of the generated code, all callee saved so helpers can
+// be called without spilling them
+constexpr Reg slots = RBX;
+constexpr Reg top = R12;
+constexpr Reg globals = R13;
+constexpr Reg state = R14;
+
+// opcode extensions of the group 1 arithmetic with an immediate
+enum Group1 : uint8_t { ADD = 0, OR = 1, AND = 4, SUB = 5, XOR = 6, CMP = 7 };
+// and of the shifts
+enum Shift : uint8_t { SHL = 4, SHR = 5, SAR = 7 };
+
+// the few x86-64 instructions the templates need, jumps go to labels that
+// are patched once they are bound
+class Assembler {
+  public:
+	struct Label {
+		std::optional<size_t> offset;
+		// positions of the rel32 fields that jump to the label
+		std::vector<size_t> uses;
+	};
+
+	std::vector<std::byte> code;
+
+	size_t size() const { return code.size(); }
+
+	void bind(Label &label) {
+		label.offset = code.size();
+		for (size_t use : label.uses) {
+			patch(use, *label.offset);
+		}
+		label.uses.clear();
+	}
+
+	void mov(Reg dst, Reg src) {
+		rex(true, src, dst);
+		emit({0x89});
+		direct(src, dst);
+	}
+	void load(Reg dst, Reg base, int32_t disp) {
+		rex(true, dst, base);
+		emit({0x8b});
+		memory(dst, base, disp);
+	}
+	void store(Reg base, int32_t disp, Reg src) {
+		rex(true, src, base);
+		emit({0x89});
+		memory(src, base, disp);
+	}
+	void lea(Reg dst, Reg base, int32_t disp) {
+		rex(true, dst, base);
+		emit({0x8d});
+		memory(dst, base, disp);
+	}
+	void movabs(Reg dst, uint64_t value) {
+		rex(true, 0, dst);
+		emit({static_cast<uint8_t>(0xb8 + (dst & 7))});
+		imm(value, 8);
+	}
+	void mov32(Reg dst, uint32_t value) {
+		rex(false, 0, dst);
+		emit({static_cast<uint8_t>(0xb8 + (dst & 7))});
+		imm(value, 4);
+	}
+	void add(Reg dst, Reg src) { alu(0x01, dst, src); }
+	void or_(Reg dst, Reg src) { alu(0x09, dst, src); }
+	void sub(Reg dst, Reg src) { alu(0x29, dst, src); }
+	void xor_(Reg dst, Reg src) { alu(0x31, dst, src); }
+	void cmp(Reg dst, Reg src) { alu(0x39, dst, src); }
+	void test(Reg dst, Reg src) { alu(0x85, dst, src); }
+	void alu(Group1 operation, Reg dst, int32_t value, bool wide = true) {
+		rex(wide, 0, dst);
+		emit({0x81});
+		direct(operation, dst);
+		imm(static_cast<uint32_t>(value), 4);
+	}
+	void shift(Shift operation, Reg dst, uint8_t count) {
+		rex(true, 0, dst);
+		emit({0xc1});
+		direct(operation, dst);
+		emit({count});
+	}
+	void imul(Reg dst, Reg src) {
+		rex(true, dst, src);
+		emit({0x0f, 0xaf});
+		direct(dst, src);
+	}
+	void neg(Reg dst) {
+		rex(true, 0, dst);
+		emit({0xf7});
+		direct(3, dst);
+	}
+	// only for the registers whose low byte needs no REX prefix
+	void setcc(Cond cond, Reg dst) {
+		emit({0x0f, static_cast<uint8_t>(0x90 | static_cast<uint8_t>(cond))});
+		direct(0, dst);
+	}
+	void and8(Reg dst, Reg src) {
+		emit({0x20});
+		direct(src, dst);
+	}
+	void test8(Reg dst, Reg src) {
+		emit({0x84});
+		direct(src, dst);
+	}
+	void movzx8(Reg dst, Reg src) {
+		emit({0x0f, 0xb6});
+		direct(dst, src);
+	}
+	void movq(Xmm dst, Reg src) {
+		emit({0x66});
+		rex(true, dst, src);
+		emit({0x0f, 0x6e});
+		direct(dst, src);
+	}
+	void movq(Reg dst, Xmm src) {
+		emit({0x66});
+		rex(true, src, dst);
+		emit({0x0f, 0x7e});
+		direct(src, dst);
+	}
+	void cvtsi2sd(Xmm dst, Reg src) {
+		emit({0xf2});
+		rex(true, dst, src);
+		emit({0x0f, 0x2a});
+		direct(dst, src);
+	}
+	// scalar double instructions, prefix and opcode
+	void sse(uint8_t prefix, uint8_t opcode, Xmm dst, Xmm src) {
+		emit({prefix, 0x0f, opcode});
+		direct(dst, src);
+	}
+	void push(Reg reg) {
+		rex(false, 0, reg);
+		emit({static_cast<uint8_t>(0x50 + (reg & 7))});
+	}
+	void pop(Reg reg) {
+		rex(false, 0, reg);
+		emit({static_cast<uint8_t>(0x58 + (reg & 7))});
+	}
+	void ret() { emit({0xc3}); }
+	void call(const void *function) {
+		movabs(RAX, reinterpret_cast<uint64_t>(function));
+		emit({0xff});
+		direct(2, RAX);
+	}
+	void jump(Reg target) {
+		rex(false, 0, target);
+		emit({0xff});
+		direct(4, target);
+	}
+	void jump(Label &label) {
+		emit({0xe9});
+		use(label);
+	}
+	void jump(Cond cond, Label &label) {
+		emit({0x0f, static_cast<uint8_t>(0x80 | static_cast<uint8_t>(cond))});
+		use(label);
+	}
+
+  private:
+	void emit(std::initializer_list<uint8_t> bytes) {
+		for (uint8_t byte : bytes) {
+			code.push_back(static_cast<std::byte>(byte));
+		}
+	}
+	void imm(uint64_t value, size_t width) {
+		for (size_t i = 0; i < width; ++i) {
+			code.push_back(static_cast<std::byte>(value >> (8 * i) & 0xff));
+		}
+	}
+	void rex(bool wide, uint8_t reg, uint8_t base) {
+		uint8_t prefix = 0x40 | wide << 3 | (reg >> 3) << 2 | base >> 3;
+		if (prefix != 0x40) {
+			emit({prefix});
+		}
+	}
+	void direct(uint8_t reg, uint8_t rm) {
+		emit({static_cast<uint8_t>(0xc0 | (reg & 7) << 3 | (rm & 7))});
+	}
+	// [base + disp32], r12 as a base needs a SIB byte
+	void memory(uint8_t reg, uint8_t base, int32_t disp) {
+		emit({static_cast<uint8_t>(0x80 | (reg & 7) << 3 | (base & 7))});
+		if ((base & 7) == RSP) {
+			emit({0x24});
+		}
+		imm(static_cast<uint32_t>(disp), 4);
+	}
+	void alu(uint8_t opcode, Reg dst, Reg src) {
+		rex(true, src, dst);
+		emit({opcode});
+		direct(src, dst);
+	}
+	void use(Label &label) {
+		size_t position = code.size();
+		imm(0, 4);
+		if (label.offset.has_value()) {
+			patch(position, *label.offset);
+		} else {
+			label.uses.push_back(position);
+		}
+	}
+	void patch(size_t position, size_t target) {
+		auto rel = static_cast<uint32_t>(static_cast<int64_t>(target) -
+		                                 static_cast<int64_t>(position + 4));
+		for (size_t i = 0; i < 4; ++i) {
+			code[position + i] = static_cast<std::byte>(rel >> (8 * i) & 0xff);
+		}
+	}
+};
+
+using Label = Assembler::Label;
+
+// displacement of the slot in the values at base, nullopt when it does not
+// fit the 32 bit displacement of the templates
+std::optional<int32_t> slotOffset(int64_t slot) {
+	if (slot < 0 || slot > INT32_MAX / int64_t{sizeof(Value)} - 2) {
+		return std::nullopt;
+	}
+	return static_cast<int32_t>(slot * sizeof(Value));
+}
+
+// translates the decoded instructions one template at a time. every
+// template can leave to the interpreter before it changed anything, the
+// exits and the calls into the helpers are emitted after the hot code
+class Translator {
+  public:
+	explicit Translator(const Chunk &chunk)
+	    : chunk(chunk), instructions(chunk.instructions()),
+	      labels(instructions.size()),
+	      entries(instructions.size(), UINT32_MAX) {}
+
+	std::optional<std::pair<std::vector<std::byte>, std::vector<uint32_t>>>
+	translate() {
+		prologue();
+		bool enterable = false;
+		for (index = 0; index < instructions.size(); ++index) {
+			exitLabel = nullptr;
+			as.bind(labels[index]);
+			size_t start = as.size();
+			if (emit(instructions[index])) {
+				entries[index] = start;
+				enterable = true;
+			} else {
+				// the code of the instruction is its exit, other templates
+				// jump here too
+				as.mov32(RAX, index);
+				as.jump(epilogueLabel);
+			}
+		}
+		// the cold paths may add more of their own
+		for (size_t i = 0; i < cold.size(); ++i) {
+			cold[i]();
+		}
+		if (!enterable) {
+			return std::nullopt;
+		}
+		return std::pair{std::move(as.code), std::move(entries)};
+	}
+
+  private:
+	const Chunk &chunk;
+	std::span<const Instruction> instructions;
+	Assembler as;
+	std::vector<Label> labels;
+	// labels of the cold paths, a deque keeps them in place as it grows
+	std::deque<Label> coldLabels;
+	std::vector<std::function<void()>> cold;
+	std::vector<uint32_t> entries;
+	Label epilogueLabel;
+	size_t index = 0;
+	Label *exitLabel = nullptr;
+
+	void prologue() {
+		as.push(RBX);
+		as.push(R12);
+		as.push(R13);
+		as.push(R14);
+		// keeps the stack aligned for the helper calls
+		as.alu(SUB, RSP, 8);
+		as.mov(state, RDI);
+		as.load(slots, RDI, offsetof(State, slots));
+		as.load(top, RDI, offsetof(State, stackTop));
+		as.load(globals, RDI, offsetof(State, globals));
+		as.jump(RSI);
+
+		as.bind(epilogueLabel);
+		as.store(state, offsetof(State, stackTop), top);
+		as.alu(ADD, RSP, 8);
+		as.pop(R14);
+		as.pop(R13);
+		as.pop(R12);
+		as.pop(RBX);
+		as.ret();
+	}
+
+	Label &newLabel() { return coldLabels.emplace_back(); }
+
+	// leaves the machine code at the current instruction, which has not
+	// changed anything yet
+	Label &exit() {
+		if (exitLabel == nullptr) {
+			exitLabel = &newLabel();
+			cold.push_back([this, label = exitLabel, at = index] {
+				as.bind(*label);
+				as.mov32(RAX, at);
+				as.jump(epilogueLabel);
+			});
+		}
+		return *exitLabel;
+	}
+
+	// flags equal when the value is an object
+	void testObject(Reg value) {
+		as.mov(RCX, value);
+		as.shift(SHR, RCX, Bits::object_shift);
+		as.alu(CMP, RCX, Bits::object, false);
+	}
+	// flags equal when the value is an integer
+	void testInteger(Reg value) {
+		as.mov(RCX, value);
+		as.shift(SHR, RCX, Bits::int_shift);
+		as.alu(CMP, RCX, Bits::integer, false);
+	}
+	// flags not equal when the value is a double
+	void testDouble(Reg value) {
+		as.mov(RCX, value);
+		as.shift(SHR, RCX, Bits::object_shift);
+		as.alu(AND, RCX, Bits::boxed, false);
+		as.alu(CMP, RCX, Bits::boxed, false);
+	}
+	// flags below or equal when the value is nil or false
+	void testFalsey(Reg value) {
+		as.movabs(RDX, Bits::nil);
+		as.mov(RCX, value);
+		as.sub(RCX, RDX);
+		as.alu(CMP, RCX, 1);
+	}
+
+	// either kind of number as a double, anything else leaves
+	void loadNumber(Xmm dst, Reg value) {
+		Label isDouble;
+		Label done;
+		testDouble(value);
+		as.jump(Cond::NE, isDouble);
+		testInteger(value);
+		as.jump(Cond::NE, exit());
+		as.mov(RCX, value);
+		as.shift(SHL, RCX, 64 - Bits::int_shift);
+		as.shift(SAR, RCX, 64 - Bits::int_shift);
+		as.cvtsi2sd(dst, RCX);
+		as.jump(done);
+		as.bind(isDouble);
+		as.movq(dst, value);
+		as.bind(done);
+	}
+
+	// boxes the integer held shifted to the top of RSI into RAX
+	void boxInteger() {
+		as.shift(SHR, RSI, 64 - Bits::int_shift);
+		as.movabs(R8, Bits::int_tag);
+		as.or_(RSI, R8);
+		as.mov(RAX, RSI);
+	}
+
+	// RAX op RDX into RAX. integers stay integers while the result is in
+	// range, anything the interpreter would round, report or turn into -0
+	// leaves instead
+	void arithmetic(OpCode op) {
+		Label notInteger;
+		Label done;
+		if (op != OpCode::OP_DIVIDE) {
+			testInteger(RAX);
+			as.jump(Cond::NE, notInteger);
+			testInteger(RDX);
+			as.jump(Cond::NE, notInteger);
+			// the payloads shifted to the top overflow exactly when the
+			// result leaves the range of the payload
+			as.mov(RSI, RAX);
+			as.shift(SHL, RSI, 64 - Bits::int_shift);
+			as.mov(RDI, RDX);
+			as.shift(SHL, RDI, 64 - Bits::int_shift);
+			if (op == OpCode::OP_ADD) {
+				as.add(RSI, RDI);
+			} else if (op == OpCode::OP_SUBTRACT) {
+				as.sub(RSI, RDI);
+			} else {
+				as.shift(SAR, RDI, 64 - Bits::int_shift);
+				as.imul(RSI, RDI);
+			}
+			as.jump(Cond::O, exit());
+			if (op == OpCode::OP_MULTIPLY) {
+				as.test(RSI, RSI);
+				as.jump(Cond::E, exit());
+			}
+			// the lowest payload is outside the range of the integers
+			as.mov(RDI, RSI);
+			as.neg(RDI);
+			as.jump(Cond::O, exit());
+			boxInteger();
+			as.jump(done);
+		}
+		as.bind(notInteger);
+		loadNumber(XMM0, RAX);
+		loadNumber(XMM1, RDX);
+		switch (op) {
+		case OpCode::OP_ADD:
+			as.sse(0xf2, 0x58, XMM0, XMM1);
+			break;
+		case OpCode::OP_SUBTRACT:
+			as.sse(0xf2, 0x5c, XMM0, XMM1);
+			break;
+		case OpCode::OP_MULTIPLY:
+			as.sse(0xf2, 0x59, XMM0, XMM1);
+			break;
+		default: {
+			// division by zero is reported by the interpreter
+			Label nonZero;
+			as.sse(0x66, 0x57, XMM2, XMM2);
+			as.sse(0x66, 0x2e, XMM1, XMM2);
+			as.jump(Cond::P, nonZero);
+			as.jump(Cond::E, exit());
+			as.bind(nonZero);
+			as.sse(0xf2, 0x5e, XMM0, XMM1);
+			break;
+		}
+		}
+		as.movq(RAX, XMM0);
+		as.bind(done);
+	}
+
+	// RAX compared to RDX, the result in RCX as 0 or 1
+	void compare(OpCode op) {
+		Label notInteger;
+		Label done;
+		testInteger(RAX);
+		as.jump(Cond::NE, notInteger);
+		testInteger(RDX);
+		as.jump(Cond::NE, notInteger);
+		as.mov(RSI, RAX);
+		as.shift(SHL, RSI, 64 - Bits::int_shift);
+		as.mov(RDI, RDX);
+		as.shift(SHL, RDI, 64 - Bits::int_shift);
+		as.cmp(RSI, RDI);
+		switch (op) {
+		case OpCode::OP_GREATER:
+			as.setcc(Cond::G, RCX);
+			break;
+		case OpCode::OP_GREATER_EQUAL:
+			as.setcc(Cond::GE, RCX);
+			break;
+		case OpCode::OP_LESS:
+			as.setcc(Cond::L, RCX);
+			break;
+		default:
+			as.setcc(Cond::LE, RCX);
+			break;
+		}
+		as.jump(done);
+		as.bind(notInteger);
+		loadNumber(XMM0, RAX);
+		loadNumber(XMM1, RDX);
+		// unordered compares as below, so NaN is never above either way
+		bool greater =
+		    op == OpCode::OP_GREATER || op == OpCode::OP_GREATER_EQUAL;
+		if (greater) {
+			as.sse(0x66, 0x2e, XMM0, XMM1);
+		} else {
+			as.sse(0x66, 0x2e, XMM1, XMM0);
+		}
+		bool strict = op == OpCode::OP_GREATER || op == OpCode::OP_LESS;
+		as.setcc(strict ? Cond::A : Cond::AE, RCX);
+		as.bind(done);
+		as.movzx8(RCX, RCX);
+	}
+
+	// RAX equals RDX in RCX as 0 or 1, objects leave
+	void equal() {
+		Label numbers;
+		Label done;
+		testObject(RAX);
+		as.jump(Cond::E, exit());
+		testObject(RDX);
+		as.jump(Cond::E, exit());
+		testDouble(RAX);
+		as.jump(Cond::NE, numbers);
+		testDouble(RDX);
+		as.jump(Cond::NE, numbers);
+		// integers, booleans and nil are equal when their bits are
+		as.cmp(RAX, RDX);
+		as.setcc(Cond::E, RCX);
+		as.jump(done);
+		as.bind(numbers);
+		loadNumber(XMM0, RAX);
+		loadNumber(XMM1, RDX);
+		as.sse(0x66, 0x2e, XMM0, XMM1);
+		as.setcc(Cond::E, RCX);
+		as.setcc(Cond::NP, RDX);
+		as.and8(RCX, RDX);
+		as.bind(done);
+		as.movzx8(RCX, RCX);
+	}
+
+	// the boolean for RCX into RAX
+	void boxBool() {
+		as.movabs(RAX, Bits::false_);
+		as.add(RAX, RCX);
+	}
+
+	// values point to their objects, so copying one copies its bits
+	void pushCopy(Reg base, int32_t disp) {
+		as.load(RAX, base, disp);
+		as.store(top, 0, RAX);
+		as.alu(ADD, top, sizeof(Value));
+	}
+
+	// stores the top of the stack at base + disp, popping it or not
+	void assign(Reg base, int32_t disp, bool pop) {
+		if (pop) {
+			as.lea(top, top, -static_cast<int32_t>(sizeof(Value)));
+		}
+		int32_t source = pop ? 0 : -static_cast<int32_t>(sizeof(Value));
+		as.load(RAX, top, source);
+		as.store(base, disp, RAX);
+	}
+
+	void pushBits(uint64_t bits) {
+		as.movabs(RAX, bits);
+		as.store(top, 0, RAX);
+		as.alu(ADD, top, sizeof(Value));
+	}
+
+	void leaveIfUndefined(int32_t disp) {
+		as.load(RAX, globals, disp);
+		as.movabs(RCX, Bits::undefined);
+		as.cmp(RAX, RCX);
+		as.jump(Cond::E, exit());
+	}
+
+	// the constant when it is a number, objects are left to the interpreter
+	std::optional<uint64_t> numberConstant(uint32_t index) {
+		auto constants = chunk.constants();
+		if (index >= constants.size() || !constants[index].isNumber()) {
+			return std::nullopt;
+		}
+		return Bits::of(constants[index]);
+	}
+
+	bool jumpTarget(uint32_t target) { return target < labels.size(); }
+
+	// emits the template, false when the instruction is left to the
+	// interpreter
+	bool emit(const Instruction &instruction) {
+		constexpr int32_t value = sizeof(Value);
+		OpCode op = genericForm(instruction.op);
+		switch (op) {
+		case OpCode::OP_CONSTANT: {
+			auto constants = chunk.constants();
+			if (instruction.operand >= constants.size()) {
+				return false;
+			}
+			pushBits(Bits::of(constants[instruction.operand]));
+			return true;
+		}
+		case OpCode::OP_NIL:
+			pushBits(Bits::of(Value{}));
+			return true;
+		case OpCode::OP_TRUE:
+			pushBits(Bits::of(Value{true}));
+			return true;
+		case OpCode::OP_FALSE:
+			pushBits(Bits::of(Value{false}));
+			return true;
+		case OpCode::OP_POP:
+			as.lea(top, top, -value);
+			return true;
+		case OpCode::OP_GET_LOCAL:
+		case OpCode::OP_SET_LOCAL:
+		case OpCode::OP_SET_LOCAL_POP: {
+			auto disp = slotOffset(instruction.operand);
+			if (!disp.has_value()) {
+				return false;
+			}
+			if (op == OpCode::OP_GET_LOCAL) {
+				pushCopy(slots, *disp);
+			} else {
+				assign(slots, *disp, op == OpCode::OP_SET_LOCAL_POP);
+			}
+			return true;
+		}
+		case OpCode::OP_GET_GLOBAL:
+		case OpCode::OP_SET_GLOBAL:
+		case OpCode::OP_DEFINE_GLOBAL: {
+			auto disp = slotOffset(instruction.operand2);
+			if (!disp.has_value()) {
+				return false;
+			}
+			if (op != OpCode::OP_DEFINE_GLOBAL) {
+				leaveIfUndefined(*disp);
+			}
+			if (op == OpCode::OP_GET_GLOBAL) {
+				pushCopy(globals, *disp);
+			} else {
+				assign(globals, *disp, op == OpCode::OP_DEFINE_GLOBAL);
+			}
+			return true;
+		}
+		case OpCode::OP_ADD:
+		case OpCode::OP_SUBTRACT:
+		case OpCode::OP_MULTIPLY:
+		case OpCode::OP_DIVIDE:
+			as.load(RAX, top, -2 * value);
+			as.load(RDX, top, -value);
+			arithmetic(op);
+			as.store(top, -2 * value, RAX);
+			as.lea(top, top, -value);
+			return true;
+		case OpCode::OP_GREATER:
+		case OpCode::OP_GREATER_EQUAL:
+		case OpCode::OP_LESS:
+		case OpCode::OP_LESS_EQUAL:
+		case OpCode::OP_EQUAL:
+		case OpCode::OP_NOT_EQUAL:
+			as.load(RAX, top, -2 * value);
+			as.load(RDX, top, -value);
+			if (op == OpCode::OP_EQUAL || op == OpCode::OP_NOT_EQUAL) {
+				equal();
+				if (op == OpCode::OP_NOT_EQUAL) {
+					as.alu(XOR, RCX, 1, false);
+				}
+			} else {
+				compare(op);
+			}
+			boxBool();
+			as.store(top, -2 * value, RAX);
+			as.lea(top, top, -value);
+			return true;
+		case OpCode::OP_NOT:
+			as.load(RAX, top, -value);
+			testObject(RAX);
+			as.jump(Cond::E, exit());
+			testFalsey(RAX);
+			as.setcc(Cond::BE, RCX);
+			as.movzx8(RCX, RCX);
+			boxBool();
+			as.store(top, -value, RAX);
+			return true;
+		case OpCode::OP_NEGATE: {
+			Label notInteger;
+			Label zero;
+			Label done;
+			as.load(RAX, top, -value);
+			testInteger(RAX);
+			as.jump(Cond::NE, notInteger);
+			as.mov(RSI, RAX);
+			as.shift(SHL, RSI, 64 - Bits::int_shift);
+			as.test(RSI, RSI);
+			as.jump(Cond::E, zero);
+			as.neg(RSI);
+			boxInteger();
+			as.jump(done);
+			// integer zero negates to -0, which only the double can hold
+			as.bind(zero);
+			as.movabs(RAX, Bits::sign);
+			as.jump(done);
+			as.bind(notInteger);
+			testDouble(RAX);
+			as.jump(Cond::E, exit());
+			as.movabs(RDX, Bits::sign);
+			as.xor_(RAX, RDX);
+			as.bind(done);
+			as.store(top, -value, RAX);
+			return true;
+		}
+		case OpCode::OP_PRINT:
+			as.lea(RDI, top, -value);
+			as.call(reinterpret_cast<const void *>(&printValue));
+			as.lea(top, top, -value);
+			return true;
+		case OpCode::OP_JUMP:
+		case OpCode::OP_LOOP:
+			if (!jumpTarget(instruction.operand)) {
+				return false;
+			}
+			as.jump(labels[instruction.operand]);
+			return true;
+		case OpCode::OP_JUMP_IF_FALSE:
+		case OpCode::OP_JUMP_IF_FALSE_POP:
+			if (!jumpTarget(instruction.operand)) {
+				return false;
+			}
+			if (op == OpCode::OP_JUMP_IF_FALSE_POP) {
+				as.lea(top, top, -value);
+				as.load(RAX, top, 0);
+			} else {
+				as.load(RAX, top, -value);
+			}
+			testFalsey(RAX);
+			as.jump(Cond::BE, labels[instruction.operand]);
+			return true;
+		case OpCode::OP_LESS_JUMP:
+			if (!jumpTarget(instruction.operand)) {
+				return false;
+			}
+			as.load(RAX, top, -2 * value);
+			as.load(RDX, top, -value);
+			compare(OpCode::OP_LESS);
+			as.lea(top, top, -2 * value);
+			as.test8(RCX, RCX);
+			as.jump(Cond::E, labels[instruction.operand]);
+			return true;
+		case OpCode::OP_ADD_LOCALS: {
+			auto a = slotOffset(instruction.operand);
+			auto b = slotOffset(instruction.operand2);
+			if (!a.has_value() || !b.has_value()) {
+				return false;
+			}
+			as.load(RAX, slots, *a);
+			as.load(RDX, slots, *b);
+			arithmetic(OpCode::OP_ADD);
+			as.store(top, 0, RAX);
+			as.alu(ADD, top, value);
+			return true;
+		}
+		case OpCode::OP_ADD_CONSTANT: {
+			auto constant = numberConstant(instruction.operand);
+			if (!constant.has_value()) {
+				return false;
+			}
+			as.load(RAX, top, -value);
+			as.movabs(RDX, *constant);
+			arithmetic(OpCode::OP_ADD);
+			as.store(top, -value, RAX);
+			return true;
+		}
+		case OpCode::OP_INCREMENT_LOCAL: {
+			auto disp = slotOffset(instruction.operand);
+			auto constant = numberConstant(instruction.operand2);
+			if (!disp.has_value() || !constant.has_value()) {
+				return false;
+			}
+			as.load(RAX, slots, *disp);
+			as.movabs(RDX, *constant);
+			arithmetic(OpCode::OP_ADD);
+			as.store(slots, *disp, RAX);
+			return true;
+		}
+		default:
+			// calls, returns, upvalues, closures and classes
+			return false;
+		}
+	}
+};
+
+} // namespace
+
+std::shared_ptr<const Code> compile(const Chunk &chunk) {
+	Translator translator{chunk};
+	auto translated = translator.translate();
+	if (!translated.has_value()) {
+		return nullptr;
+	}
+	auto &[code, entries] = *translated;
+	size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t size = (code.size() + page - 1) / page * page;
+	void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		return nullptr;
+	}
+	std::memcpy(memory, code.data(), code.size());
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, size);
+		return nullptr;
+	}
+	return std::make_shared<const Code>(static_cast<std::byte *>(memory),
+	                                    size, std::move(entries));
+}
+
+#else
+
+std::shared_ptr<const Code> compile(const Chunk &chunk) { return nullptr; }
+
+#endif
+
+} // namespace lox::jit
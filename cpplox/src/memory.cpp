@@ -0,0 +1,115 @@
+#include <cpplox/memory.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace lox {
+
+namespace {
+
+// the size class that holds the request, with the blocks of each class
+// aligned to the smaller of their size and max_align_t
+size_t classIndex(size_t bytes) {
+	return std::bit_width(std::max(bytes, PoolResource::min_size) - 1) -
+	       std::bit_width(PoolResource::min_size - 1);
+}
+
+} // namespace
+
+ArenaResource::ArenaResource(size_t block_size,
+                             std::pmr::memory_resource *upstream)
+    : m_upstream(upstream), m_block_size(std::max(block_size, sizeof(Block))) {
+}
+
+ArenaResource::~ArenaResource() { release(); }
+
+void ArenaResource::release() {
+	while (m_blocks != nullptr) {
+		Block *block = std::exchange(m_blocks, m_blocks->next);
+		m_upstream->deallocate(block, block->size, alignof(std::max_align_t));
+	}
+	m_current = nullptr;
+	m_end = nullptr;
+	m_allocated = 0;
+	m_reserved = 0;
+}
+
+void *ArenaResource::do_allocate(size_t bytes, size_t alignment) {
+	void *pointer = m_current;
+	size_t space = m_end - m_current;
+	if (m_current == nullptr ||
+	    std::align(alignment, bytes, pointer, space) == nullptr) {
+		size_t size = std::max(m_block_size, sizeof(Block) + bytes + alignment);
+		auto *block = static_cast<Block *>(
+		    m_upstream->allocate(size, alignof(std::max_align_t)));
+		m_blocks = new (block) Block{m_blocks, size};
+		m_current = reinterpret_cast<std::byte *>(block + 1);
+		m_end = reinterpret_cast<std::byte *>(block) + size;
+		m_reserved += size;
+		m_block_size *= 2;
+		pointer = m_current;
+		space = m_end - m_current;
+		std::align(alignment, bytes, pointer, space);
+	}
+	m_current = static_cast<std::byte *>(pointer) + bytes;
+	m_allocated += bytes;
+	return pointer;
+}
+
+PoolResource::PoolResource(std::pmr::memory_resource *upstream)
+    : m_upstream(upstream) {}
+
+PoolResource::~PoolResource() {
+	while (m_chunks != nullptr) {
+		Chunk *chunk = std::exchange(m_chunks, m_chunks->next);
+		m_upstream->deallocate(chunk, chunk->size, alignof(std::max_align_t));
+	}
+}
+
+void PoolResource::refill(size_t index) {
+	size_t block = min_size << index;
+	// the header takes the first block so the others keep their alignment
+	size_t size = std::max(chunk_size, 2 * block);
+	auto *chunk = static_cast<Chunk *>(
+	    m_upstream->allocate(size, alignof(std::max_align_t)));
+	m_chunks = new (chunk) Chunk{m_chunks, size};
+	m_reserved += size;
+	auto *begin = reinterpret_cast<std::byte *>(chunk);
+	for (size_t offset = size - block; offset >= block; offset -= block) {
+		m_free[index] = new (begin + offset) Block{m_free[index]};
+	}
+}
+
+void *PoolResource::do_allocate(size_t bytes, size_t alignment) {
+	if (bytes > max_size || alignment > alignof(std::max_align_t)) {
+		m_reserved += bytes;
+		m_in_use += bytes;
+		return m_upstream->allocate(bytes, alignment);
+	}
+	size_t index = classIndex(bytes);
+	if (m_free[index] == nullptr) {
+		refill(index);
+	}
+	Block *block = std::exchange(m_free[index], m_free[index]->next);
+	m_in_use += min_size << index;
+	return block;
+}
+
+void PoolResource::do_deallocate(void *pointer, size_t bytes,
+                                 size_t alignment) {
+	if (bytes > max_size || alignment > alignof(std::max_align_t)) {
+		m_reserved -= bytes;
+		m_in_use -= bytes;
+		m_upstream->deallocate(pointer, bytes, alignment);
+		return;
+	}
+	size_t index = classIndex(bytes);
+	m_free[index] = new (pointer) Block{m_free[index]};
+	m_in_use -= min_size << index;
+}
+
+} // namespace lox
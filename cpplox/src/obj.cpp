@@ -1,34 +1,96 @@
 #include <cpplox/chunk.hpp>
+#include <cpplox/class.hpp>
 #include <cpplox/obj.hpp>
 #include <cpplox/value.hpp>
 
 #include <format>
+#include <memory>
+#include <memory_resource>
+#include <vector>
 
 namespace lox {
 
+namespace {
+
+const ObjString &stringOf(const Value &value) {
+	return std::get<ObjString>(value.asObj().value);
+}
+
+} // namespace
+
+ObjString::ObjString(std::pmr::string chars, size_t hash)
+    : m_chars(std::move(chars)), m_hash(hash), m_size(m_chars.size()) {}
+
+ObjString::ObjString(Value left, Value right)
+    : m_chars(stringOf(left).m_chars.get_allocator()),
+      m_size(stringOf(left).size() + stringOf(right).size()), m_left(left),
+      m_right(right) {}
+
+size_t ObjString::hashOf(std::string_view chars) {
+	return std::hash<std::string_view>{}(chars);
+}
+
+const std::pmr::string &ObjString::chars() const {
+	if (isRope()) {
+		flatten();
+	}
+	return m_chars;
+}
+
+size_t ObjString::hash() const {
+	if (isRope()) {
+		flatten();
+	}
+	return m_hash;
+}
+
+void ObjString::flatten() const {
+	std::pmr::string chars{m_chars.get_allocator()};
+	chars.reserve(m_size);
+	// strings still to append, the next one on top, allocated from the
+	// resource of the string like the characters
+	std::pmr::vector<const ObjString *> pending{chars.get_allocator()};
+	pending.push_back(&stringOf(m_right));
+	pending.push_back(&stringOf(m_left));
+	while (!pending.empty()) {
+		const ObjString *string = pending.back();
+		pending.pop_back();
+		if (string->isRope()) {
+			pending.push_back(&stringOf(string->m_right));
+			pending.push_back(&stringOf(string->m_left));
+		} else {
+			chars += string->m_chars;
+		}
+	}
+	m_chars = std::move(chars);
+	m_hash = hashOf(m_chars);
+	m_left = Value{};
+	m_right = Value{};
+}
+
+bool ObjString::operator==(const ObjString &other) const {
+	return m_size == other.m_size && hash() == other.hash() &&
+	       chars() == other.chars();
+}
+
 bool ObjNative::operator==(const ObjNative &other) const {
 	return function == other.function;
 }
 
 std::string ObjNative::toString() const { return std::format("<native fn>"); }
 
-ObjFunction::ObjFunction() : chunk(std::make_unique<Chunk>()) {}
+ObjFunction::ObjFunction()
+    : ObjFunction(std::pmr::get_default_resource()) {}
+
+ObjFunction::ObjFunction(std::pmr::memory_resource *resource)
+    : chunk(std::allocate_shared<Chunk>(
+          std::pmr::polymorphic_allocator<Chunk>{resource}, resource)) {}
 
 bool ObjFunction::operator==(const ObjFunction &other) const {
-	if (name != other.name || arity != other.arity) {
-		return false;
-	}
-	return *chunk == *other.chunk;
+	return chunk == other.chunk && upvalues == other.upvalues;
 }
 
-ObjFunction ObjFunction::clone() const {
-	ObjFunction result;
-	// copy the chunk data
-	result.chunk = std::make_unique<Chunk>(*chunk);
-	result.arity = arity;
-	result.name = name;
-	return result;
-}
+ObjFunction ObjFunction::clone() const { return *this; }
 
 std::string ObjFunction::toString() const {
 	if (name.empty()) {
@@ -51,14 +113,28 @@ std::string ObjClosure::toString() const {
 	return std::format("<closure {}>", function.get().name);
 }
 
-Obj::Obj(std::string value) : value(value) {}
+bool ObjBoundMethod::operator==(const ObjBoundMethod &other) const {
+	return receiver.equals(other.receiver) && method == other.method;
+}
+
+std::string ObjBoundMethod::toString() const { return method->toString(); }
+
+Obj::Obj(ObjString value) : value(std::move(value)) {}
 
 Obj::Obj(const ObjFunction &value) : value{value.clone()} {}
 
+Obj::Obj(ObjFunction &&value) : value{std::move(value)} {}
+
 Obj::Obj(const ObjNative &value) : value(value) {}
 
 Obj::Obj(const ObjClosure &value) : value(value) {}
 
+Obj::Obj(std::shared_ptr<ObjClass> value) : value(std::move(value)) {}
+
+Obj::Obj(ObjInstance &&value) : value(std::move(value)) {}
+
+Obj::Obj(const ObjBoundMethod &value) : value(value) {}
+
 Obj::Obj(Obj &&other) noexcept : value(std::move(other.value)) {}
 
 Obj &Obj::operator=(Obj &&other) noexcept {
@@ -69,7 +145,7 @@ Obj &Obj::operator=(Obj &&other) noexcept {
 bool Obj::operator==(const Obj &other) const {
 	bool result = false;
 	std::visit(overloads{
-	               [&result](const std::string &a, const std::string &b) {
+	               [&result](const ObjString &a, const ObjString &b) {
 		               result = a == b;
 	               },
 	               [&result](const ObjFunction &a, const ObjFunction &b) {
@@ -78,6 +154,17 @@ bool Obj::operator==(const Obj &other) const {
 	               [&result](const ObjNative &a, const ObjNative &b) {
 		               result = a == b;
 	               },
+	               // classes and instances are equal only to themselves
+	               [&result](const std::shared_ptr<ObjClass> &a,
+	                         const std::shared_ptr<ObjClass> &b) {
+		               result = a == b;
+	               },
+	               [&result](const ObjInstance &a, const ObjInstance &b) {
+		               result = &a == &b;
+	               },
+	               [&result](const ObjBoundMethod &a, const ObjBoundMethod &b) {
+		               result = a == b;
+	               },
 	               // dont bother comparing different types
 	               [](const auto &, const auto &) {},
 	           },
@@ -89,25 +176,19 @@ std::string Obj::toString() const {
 	std::string result;
 	std::visit(
 	    overloads{
-	        [&result](const std::string &value) { result = value; },
+	        [&result](const ObjString &value) { result = value.chars(); },
 	        [&result](const ObjNative &value) { result = value.toString(); },
 	        [&result](const ObjFunction &value) { result = value.toString(); },
-	        [&result](const ObjClosure &value) { result = value.toString(); }},
-	    value);
-	return result;
-}
-
-Obj Obj::clone() const {
-	Obj result;
-	std::visit(
-	    overloads{[&result](const std::string &value) { result = Obj{value}; },
-	              [&result](const ObjNative &value) { result = Obj{value}; },
-	              [&result](const ObjFunction &value) {
-		              result = Obj{value.clone()};
-	              },
-	              [&result](const ObjClosure &value) {
-		              result = Obj{value.clone()};
-	              }},
+	        [&result](const ObjClosure &value) { result = value.toString(); },
+	        [&result](const std::shared_ptr<ObjClass> &value) {
+		        result = value->toString();
+	        },
+	        [&result](const ObjInstance &value) {
+		        result = value.toString();
+	        },
+	        [&result](const ObjBoundMethod &value) {
+		        result = value.toString();
+	        }},
 	    value);
 	return result;
 }
@@ -0,0 +1,219 @@
+#include <cpplox/chunk.hpp>
+#include <cpplox/peephole.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace lox::peephole {
+
+namespace {
+
+struct Node {
+	OpCode op;
+	bool wide = false;
+	bool isTarget = false;
+	// decoded operands, jumps hold the index of their target node instead
+	std::array<uint32_t, 2> operands{};
+	size_t line;
+};
+
+// decodes the chunk into nodes, false when the code is malformed
+bool decode(const Chunk &chunk, std::vector<Node> &nodes) {
+	auto code = chunk.code();
+	std::vector<uint32_t> indices(code.size() + 1, UINT32_MAX);
+	// target byte offset of each jump
+	std::vector<std::pair<size_t, size_t>> jumps;
+	for (size_t offset = 0; offset < code.size();) {
+		size_t start = offset;
+		bool wide = code[offset] == static_cast<std::byte>(OpCode::OP_WIDE);
+		if (wide) {
+			++offset;
+		}
+		if (offset >= code.size() || !isOpCode(code[offset])) {
+			return false;
+		}
+		auto op = static_cast<OpCode>(code[offset]);
+		const auto &info = opcodeInfo(op);
+		if (op == OpCode::OP_WIDE || offset + info.size(wide) > code.size()) {
+			return false;
+		}
+		++offset;
+		Node node{.op = op, .wide = wide, .line = chunk.getLine(start)};
+		for (size_t i = 0; i < info.operandCount(); ++i) {
+			for (size_t byte = 0; byte < info.operandWidth(i, wide); ++byte) {
+				node.operands[i] =
+				    node.operands[i] << 8 | static_cast<uint8_t>(code[offset++]);
+			}
+		}
+		if (info.isJump()) {
+			// jumps are relative to the end of the instruction, their width
+			// is picked again when encoding
+			size_t distance = node.operands[0];
+			jumps.emplace_back(nodes.size(),
+			                   info.operands[0] == OperandKind::LOOP
+			                       ? offset - distance
+			                       : offset + distance);
+			node.wide = false;
+		}
+		indices[start] = nodes.size();
+		nodes.push_back(node);
+	}
+	indices[code.size()] = nodes.size();
+
+	for (auto [index, target] : jumps) {
+		if (target >= indices.size() || indices[target] == UINT32_MAX) {
+			return false;
+		}
+		nodes[index].operands[0] = indices[target];
+		if (indices[target] < nodes.size()) {
+			nodes[indices[target]].isTarget = true;
+		}
+	}
+	return true;
+}
+
+// offset of each node and of the end of the code
+std::vector<size_t> layout(std::span<const Node> nodes) {
+	std::vector<size_t> offsets(nodes.size() + 1);
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		const Node &node = nodes[i];
+		offsets[i + 1] =
+		    offsets[i] + node.wide + opcodeInfo(node.op).size(node.wide);
+	}
+	return offsets;
+}
+
+size_t jumpDistance(const Node &node, std::span<const size_t> offsets,
+                    size_t index) {
+	size_t next = offsets[index + 1];
+	size_t target = offsets[node.operands[0]];
+	return node.op == OpCode::OP_LOOP ? next - target : target - next;
+}
+
+// checks that nodes[index..] starts with the given opcodes, that only the
+// first of them can be reached by a jump and that none is widened, the fused
+// forms only have byte operands
+bool matches(std::span<const Node> nodes, size_t index,
+             std::initializer_list<OpCode> ops) {
+	if (index + ops.size() > nodes.size()) {
+		return false;
+	}
+	size_t i = index;
+	for (OpCode op : ops) {
+		if (nodes[i].op != op || nodes[i].wide ||
+		    (i != index && nodes[i].isTarget)) {
+			return false;
+		}
+		++i;
+	}
+	return true;
+}
+
+// fuses the sequence starting at index, returns the number of nodes consumed
+size_t fuse(std::span<const Node> nodes, size_t index, Node &fused) {
+	using enum OpCode;
+	const Node &first = nodes[index];
+	fused = first;
+
+	if (matches(nodes, index,
+	            {OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP}) &&
+	    first.operands[0] == nodes[index + 3].operands[0]) {
+		fused.op = OP_INCREMENT_LOCAL;
+		fused.operands = {first.operands[0], nodes[index + 1].operands[0]};
+		return 5;
+	}
+	if (matches(nodes, index, {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD})) {
+		fused.op = OP_ADD_LOCALS;
+		fused.operands = {first.operands[0], nodes[index + 1].operands[0]};
+		return 3;
+	}
+	if (matches(nodes, index, {OP_CONSTANT, OP_ADD})) {
+		fused.op = OP_ADD_CONSTANT;
+		return 2;
+	}
+	if (matches(nodes, index, {OP_SET_LOCAL, OP_POP})) {
+		fused.op = OP_SET_LOCAL_POP;
+		return 2;
+	}
+	if (matches(nodes, index, {OP_LESS, OP_JUMP_IF_FALSE_POP})) {
+		fused.op = OP_LESS_JUMP;
+		fused.operands = nodes[index + 1].operands;
+		return 2;
+	}
+	return 1;
+}
+
+} // namespace
+
+void optimize(Chunk &chunk) {
+	std::vector<Node> nodes;
+	if (!decode(chunk, nodes)) {
+		return;
+	}
+
+	// fuses in place, new index of every old node, fused away nodes map to
+	// the node that replaces them, which is never a jump target
+	std::vector<uint32_t> remap(nodes.size() + 1);
+	size_t count = 0;
+	for (size_t i = 0; i < nodes.size();) {
+		Node node;
+		size_t fused = fuse(nodes, i, node);
+		for (size_t j = 0; j < fused; ++j) {
+			remap[i + j] = count;
+		}
+		nodes[count++] = node;
+		i += fused;
+	}
+	remap[nodes.size()] = count;
+	nodes.resize(count);
+	for (auto &node : nodes) {
+		if (opcodeInfo(node.op).isJump()) {
+			node.operands[0] = remap[node.operands[0]];
+		}
+	}
+
+	// every jump starts out wide and is shrunk when it fits in 16 bits.
+	// shrinking only ever brings instructions closer together, so a jump
+	// that fits keeps fitting while the others are shrunk
+	for (auto &node : nodes) {
+		node.wide = node.wide || opcodeInfo(node.op).isJump();
+	}
+	auto offsets = layout(nodes);
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		Node &node = nodes[i];
+		if (opcodeInfo(node.op).isJump() &&
+		    jumpDistance(node, offsets, i) <= UINT16_MAX) {
+			node.wide = false;
+		}
+	}
+	offsets = layout(nodes);
+
+	chunk.clearCode();
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		Node node = nodes[i];
+		const auto &info = opcodeInfo(node.op);
+		if (info.isJump()) {
+			node.operands[0] = jumpDistance(node, offsets, i);
+		}
+		if (node.wide) {
+			chunk.write(static_cast<std::byte>(OpCode::OP_WIDE), node.line);
+		}
+		chunk.write(static_cast<std::byte>(node.op), node.line);
+		// operands are stored big endian
+		for (size_t operand = 0; operand < info.operandCount(); ++operand) {
+			for (size_t byte = info.operandWidth(operand, node.wide);
+			     byte-- > 0;) {
+				chunk.write(static_cast<std::byte>(
+				                node.operands[operand] >> (8 * byte) & 0xff),
+				            node.line);
+			}
+		}
+	}
+}
+
+} // namespace lox::peephole
@@ -0,0 +1,247 @@
+#include <cpplox/chunk.hpp>
+#include <cpplox/obj.hpp>
+#include <cpplox/opcodes.hpp>
+#include <cpplox/profile.hpp>
+#include <cpplox/vm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+namespace lox::profile {
+
+namespace {
+
+// FNV-1a, stable across builds unlike std::hash
+void mix(uint64_t &hash, std::string_view bytes) {
+	for (char byte : bytes) {
+		hash ^= static_cast<uint8_t>(byte);
+		hash *= 0x100000001b3;
+	}
+}
+
+} // namespace
+
+Key keyOf(std::string_view name, const Chunk &chunk) {
+	uint64_t hash = 0xcbf29ce484222325;
+	auto code = chunk.code();
+	mix(hash, {reinterpret_cast<const char *>(code.data()), code.size()});
+	for (const auto &constant : chunk.constants()) {
+		// separates the constants so their text can not run together
+		mix(hash, {"\0", 1});
+		mix(hash, constant.toString());
+	}
+	return Key{.name = std::string(name.empty() ? "<script>" : name),
+	           .hash = hash};
+}
+
+const FunctionProfile *Profile::find(std::string_view name,
+                                     const Chunk &chunk) const {
+	auto it = functions.find(keyOf(name, chunk));
+	return it != functions.end() ? &it->second : nullptr;
+}
+
+void Profile::apply(std::string_view name, const Chunk &chunk) const {
+	const auto *profile = find(name, chunk);
+	if (profile == nullptr) {
+		return;
+	}
+	auto instructions = chunk.instructions();
+	for (auto [index, op] : profile->types) {
+		// the quickened forms fall back to the generic one when the types
+		// change, so the profile only has to name the right instruction
+		if (index < instructions.size() &&
+		    opcodeInfo(op).flags == OpCodeFlags::QUICKENED &&
+		    instructions[index].op == genericForm(op)) {
+			instructions[index].op = op;
+		}
+	}
+	chunk.warm(profile->hotness);
+}
+
+void Profile::write(std::ostream &out) const {
+	out << "cpplox-profile 1\n";
+	for (const auto &[key, profile] : functions) {
+		out << std::format("function {:016x} {} {}\n", key.hash,
+		                   profile.hotness, key.name);
+		for (auto [index, op] : profile.types) {
+			out << std::format("type {} {}\n", index, opcodeInfo(op).name);
+		}
+		for (const auto &[index, counts] : profile.branches) {
+			out << std::format("branch {} {} {}\n", index, counts.first,
+			                   counts.second);
+		}
+		for (const auto &[site, count] : profile.targets) {
+			out << std::format("target {} {} {:016x} {}\n", site.first, count,
+			                   site.second.hash, site.second.name);
+		}
+	}
+}
+
+auto Profile::read(std::istream &in) -> std::expected<Profile, std::string> {
+	Profile result;
+	FunctionProfile *function = nullptr;
+	std::string line;
+	size_t number = 0;
+	auto error = [&](std::string_view message) {
+		return std::unexpected(std::format("line {}: {}", number, message));
+	};
+	// names end the line
+	auto readName = [](std::istringstream &fields, Key &key) {
+		fields >> std::ws;
+		std::getline(fields, key.name);
+		return !key.name.empty();
+	};
+	while (std::getline(in, line)) {
+		++number;
+		std::istringstream fields(line);
+		std::string kind;
+		fields >> kind;
+		if (number == 1) {
+			int version = 0;
+			if (kind != "cpplox-profile" || !(fields >> version) ||
+			    version != 1) {
+				return error("not a cpplox profile");
+			}
+			continue;
+		}
+		if (kind.empty()) {
+			continue;
+		}
+		if (kind == "function") {
+			Key key;
+			uint64_t hotness = 0;
+			fields >> std::hex >> key.hash >> std::dec >> hotness;
+			if (!fields || !readName(fields, key)) {
+				return error("malformed function");
+			}
+			function = &result.functions[std::move(key)];
+			function->hotness = hotness;
+			continue;
+		}
+		if (function == nullptr) {
+			return error(std::format("{} outside of a function", kind));
+		}
+		uint32_t index = 0;
+		if (!(fields >> index)) {
+			return error(std::format("malformed {}", kind));
+		}
+		if (kind == "type") {
+			std::string name;
+			fields >> name;
+			auto info = std::ranges::find(opcodes, name, &OpCodeInfo::name);
+			if (info == opcodes.end()) {
+				return error(std::format("unknown opcode {}", name));
+			}
+			function->types[index] =
+			    static_cast<OpCode>(std::distance(opcodes.begin(), info));
+		} else if (kind == "branch") {
+			auto &counts = function->branches[index];
+			if (!(fields >> counts.first >> counts.second)) {
+				return error("malformed branch");
+			}
+		} else if (kind == "target") {
+			uint64_t count = 0;
+			Key key;
+			fields >> count >> std::hex >> key.hash >> std::dec;
+			if (!fields || !readName(fields, key)) {
+				return error("malformed target");
+			}
+			function->targets[{index, std::move(key)}] = count;
+		} else {
+			return error(std::format("unknown entry {}", kind));
+		}
+	}
+	if (number == 0) {
+		return error("not a cpplox profile");
+	}
+	return result;
+}
+
+Recorder::Seen &Recorder::seen(const ObjFunction &function) {
+	auto [it, inserted] = functions.try_emplace(function.chunk.get());
+	if (inserted) {
+		it->second.key = keyOf(function.name, *function.chunk);
+		it->second.chunk = function.chunk;
+	}
+	return it->second;
+}
+
+void Recorder::beforeInstruction(const VM &vm, const Chunk &chunk,
+                                 const Instruction &instruction) {
+	// every frame is announced by onCall before it runs
+	if (current == nullptr || current->chunk.get() != &chunk) {
+		auto it = functions.find(&chunk);
+		if (it == functions.end()) {
+			return;
+		}
+		current = &it->second;
+	}
+	auto &profile = current->profile;
+	auto index =
+	    static_cast<uint32_t>(&instruction - chunk.instructions().data());
+	auto stack = vm.stackView();
+	auto branch = [&](bool taken) {
+		auto &counts = profile.branches[index];
+		++(taken ? counts.first : counts.second);
+	};
+	switch (instruction.op) {
+	case OpCode::OP_LOOP:
+		++profile.hotness;
+		break;
+	case OpCode::OP_JUMP_IF_FALSE:
+	case OpCode::OP_JUMP_IF_FALSE_POP:
+		if (!stack.empty()) {
+			branch(!stack.back().isTruthy());
+		}
+		break;
+	case OpCode::OP_LESS_JUMP: {
+		// operands that are not numbers end the run with an error
+		if (stack.size() >= 2 && stack[stack.size() - 2].isNumber() &&
+		    stack.back().isNumber()) {
+			branch(!(stack[stack.size() - 2].asNumber() <
+			         stack.back().asNumber()));
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Recorder::onCall(const VM &vm, const CallFrame &frame) {
+	auto &callee = seen(frame.closure.function.get());
+	++callee.profile.hotness;
+	// the call site of a tail call belongs to a frame that is gone
+	auto frames = vm.frames();
+	if (frame.elided != 0 || frames.size() < 2) {
+		return;
+	}
+	const auto &caller = frames[frames.size() - 2];
+	auto &site = seen(caller.closure.function.get());
+	auto index = static_cast<uint32_t>(
+	    caller.ip - 1 - caller.closure.chunk()->instructions().data());
+	++site.profile.targets[{index, callee.key}];
+}
+
+Profile Recorder::profile() const {
+	Profile result;
+	for (const auto &[chunk, seen] : functions) {
+		auto &profile = result.functions[seen.key];
+		profile = seen.profile;
+		auto instructions = chunk->instructions();
+		for (size_t index = 0; index < instructions.size(); ++index) {
+			auto op = instructions[index].op;
+			if (opcodeInfo(op).flags == OpCodeFlags::QUICKENED) {
+				profile.types[static_cast<uint32_t>(index)] = op;
+			}
+		}
+	}
+	return result;
+}
+
+} // namespace lox::profile
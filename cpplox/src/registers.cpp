@@ -0,0 +1,447 @@
+#include <cpplox/chunk.hpp>
+#include <cpplox/registers.hpp>
+#include <cpplox/verifier.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace lox::registers {
+
+namespace {
+
+// instructions that only write their a register after reading the others,
+// so the register can be changed to the local their result is assigned to
+bool writesResult(RegOp instruction) {
+	switch (instruction) {
+	case RegOp::OP_MOVE:
+	case RegOp::OP_NIL:
+	case RegOp::OP_TRUE:
+	case RegOp::OP_FALSE:
+	case RegOp::OP_GET_GLOBAL:
+	case RegOp::OP_GET_UPVALUE:
+	case RegOp::OP_EQUAL:
+	case RegOp::OP_NOT_EQUAL:
+	case RegOp::OP_GREATER:
+	case RegOp::OP_GREATER_EQUAL:
+	case RegOp::OP_LESS:
+	case RegOp::OP_LESS_EQUAL:
+	case RegOp::OP_ADD:
+	case RegOp::OP_SUBTRACT:
+	case RegOp::OP_MULTIPLY:
+	case RegOp::OP_DIVIDE:
+	case RegOp::OP_NOT:
+	case RegOp::OP_NEGATE:
+	case RegOp::OP_GET_PROPERTY:
+	case RegOp::OP_GET_SUPER:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// the compare and jump form of a comparison, OP_MOVE when there is none
+RegOp jumpForm(RegOp instruction) {
+	switch (instruction) {
+	case RegOp::OP_EQUAL:
+		return RegOp::OP_EQUAL_JUMP;
+	case RegOp::OP_NOT_EQUAL:
+		return RegOp::OP_NOT_EQUAL_JUMP;
+	case RegOp::OP_GREATER:
+		return RegOp::OP_GREATER_JUMP;
+	case RegOp::OP_GREATER_EQUAL:
+		return RegOp::OP_GREATER_EQUAL_JUMP;
+	case RegOp::OP_LESS:
+		return RegOp::OP_LESS_JUMP;
+	case RegOp::OP_LESS_EQUAL:
+		return RegOp::OP_LESS_EQUAL_JUMP;
+	default:
+		return RegOp::OP_MOVE;
+	}
+}
+
+RegOp binaryForm(OpCode instruction) {
+	switch (instruction) {
+	case OpCode::OP_EQUAL:
+		return RegOp::OP_EQUAL;
+	case OpCode::OP_NOT_EQUAL:
+		return RegOp::OP_NOT_EQUAL;
+	case OpCode::OP_GREATER:
+		return RegOp::OP_GREATER;
+	case OpCode::OP_GREATER_EQUAL:
+		return RegOp::OP_GREATER_EQUAL;
+	case OpCode::OP_LESS:
+		return RegOp::OP_LESS;
+	case OpCode::OP_LESS_EQUAL:
+		return RegOp::OP_LESS_EQUAL;
+	case OpCode::OP_ADD:
+		return RegOp::OP_ADD;
+	case OpCode::OP_SUBTRACT:
+		return RegOp::OP_SUBTRACT;
+	case OpCode::OP_MULTIPLY:
+		return RegOp::OP_MULTIPLY;
+	default:
+		return RegOp::OP_DIVIDE;
+	}
+}
+
+class Generator {
+  public:
+	// false when the code has an instruction the stack backend only makes
+	// at run time
+	bool translate(std::span<const Instruction> instructions,
+	               const std::vector<size_t> &depths);
+
+	RegChunk result;
+
+  private:
+	void emit(RegOp op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+		result.code.push_back(
+		    {.op = op, .a = a, .b = b, .c = c, .source = source});
+	}
+	void jump(RegOp op, uint32_t target, uint32_t b = 0, uint32_t c = 0) {
+		jumps.emplace_back(result.code.size(), target);
+		emit(op, target, b, c);
+	}
+	// position of the value pushed next, its register holds it once the
+	// instruction writing it has been emitted
+	uint32_t push() {
+		auto position = static_cast<uint32_t>(stack.size());
+		stack.push_back(position);
+		return position;
+	}
+	uint32_t pop() {
+		uint32_t value = stack.back();
+		stack.pop_back();
+		return value;
+	}
+	void materialize(size_t position) {
+		if (stack[position] != position) {
+			emit(RegOp::OP_MOVE, position, stack[position]);
+			stack[position] = position;
+		}
+	}
+	void materializeAll() {
+		for (size_t position = 0; position < stack.size(); ++position) {
+			materialize(position);
+		}
+	}
+	// register holding the value of the position, constants are moved into
+	// the position first
+	uint32_t reg(size_t position) {
+		if (stack[position] & constant_operand) {
+			materialize(position);
+		}
+		return stack[position];
+	}
+	// values still read from the register are moved out before it changes
+	void beforeWrite(uint32_t reg) {
+		for (size_t position = 0; position < stack.size(); ++position) {
+			if (position != reg && stack[position] == reg) {
+				materialize(position);
+			}
+		}
+	}
+	// true when the last instruction wrote the value of the position
+	bool lastWrote(uint32_t position) const {
+		return stack[position] == position && result.code.size() > blockStart &&
+		       result.code.back().a == position &&
+		       writesResult(result.code.back().op);
+	}
+	void store(uint32_t local, uint32_t position);
+
+	// operand holding the value of each stack position, the position itself
+	// once the value is in its register. they only name lower positions, so
+	// popping a value never leaves another one without its register
+	std::vector<uint32_t> stack;
+	// stack instruction being translated
+	uint32_t source = 0;
+	// results written before the start of the block may be read by a jump
+	// into it, they are never changed
+	size_t blockStart = 0;
+	// jumps with the stack instruction they go to
+	std::vector<std::pair<size_t, uint32_t>> jumps;
+};
+
+void Generator::store(uint32_t local, uint32_t position) {
+	uint32_t value = stack[position];
+	if (value == local) {
+		return;
+	}
+	beforeWrite(local);
+	if (lastWrote(position)) {
+		// the result goes straight into the local
+		result.code.back().a = local;
+		stack[position] = local;
+	} else {
+		emit(RegOp::OP_MOVE, local, value);
+	}
+	stack[local] = local;
+}
+
+bool Generator::translate(std::span<const Instruction> instructions,
+                          const std::vector<size_t> &depths) {
+	// every value is in its register at a jump target
+	std::vector<bool> targets(instructions.size());
+	for (const auto &instruction : instructions) {
+		if (opcodeInfo(instruction.op).isJump()) {
+			targets[instruction.operand] = true;
+		}
+	}
+	std::vector<uint32_t> labels(instructions.size(), UINT32_MAX);
+	bool fallsThrough = false;
+	for (size_t i = 0; i < instructions.size(); ++i) {
+		const auto &instruction = instructions[i];
+		size_t depth = depths[i];
+		if (depth == SIZE_MAX) {
+			fallsThrough = false;
+			continue;
+		}
+		source = static_cast<uint32_t>(i);
+		if (!fallsThrough) {
+			stack.clear();
+			for (size_t position = 0; position < depth; ++position) {
+				push();
+			}
+		} else if (targets[i]) {
+			materializeAll();
+		}
+		if (targets[i]) {
+			blockStart = result.code.size();
+		}
+		labels[i] = result.code.size();
+		fallsThrough = !opcodeInfo(instruction.op).isTerminal();
+
+		uint32_t operand = instruction.operand;
+		switch (instruction.op) {
+		case OpCode::OP_CONSTANT:
+			stack.push_back(constant_operand | operand);
+			break;
+		case OpCode::OP_NIL:
+			emit(RegOp::OP_NIL, push());
+			break;
+		case OpCode::OP_TRUE:
+			emit(RegOp::OP_TRUE, push());
+			break;
+		case OpCode::OP_FALSE:
+			emit(RegOp::OP_FALSE, push());
+			break;
+		case OpCode::OP_POP:
+			pop();
+			break;
+		case OpCode::OP_GET_LOCAL:
+			stack.push_back(stack[operand]);
+			break;
+		case OpCode::OP_SET_LOCAL:
+			store(operand, depth - 1);
+			break;
+		case OpCode::OP_SET_LOCAL_POP:
+			store(operand, depth - 1);
+			pop();
+			break;
+		case OpCode::OP_GET_GLOBAL:
+			emit(RegOp::OP_GET_GLOBAL, push(), operand);
+			break;
+		case OpCode::OP_DEFINE_GLOBAL:
+			emit(RegOp::OP_DEFINE_GLOBAL, pop(), operand);
+			break;
+		case OpCode::OP_SET_GLOBAL:
+			emit(RegOp::OP_SET_GLOBAL, stack.back(), operand);
+			break;
+		case OpCode::OP_GET_UPVALUE:
+			emit(RegOp::OP_GET_UPVALUE, push(), operand);
+			break;
+		case OpCode::OP_SET_UPVALUE:
+			emit(RegOp::OP_SET_UPVALUE, operand, stack.back());
+			break;
+		case OpCode::OP_EQUAL:
+		case OpCode::OP_NOT_EQUAL:
+		case OpCode::OP_GREATER:
+		case OpCode::OP_GREATER_EQUAL:
+		case OpCode::OP_LESS:
+		case OpCode::OP_LESS_EQUAL:
+		case OpCode::OP_ADD:
+		case OpCode::OP_SUBTRACT:
+		case OpCode::OP_MULTIPLY:
+		case OpCode::OP_DIVIDE: {
+			uint32_t c = pop();
+			uint32_t b = pop();
+			emit(binaryForm(instruction.op), push(), b, c);
+			break;
+		}
+		case OpCode::OP_NOT:
+		case OpCode::OP_NEGATE: {
+			uint32_t b = pop();
+			emit(instruction.op == OpCode::OP_NOT ? RegOp::OP_NOT
+			                                      : RegOp::OP_NEGATE,
+			     push(), b);
+			break;
+		}
+		case OpCode::OP_PRINT:
+			emit(RegOp::OP_PRINT, pop());
+			break;
+		case OpCode::OP_JUMP:
+		case OpCode::OP_LOOP:
+			materializeAll();
+			jump(RegOp::OP_JUMP, operand);
+			break;
+		case OpCode::OP_JUMP_IF_FALSE:
+			materializeAll();
+			jump(RegOp::OP_JUMP_IF_FALSE, operand, stack.back());
+			break;
+		case OpCode::OP_JUMP_IF_FALSE_POP: {
+			// a comparison that is only tested jumps on its own
+			if (lastWrote(depth - 1) &&
+			    jumpForm(result.code.back().op) != RegOp::OP_MOVE) {
+				RegInstruction compare = result.code.back();
+				result.code.pop_back();
+				pop();
+				materializeAll();
+				jump(jumpForm(compare.op), operand, compare.b, compare.c);
+				break;
+			}
+			uint32_t condition = pop();
+			materializeAll();
+			jump(RegOp::OP_JUMP_IF_FALSE, operand, condition);
+			break;
+		}
+		case OpCode::OP_LESS_JUMP: {
+			uint32_t c = pop();
+			uint32_t b = pop();
+			materializeAll();
+			jump(RegOp::OP_LESS_JUMP, operand, b, c);
+			break;
+		}
+		case OpCode::OP_CALL:
+		case OpCode::OP_TAIL_CALL: {
+			// the callee reads its arguments from the registers and may
+			// change captured locals
+			materializeAll();
+			auto base = static_cast<uint32_t>(depth - operand - 1);
+			emit(instruction.op == OpCode::OP_CALL ? RegOp::OP_CALL
+			                                       : RegOp::OP_TAIL_CALL,
+			     base, operand);
+			stack.resize(base + 1);
+			break;
+		}
+		case OpCode::OP_CLOSURE:
+			// captured locals have to be in their register
+			materializeAll();
+			emit(RegOp::OP_CLOSURE, push(), operand);
+			break;
+		case OpCode::OP_CLOSE_UPVALUE:
+			materializeAll();
+			emit(RegOp::OP_CLOSE_UPVALUE, pop());
+			break;
+		case OpCode::OP_CLASS:
+			emit(RegOp::OP_CLASS, push(), operand);
+			break;
+		case OpCode::OP_INHERIT: {
+			uint32_t subclass = reg(depth - 1);
+			emit(RegOp::OP_INHERIT, reg(depth - 2), subclass);
+			pop();
+			break;
+		}
+		case OpCode::OP_METHOD: {
+			uint32_t function = reg(depth - 1);
+			emit(RegOp::OP_METHOD, reg(depth - 2), function, operand);
+			pop();
+			break;
+		}
+		case OpCode::OP_GET_PROPERTY: {
+			uint32_t object = reg(depth - 1);
+			pop();
+			emit(RegOp::OP_GET_PROPERTY, push(), object, operand);
+			break;
+		}
+		case OpCode::OP_SET_PROPERTY: {
+			uint32_t value = stack[depth - 1];
+			emit(RegOp::OP_SET_PROPERTY, reg(depth - 2), value, operand);
+			pop();
+			pop();
+			// the assigned value is the result, a temporary above the
+			// object is moved down unless the result is dropped right away
+			bool dropped = i + 1 < instructions.size() && !targets[i + 1] &&
+			               instructions[i + 1].op == OpCode::OP_POP;
+			if (value == depth - 1 && !dropped) {
+				emit(RegOp::OP_MOVE, push(), value);
+			} else if (value == depth - 1) {
+				push();
+			} else {
+				stack.push_back(value);
+			}
+			break;
+		}
+		case OpCode::OP_GET_SUPER: {
+			uint32_t superclass = reg(depth - 1);
+			uint32_t instance = reg(depth - 2);
+			pop();
+			pop();
+			emit(RegOp::OP_GET_SUPER, push(), instance, superclass);
+			break;
+		}
+		case OpCode::OP_INVOKE:
+		case OpCode::OP_SUPER_INVOKE: {
+			materializeAll();
+			uint32_t argCount = instruction.operand2;
+			bool super = instruction.op == OpCode::OP_SUPER_INVOKE;
+			auto base = static_cast<uint32_t>(depth - argCount - 1 - super);
+			emit(super ? RegOp::OP_SUPER_INVOKE : RegOp::OP_INVOKE, base,
+			     argCount, operand);
+			stack.resize(base + 1);
+			break;
+		}
+		case OpCode::OP_RETURN:
+			emit(RegOp::OP_RETURN, pop());
+			break;
+		case OpCode::OP_ADD_LOCALS: {
+			uint32_t b = stack[operand];
+			uint32_t c = stack[instruction.operand2];
+			emit(RegOp::OP_ADD, push(), b, c);
+			break;
+		}
+		case OpCode::OP_ADD_CONSTANT: {
+			uint32_t b = pop();
+			emit(RegOp::OP_ADD, push(), b, constant_operand | operand);
+			break;
+		}
+		case OpCode::OP_INCREMENT_LOCAL:
+			beforeWrite(operand);
+			emit(RegOp::OP_ADD, operand, stack[operand],
+			     constant_operand | instruction.operand2);
+			stack[operand] = operand;
+			break;
+		default:
+			return false;
+		}
+		result.registers = std::max(result.registers, stack.size());
+	}
+	for (auto [index, target] : jumps) {
+		if (labels[target] == UINT32_MAX) {
+			return false;
+		}
+		result.code[index].a = labels[target];
+	}
+	return true;
+}
+
+} // namespace
+
+std::shared_ptr<RegChunk> generate(const Chunk &chunk, size_t arity) {
+	auto depths = verifier::stackDepths(chunk, arity);
+	if (!depths.has_value()) {
+		return nullptr;
+	}
+	Generator generator;
+	generator.result.registers = arity;
+	if (!generator.translate(chunk.instructions(), *depths)) {
+		return nullptr;
+	}
+	return std::make_shared<RegChunk>(std::move(generator.result));
+}
+
+} // namespace lox::registers
@@ -12,6 +12,13 @@ Scanner::Scanner(std::string_view source) {
 	this->line = 1;
 }
 
+Scanner::Scanner(std::string_view source, size_t offset, size_t line) {
+	this->source = source;
+	this->start = source.begin() + offset;
+	this->current = source.begin() + offset;
+	this->line = line;
+}
+
 Token Scanner::scanToken() {
 	skipWhitespace();
 	start = current;
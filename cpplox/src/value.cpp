@@ -2,51 +2,74 @@
 #include <cpplox/obj.hpp>
 #include <cpplox/value.hpp>
 
+#include <cstdint>
 #include <format>
 #include <string>
 #include <variant>
 
 namespace lox {
 
-Value::Value() : value(std::monostate{}) {}
+namespace {
 
-Value::Value(bool value) : value(value) {}
+std::string integerToString(int64_t value) {
+	// shortest double formatting switches to an exponent for long runs of
+	// trailing zeros, only format directly where both agree
+	constexpr int64_t limit = 1'000'000'000'000'000;
+	if (value % 10000 != 0 && value < limit && value > -limit) {
+		return std::format("{}", value);
+	}
+	return std::format("{}", static_cast<double>(value));
+}
 
-Value::Value(double value) : value(value) {}
+bool numbersEqual(const Value &a, const Value &b) {
+	if (a.isInt() && b.isInt()) {
+		return a.asInt() == b.asInt();
+	}
+	return a.asNumber() == b.asNumber();
+}
 
-Value::Value(const std::string_view value) : value(std::string(value)) {}
+} // namespace
 
-Value::Value(const NativeFn &function) : value(Obj{ObjNative{function}}) {}
+#if CPPLOX_NAN_BOXING
 
-Value::Value(ObjFunction &&value) : value(Obj{std::move(value)}) {}
+std::string Value::toString() const {
+	if (isInt()) {
+		return integerToString(asInt());
+	}
+	if (isNumber()) {
+		return std::format("{}", asNumber());
+	}
+	if (isBool()) {
+		return std::format("{}", asBool());
+	}
+	if (isObj()) {
+		return asObj().toString();
+	}
+	return "nil";
+}
 
-Value::Value(const Value &other) : value(other.clone().value) {}
+bool Value::equals(const Value &other) const {
+	if (isNumber() && other.isNumber()) {
+		return numbersEqual(*this, other);
+	}
+	if (isObj() && other.isObj()) {
+		return bits == other.bits || asObj() == other.asObj();
+	}
+	// nil and booleans are unique bit patterns
+	return bits == other.bits;
+}
 
-Value::Value(Value &&other) noexcept : value(std::move(other.value)) {}
+#else
 
-Value &Value::operator=(const Value &other) {
-	value = other.clone().value;
-	return *this;
-}
+Value::Value() : value(std::monostate{}) {}
 
-Value &Value::operator=(Value &&other) noexcept {
-	value = std::move(other.value);
-	return *this;
-}
+Value::Value(bool value) : value(value) {}
 
-Value Value::clone() const {
-	Value result;
-	std::visit(
-	    overloads{
+Value::Value(double value) : value(value) {}
 
-	        [&result](bool value) { result = Value{value}; },
-	        [&result](double value) { result = Value{value}; },
-	        [&result](const Obj &value) { result.value = value.clone(); },
-	        [&result](std::monostate) { result = Value{}; },
-	    },
-	    value);
-	return result;
-}
+Value::Value(int64_t value) : value(value) {}
+
+Value::Value(Obj *object) : value(std::in_place_type<Obj *>, object) {}
 
 std::string Value::toString() const {
 	std::string result;
@@ -54,10 +77,10 @@ std::string Value::toString() const {
 	    overloads{
 	        [&result](bool value) { result = std::format("{}", value); },
 	        [&result](double value) { result = std::format("{}", value); },
-	        [&result](const Obj &value) {
-		        result = std::format("{}", value.toString());
-	        },
+	        [&result](int64_t value) { result = integerToString(value); },
+	        [&result](Obj *value) { result = value->toString(); },
 	        [&result](std::monostate) { result = std::format("nil"); },
+	        [&result](Undefined) { result = std::format("undefined"); },
 	    },
 	    value);
 
@@ -80,12 +103,17 @@ bool Value::isTruthy() const {
 }
 
 bool Value::equals(const Value &other) const {
+	// integers and doubles compare by their numeric value
+	if (isNumber() && other.isNumber()) {
+		return numbersEqual(*this, other);
+	}
 	bool result = false;
 	std::visit(overloads{
-	               [&result](double a, double b) { result = a == b; },
 	               [&result](bool a, bool b) { result = a == b; },
 	               [&result](std::monostate, std::monostate) { result = true; },
-	               [&result](const Obj &a, const Obj &b) { result = a == b; },
+	               [&result](Obj *a, Obj *b) {
+		               result = a == b || *a == *b;
+	               },
 	               // dont bother comparing different types
 	               [](const auto &, const auto &) {},
 	           },
@@ -93,4 +121,6 @@ bool Value::equals(const Value &other) const {
 	return result;
 }
 
+#endif
+
 } // namespace lox
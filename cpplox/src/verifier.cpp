@@ -0,0 +1,214 @@
+#include <cpplox/chunk.hpp>
+#include <cpplox/obj.hpp>
+#include <cpplox/verifier.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <expected>
+#include <format>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace lox::verifier {
+
+namespace {
+
+struct StackEffect {
+	// values the instruction reads from the top of the stack
+	size_t pops = 0;
+	size_t pushes = 0;
+	// extra values pushed while it runs, the fused instructions fall back
+	// to the generic ones through the stack
+	size_t scratch = 0;
+};
+
+StackEffect stackEffect(const Instruction &instruction) {
+	const auto &info = opcodeInfo(instruction.op);
+	StackEffect effect{
+	    .pops = info.pops, .pushes = info.pushes, .scratch = info.scratch};
+	// calls also pop their arguments
+	if (info.operands[0] == OperandKind::COUNT) {
+		effect.pops += instruction.operand;
+	} else if (info.operands[1] == OperandKind::COUNT) {
+		effect.pops += instruction.operand2;
+	}
+	return effect;
+}
+
+struct Analysis {
+	std::vector<size_t> depths;
+	size_t maxDepth;
+};
+
+auto analyze(const Chunk &chunk, size_t arity)
+    -> std::expected<Analysis, std::string> {
+	auto instructions = chunk.instructions();
+	auto constants = chunk.constants();
+	constexpr size_t unknown = SIZE_MAX;
+	// stack depth on entry of each instruction, counted from the first
+	// argument slot of the frame
+	std::vector<size_t> depths(instructions.size(), unknown);
+	std::vector<size_t> pending;
+	size_t maxDepth = arity;
+
+	auto reach = [&](size_t index,
+	                 size_t depth) -> std::expected<void, std::string> {
+		if (index >= instructions.size()) {
+			return std::unexpected(std::format("jump out of the code to {}", index));
+		}
+		if (depths[index] == unknown) {
+			depths[index] = depth;
+			pending.push_back(index);
+		} else if (depths[index] != depth) {
+			return std::unexpected(std::format(
+			    "stack depth {} and {} meet at offset {}", depths[index], depth,
+			    instructions[index].offset));
+		}
+		return {};
+	};
+
+	if (instructions.empty()) {
+		return std::unexpected("empty code");
+	}
+	if (auto reached = reach(0, arity); !reached) {
+		return std::unexpected(reached.error());
+	}
+	while (!pending.empty()) {
+		size_t index = pending.back();
+		pending.pop_back();
+		const auto &instruction = instructions[index];
+		size_t depth = depths[index];
+		auto error = [&](std::string_view message) {
+			return std::unexpected(
+			    std::format("{} at offset {}", message, instruction.offset));
+		};
+
+		auto effect = stackEffect(instruction);
+		if (depth < effect.pops) {
+			return error("stack underflow");
+		}
+
+		const auto &info = opcodeInfo(instruction.op);
+		if (info.flags == OpCodeFlags::PREFIX) {
+			return error("unknown opcode");
+		}
+		std::array operands{instruction.operand, instruction.operand2};
+		for (size_t i = 0; i < info.operandCount(); ++i) {
+			if (info.operands[i] == OperandKind::CONSTANT &&
+			    operands[i] >= constants.size()) {
+				return error("constant index out of bounds");
+			}
+			if (info.operands[i] == OperandKind::LOCAL && operands[i] >= depth) {
+				return error("local index out of bounds");
+			}
+			if (info.operands[i] == OperandKind::UPVALUE &&
+			    operands[i] >= chunk.captures().size()) {
+				return error("upvalue index out of bounds");
+			}
+		}
+		// classes, methods and properties are looked up by the name in
+		// their constant
+		bool named = info.flags == OpCodeFlags::CACHED ||
+		             instruction.op == OpCode::OP_CLASS ||
+		             instruction.op == OpCode::OP_METHOD;
+		if (named && !(constants[instruction.operand].isObj() &&
+		               std::holds_alternative<ObjString>(
+		                   constants[instruction.operand].asObj().value))) {
+			return error("name constant is not a string");
+		}
+		const auto *function =
+		    info.operands[0] == OperandKind::CONSTANT &&
+		            constants[instruction.operand].isObj()
+		        ? std::get_if<ObjFunction>(
+		              &constants[instruction.operand].asObj().value)
+		        : nullptr;
+		if (instruction.op == OpCode::OP_CLOSURE) {
+			if (function == nullptr) {
+				return error("closure of a non function constant");
+			}
+			// the captured locals have to be in the frame when the closure
+			// is made
+			for (const auto &capture : function->chunk->captures()) {
+				if (capture.isLocal ? capture.index > depth
+				                    : capture.index >= chunk.captures().size()) {
+					return error("capture out of bounds");
+				}
+			}
+		} else if (function != nullptr &&
+		           !function->chunk->captures().empty()) {
+			// only OP_CLOSURE gives a function its upvalues
+			return error("function that captures variables used as a value");
+		}
+		// the assigned value is on top of the local
+		if (instruction.op == OpCode::OP_SET_LOCAL_POP &&
+		    instruction.operand + 1 >= depth) {
+			return error("local index out of bounds");
+		}
+
+		size_t next = depth - effect.pops + effect.pushes;
+		maxDepth = std::max(maxDepth, next + effect.scratch);
+
+		if (info.isJump()) {
+			if (auto reached = reach(instruction.operand, next); !reached) {
+				return std::unexpected(reached.error());
+			}
+		}
+		if (!info.isTerminal()) {
+			if (auto reached = reach(index + 1, next); !reached) {
+				return std::unexpected(reached.error());
+			}
+		}
+	}
+	return Analysis{.depths = std::move(depths), .maxDepth = maxDepth};
+}
+
+} // namespace
+
+auto verify(const Chunk &chunk, size_t arity)
+    -> std::expected<size_t, std::string> {
+	auto analysis = analyze(chunk, arity);
+	if (!analysis.has_value()) {
+		return std::unexpected(std::move(analysis.error()));
+	}
+	return analysis->maxDepth;
+}
+
+auto stackDepths(const Chunk &chunk, size_t arity)
+    -> std::expected<std::vector<size_t>, std::string> {
+	auto analysis = analyze(chunk, arity);
+	if (!analysis.has_value()) {
+		return std::unexpected(std::move(analysis.error()));
+	}
+	return std::move(analysis->depths);
+}
+
+bool verifyFunction(const ObjFunction &function) {
+	auto &chunk = *function.chunk;
+	// skipped bodies are verified once they are compiled
+	if (chunk.lazy() != nullptr) {
+		return true;
+	}
+	if (!chunk.maxStack().has_value()) {
+		// the receiver of a method sits in the slot below its arguments
+		auto depth = verify(chunk, function.arity + function.isMethod);
+		if (!depth.has_value()) {
+			return false;
+		}
+		chunk.setMaxStack(*depth);
+	}
+	for (const auto &constant : chunk.constants()) {
+		if (!constant.isObj()) {
+			continue;
+		}
+		if (auto *nested = std::get_if<ObjFunction>(&constant.asObj().value);
+		    nested && !verifyFunction(*nested)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+} // namespace lox::verifier
@@ -1,31 +1,211 @@
 #include <cpplox/private/constants.hpp>
 
+#include <cpplox/arithmetic.hpp>
 #include <cpplox/chunk.hpp>
+#include <cpplox/class.hpp>
 #include <cpplox/compiler.hpp>
 #include <cpplox/debug.hpp>
+#include <cpplox/jit.hpp>
 #include <cpplox/obj.hpp>
 #include <cpplox/terminal.hpp>
 #include <cpplox/value.hpp>
+#include <cpplox/verifier.hpp>
 #include <cpplox/vm.hpp>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <format>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <ranges>
 #include <span>
+#include <string>
 #include <string_view>
 #include <variant>
 
 namespace lox {
 
-VM::VM()
-    : debug_trace_instruction(constants::debug_trace_instruction),
-      debug_trace_stack(constants::debug_trace_stack) {
+namespace {
+
+bool isGlobalInstruction(OpCode instruction) {
+	return instruction == OpCode::OP_GET_GLOBAL ||
+	       instruction == OpCode::OP_DEFINE_GLOBAL ||
+	       instruction == OpCode::OP_SET_GLOBAL;
+}
+
+OpCode numberForm(OpCode instruction) {
+	switch (instruction) {
+	case OpCode::OP_ADD:
+		return OpCode::OP_ADD_NUM;
+	case OpCode::OP_SUBTRACT:
+		return OpCode::OP_SUBTRACT_NUM;
+	case OpCode::OP_MULTIPLY:
+		return OpCode::OP_MULTIPLY_NUM;
+	case OpCode::OP_DIVIDE:
+		return OpCode::OP_DIVIDE_NUM;
+	case OpCode::OP_GREATER:
+		return OpCode::OP_GREATER_NUM;
+	case OpCode::OP_GREATER_EQUAL:
+		return OpCode::OP_GREATER_EQUAL_NUM;
+	case OpCode::OP_LESS:
+		return OpCode::OP_LESS_NUM;
+	case OpCode::OP_LESS_EQUAL:
+		return OpCode::OP_LESS_EQUAL_NUM;
+	default:
+		return instruction;
+	}
+}
+
+// the integer form of the quickened instruction, division always produces
+// a double so it has none
+OpCode integerForm(OpCode instruction) {
+	switch (instruction) {
+	case OpCode::OP_ADD:
+		return OpCode::OP_ADD_INT;
+	case OpCode::OP_SUBTRACT:
+		return OpCode::OP_SUBTRACT_INT;
+	case OpCode::OP_MULTIPLY:
+		return OpCode::OP_MULTIPLY_INT;
+	case OpCode::OP_GREATER:
+		return OpCode::OP_GREATER_INT;
+	case OpCode::OP_GREATER_EQUAL:
+		return OpCode::OP_GREATER_EQUAL_INT;
+	case OpCode::OP_LESS:
+		return OpCode::OP_LESS_INT;
+	case OpCode::OP_LESS_EQUAL:
+		return OpCode::OP_LESS_EQUAL_INT;
+	default:
+		return numberForm(instruction);
+	}
+}
+
+bool isString(const Value &value) {
+	return value.isObj() &&
+	       std::holds_alternative<ObjString>(value.asObj().value);
+}
+
+ObjInstance *instanceOf(Value &value) {
+	return value.isObj() ? std::get_if<ObjInstance>(&value.asObj().value)
+	                     : nullptr;
+}
+
+ObjClass *classOf(const Value &value) {
+	const auto *klass =
+	    value.isObj()
+	        ? std::get_if<std::shared_ptr<ObjClass>>(&value.asObj().value)
+	        : nullptr;
+	return klass != nullptr ? klass->get() : nullptr;
+}
+
+// the verifier only accepts string names, unverified code gets an empty one
+std::string_view nameOf(const Value &constant) {
+	const auto *name =
+	    constant.isObj() ? std::get_if<ObjString>(&constant.asObj().value)
+	                     : nullptr;
+	return name != nullptr ? std::string_view{name->chars()}
+	                       : std::string_view{};
+}
+
+// the string of the two joined. short results are copied and interned in
+// the heap, longer ones make a rope so appending to a long string in a loop
+// does not copy it every time
+Value concatenate(Heap &heap, const Value &a, const Value &b,
+                  size_t rope_threshold) {
+	const auto &left = std::get<ObjString>(a.asObj().value);
+	const auto &right = std::get<ObjString>(b.asObj().value);
+	if (left.size() + right.size() >= rope_threshold) {
+		return heap.allocate(Obj{ObjString{a, b}});
+	}
+	std::pmr::string result{heap.resource()};
+	result.reserve(left.size() + right.size());
+	result.append(left.chars()).append(right.chars());
+	return heap.intern(std::move(result));
+}
+
+// where a property read finds the property on instances of the shape, a
+// field shadows the method of the same name
+std::optional<PropertyCache::Entry> readEntry(const ObjInstance &instance,
+                                              std::string_view name) {
+	if (auto slot = instance.shape->find(name); slot.has_value()) {
+		return PropertyCache::Entry{
+		    .shape = instance.shape, .slot = *slot, .owner = instance.klass};
+	}
+	if (const auto *method = classOf(instance.klass)->findMethod(name);
+	    method) {
+		return PropertyCache::Entry{
+		    .shape = instance.shape, .method = method, .owner = instance.klass};
+	}
+	return std::nullopt;
+}
+
+// where a property write stores the field, instances that do not have it
+// yet move to the next shape
+PropertyCache::Entry writeEntry(const ObjInstance &instance,
+                                std::string_view name) {
+	if (auto slot = instance.shape->find(name); slot.has_value()) {
+		return {.shape = instance.shape, .slot = *slot, .owner = instance.klass};
+	}
+	return {.shape = instance.shape,
+	        .slot = static_cast<uint32_t>(instance.shape->size()),
+	        .transition = instance.shape->withField(name),
+	        .owner = instance.klass};
+}
+
+// the method of the superclass, keyed by the root shape of the superclass
+// since the site always names the same one
+std::optional<PropertyCache::Entry>
+superEntry(const Value &superclass, std::string_view name) {
+	const auto &klass = *classOf(superclass);
+	if (const auto *method = klass.findMethod(name); method) {
+		return PropertyCache::Entry{
+		    .shape = &klass.root, .method = method, .owner = superclass};
+	}
+	return std::nullopt;
+}
+
+// the function and the functions nested in its constants were compiled for
+// the register backend
+bool hasRegisterCode(const ObjFunction &function) {
+	// skipped bodies get their register code when they are compiled
+	if (const auto *body = function.chunk->lazy(); body != nullptr) {
+		return body->backend == Backend::REGISTER;
+	}
+	if (function.chunk->registers() == nullptr) {
+		return false;
+	}
+	return std::ranges::all_of(
+	    function.chunk->constants(), [](const Value &constant) {
+		    const auto *nested =
+		        constant.isObj()
+		            ? std::get_if<ObjFunction>(&constant.asObj().value)
+		            : nullptr;
+		    return nested == nullptr || hasRegisterCode(*nested);
+	    });
+}
+
+} // namespace
+
+VM::VM(std::pmr::memory_resource *resource)
+    : heap(resource), callFrames(resource), stack(resource),
+      open_upvalues(resource), global_slots(resource), global_names(resource),
+      globals(resource) {
+	if (constants::debug_trace_instruction || constants::debug_trace_stack) {
+		auto tracer = std::make_unique<debug::TraceHooks>();
+		tracer->trace_instruction = constants::debug_trace_instruction;
+		tracer->trace_stack = constants::debug_trace_stack;
+		hooks = tracer.get();
+		default_hooks = std::move(tracer);
+	}
 
 	defineNative("clock",
-	             [](size_t, std::span<std::reference_wrapper<Value>>) -> Value {
+	             [](size_t, std::span<Value>) -> Value {
 		             using namespace std::chrono;
 		             auto now = system_clock::now().time_since_epoch();
 		             auto ms = duration_cast<milliseconds>(now).count();
@@ -34,162 +214,266 @@ VM::VM()
 }
 
 void VM::defineNative(std::string_view name, NativeFn function) {
-	// could also use heterogeneous lookup, but just for this is not worth it
-	globals[std::string(name)] = function;
+	globals[globalSlot(name)] = heap.allocate(Obj{ObjNative{function}});
+}
+
+uint32_t VM::globalSlot(std::string_view name) {
+	auto [it, inserted] = global_slots.try_emplace(
+	    std::pmr::string(name, heap.resource()),
+	    static_cast<uint32_t>(globals.size()));
+	if (inserted) {
+		global_names.emplace_back(name);
+		globals.push_back(Value::undefined());
+	}
+	return it->second;
+}
+
+void VM::load(const ObjFunction &function) {
+	// skipped bodies are loaded once they are compiled
+	if (function.chunk->lazy() != nullptr) {
+		return;
+	}
+	// clones made by OP_CLOSURE share the decoded instructions, so they are
+	// resolved once for all of them. the slots are resolved again every time
+	// the function is loaded, in case another VM loaded it in between
+	auto constants = function.chunk->constants();
+	for (auto &instruction : function.chunk->instructions()) {
+		if (!isGlobalInstruction(instruction.op)) {
+			continue;
+		}
+		// unverified code can name a constant that does not exist, the
+		// checked loop then rejects the slot
+		instruction.operand2 =
+		    instruction.operand < constants.size()
+		        ? globalSlot(constants[instruction.operand].toString())
+		        : UINT32_MAX;
+	}
+	// the register code is only made from verified code, whose names exist
+	if (auto *registers = function.chunk->registers(); registers != nullptr) {
+		for (auto &instruction : registers->code) {
+			auto kind = regOpInfo(instruction.op).operands[2];
+			if (kind == RegOperandKind::GLOBAL) {
+				instruction.c = globalSlot(constants[instruction.b].toString());
+			}
+		}
+	}
+	for (const auto &constant : constants) {
+		if (!constant.isObj()) {
+			continue;
+		}
+		if (auto *nested = std::get_if<ObjFunction>(&constant.asObj().value);
+		    nested) {
+			load(*nested);
+		}
+	}
+}
+
+bool VM::compileLazy(const ObjFunction &function) {
+	if (!Compiler::compileBody(function)) {
+		runtimeError(
+		    std::format("Could not compile function '{}'.", function.name));
+		return false;
+	}
+	load(function);
+	// the loop without checks keeps running once the body is compiled, so
+	// it only accepts code that verifies
+	if (!verifier::verifyFunction(function) && verified_code) {
+		runtimeError(
+		    std::format("Could not verify function '{}'.", function.name));
+		return false;
+	}
+	return true;
+}
+
+void VM::setHooks(VMHooks *hooks) { this->hooks = hooks; }
+
+VMHooks *VM::getHooks() const { return hooks; }
+
+std::span<const Value> VM::stackView() const {
+	return {stack.data(), stackTop};
 }
 
+std::span<const CallFrame> VM::frames() const { return callFrames; }
+
 void VM::runtimeError(std::string_view message) {
-	std::cerr << std::format("{}\n", message);
+	// only the first error is kept, the trace is printed by reportError once
+	// the interpreter loop has stored its instruction pointer in the frame
+	if (!had_error) {
+		error_message = message;
+	}
+	had_error = true;
+}
+
+template <typename Operation>
+bool VM::numberOp(Instruction &instruction, OpCode generic,
+                  Operation operation) {
+	Value &a = peek(1);
+	const Value &b = peek();
+	if (a.isNumber() && b.isNumber()) [[likely]] {
+		a = numberResult(a, b, operation);
+		--stackTop;
+		return true;
+	}
+	instruction.op = generic;
+	return binaryOp(generic);
+}
+
+template <typename Operation>
+bool VM::integerOp(Instruction &instruction, OpCode generic,
+                   Operation operation) {
+	Value &a = peek(1);
+	const Value &b = peek();
+	if (a.isInt() && b.isInt()) [[likely]] {
+		a = operation(a.asInt(), b.asInt());
+		--stackTop;
+		return true;
+	}
+	instruction.op = generic;
+	return binaryOp(generic);
+}
+
+bool VM::addStrings(Instruction &instruction) {
+	Value &a = peek(1);
+	const Value &b = peek();
+	if (isString(a) && isString(b)) [[likely]] {
+		a = concatenate(heap, a, b, rope_threshold);
+		--stackTop;
+		return true;
+	}
+	instruction.op = OpCode::OP_ADD;
+	return binaryOp(OpCode::OP_ADD);
+}
+
+InterpretResult VM::reportError() {
+	std::cerr << std::format("{}\n", error_message);
+	size_t depth = 0;
+	size_t omitted = callFrames.size() > 2 * trace_frames
+	                     ? callFrames.size() - 2 * trace_frames
+	                     : 0;
 	for (auto it = callFrames.rbegin(); it != callFrames.rend(); it++) {
-		auto &frame = **it;
+		if (omitted > 0 && depth++ == trace_frames) {
+			std::cerr << std::format(
+			    "{}\n", cli::terminal::gray_colored(std::format(
+			                 "... {} frame(s) omitted", omitted)));
+			it += omitted - 1;
+			continue;
+		}
+		auto &frame = *it;
 		auto &function = frame.closure;
 		auto &chunk = *function.chunk();
-		size_t offset = frame.ip - chunk.code().begin();
-		size_t line = chunk.getLine(offset);
+		// the ip points past the instruction being executed
+		auto instructions = chunk.instructions();
+		auto *current = frame.ip > instructions.data() ? frame.ip - 1 : frame.ip;
+		size_t line = chunk.getLine(current->offset);
 		std::string name = function.toString();
 		std::cerr << std::format(
 		    "{} in {}\n",
 		    cli::terminal::green_colored(std::format("[Line {}]", line)),
 		    cli::terminal::yellow_colored(name));
+		if (frame.elided > 0) {
+			std::cerr << std::format(
+			    "{}\n", cli::terminal::gray_colored(std::format(
+			                 "... {} tail call frame(s) elided", frame.elided)));
+		}
 	}
-	had_error = true;
-	stack.clear();
+	resetStack();
+	return InterpretResult::RUNTIME_ERROR;
 }
 
-std::byte VM::readByte(std::span<const std::byte>::iterator &ip) {
-	return *ip++;
+bool VM::push(Value value) {
+	if (stackTop == stack.data() + stack.size()) [[unlikely]] {
+		runtimeError("Stack overflow.");
+		return false;
+	}
+	*stackTop++ = std::move(value);
+	stack_high = std::max<const Value *>(stack_high, stackTop);
+	return true;
 }
 
-std::byte VM::nextByte(std::span<const std::byte>::iterator &ip) {
-	return *++ip;
+Value VM::pop() { return std::move(*--stackTop); }
+
+Value &VM::peek(size_t distance) { return stackTop[-1 - distance]; }
+
+size_t VM::stackSize() const { return stackTop - stack.data(); }
+
+void VM::resetStack() {
+	// closures that outlive an error keep the values they captured
+	closeUpvalues(stack.data());
+	if (stack.size() != max_stack_size) {
+		stack = std::pmr::vector<Value>(max_stack_size, stack.get_allocator());
+		stack_high = stack.data();
+	}
+	stackTop = stack.data();
+	callFrames.clear();
+	if (callFrames.capacity() < max_callframes_size) {
+		callFrames.reserve(max_callframes_size);
+	}
 }
 
-std::byte VM::peekByte(std::span<const std::byte>::iterator &ip) { return *ip; }
+bool VM::binaryOp(OpCode instruction) {
+	auto vb = pop();
+	auto va = pop();
+	auto result = binaryResult(instruction, va, vb);
+	return result.has_value() && push(std::move(*result));
+}
 
-void VM::binaryOp(std::span<const std::byte>::iterator &ip) {
-	OpCode instruction = static_cast<OpCode>(peekByte(ip));
-	auto vb = (*stack.back()).clone();
-	stack.pop_back();
-	auto va = (*stack.back()).clone();
-	stack.pop_back();
-	auto onlyNumbers = [this](const auto &, const auto &) {
-		runtimeError("Operands must be numbers.");
-	};
+std::optional<Value> VM::binaryResult(OpCode instruction, const Value &va,
+                                      const Value &vb) {
 	switch (instruction) {
 	case OpCode::OP_EQUAL:
-		stack.emplace_back(std::make_unique<Value>(va.equals(vb)));
-		break;
+		return Value(va.equals(vb));
 	case OpCode::OP_NOT_EQUAL:
-		stack.emplace_back(std::make_unique<Value>(!va.equals(vb)));
-		break;
-	case OpCode::OP_GREATER:
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        stack.push_back(std::make_unique<Value>(a > b));
-		        },
-		        onlyNumbers,
-		    },
-		    va.value, vb.value);
-		break;
-	case OpCode::OP_GREATER_EQUAL:
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        stack.push_back(std::make_unique<Value>(a >= b));
-		        },
-		        onlyNumbers,
-		    },
-		    va.value, vb.value);
+		return Value(!va.equals(vb));
+	case OpCode::OP_ADD:
+		if (va.isObj() && vb.isObj()) {
+			if (std::holds_alternative<ObjString>(va.asObj().value) &&
+			    std::holds_alternative<ObjString>(vb.asObj().value)) {
+				return concatenate(heap, va, vb, rope_threshold);
+			}
+		}
+		if (!va.isNumber() || !vb.isNumber()) {
+			runtimeError("Operands must be two numbers or two strings.");
+			return std::nullopt;
+		}
 		break;
-	case OpCode::OP_LESS: {
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        stack.push_back(std::make_unique<Value>(a < b));
-		        },
-		        onlyNumbers,
-		    },
-		    va.value, vb.value);
+	default:
+		if (!va.isNumber() || !vb.isNumber()) {
+			runtimeError("Operands must be numbers.");
+			return std::nullopt;
+		}
 		break;
 	}
+
+	switch (instruction) {
+	case OpCode::OP_GREATER:
+		return numberResult(va, vb, std::greater<>{});
+	case OpCode::OP_GREATER_EQUAL:
+		return numberResult(va, vb, std::greater_equal<>{});
+	case OpCode::OP_LESS:
+		return numberResult(va, vb, std::less<>{});
 	case OpCode::OP_LESS_EQUAL:
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        stack.push_back(std::make_unique<Value>(a <= b));
-		        },
-		        onlyNumbers,
-		    },
-		    va.value, vb.value);
-		break;
+		return numberResult(va, vb, std::less_equal<>{});
 	case OpCode::OP_ADD:
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        stack.push_back(std::make_unique<Value>(a + b));
-		        },
-		        [&](const Obj &a, const Obj &b) {
-			        std::visit(
-			            overloads{
-			                [this](const std::string &a, const std::string &b) {
-				                stack.emplace_back(
-				                    std::make_unique<Value>(a + b));
-			                },
-			                [this](const auto &, const auto &) {
-				                runtimeError("Operands must be two numbers or "
-				                             "two strings.");
-			                },
-			            },
-			            a.value, b.value);
-		        },
-		        [this](const auto &, const auto &) {
-			        runtimeError("Operands must be two numbers or "
-			                     "two strings.");
-		        },
-		    },
-		    va.value, vb.value);
-		break;
+		return numberResult(va, vb, Add{});
 	case OpCode::OP_SUBTRACT:
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        stack.push_back(std::make_unique<Value>(a - b));
-		        },
-		        onlyNumbers,
-		    },
-		    va.value, vb.value);
-		break;
+		return numberResult(va, vb, Subtract{});
 	case OpCode::OP_MULTIPLY:
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        stack.push_back(std::make_unique<Value>(a * b));
-		        },
-		        onlyNumbers,
-		    },
-		    va.value, vb.value);
-		break;
+		return numberResult(va, vb, Multiply{});
 	case OpCode::OP_DIVIDE:
-		std::visit(
-		    overloads{
-		        [this](double a, double b) {
-			        if (b == 0) {
-				        runtimeError("Division by zero.");
-				        return;
-			        }
-			        stack.push_back(std::make_unique<Value>(a / b));
-		        },
-		        onlyNumbers,
-		    },
-		    va.value, vb.value);
-		break;
+		if (vb.asNumber() == 0) {
+			runtimeError("Division by zero.");
+			return std::nullopt;
+		}
+		return numberResult(va, vb, Divide{});
 	default:
 		[[unlikely]] throw std::runtime_error("Unhandled OpCode in binaryOp");
 	}
 }
 
 bool VM::call(const ObjClosure &closure, size_t argCount) {
+	if (heap.wantsCollection()) [[unlikely]] {
+		collectGarbage();
+	}
 	auto &function = closure.function.get();
 	if (function.arity != argCount) {
 		runtimeError(std::format("Expected {} arguments but got {}.",
@@ -202,9 +486,21 @@ bool VM::call(const ObjClosure &closure, size_t argCount) {
 		return false;
 	}
 
+	if (function.chunk->lazy() != nullptr && !compileLazy(function))
+	    [[unlikely]] {
+		return false;
+	}
+
+	countCall(function);
+
+	// the receiver of a method is its first local
+	Value *slots = stackTop - argCount - function.isMethod;
+	if (!reserveStack(function, slots)) {
+		return false;
+	}
+
 	try {
-		callFrames.emplace_back(
-		    std::make_unique<CallFrame>(closure, stack.size()));
+		callFrames.emplace_back(closure, slots);
 	} catch (const std::bad_alloc &) {
 		runtimeError("could not allocate memory for call frame");
 		return false;
@@ -212,339 +508,1758 @@ bool VM::call(const ObjClosure &closure, size_t argCount) {
 
 	return true;
 }
+
+void VM::countCall(const ObjFunction &function) {
+	if (jit_threshold != 0 && verified_code && backend == Backend::STACK &&
+	    function.chunk->native() == nullptr &&
+	    function.chunk->countHot(jit_threshold)) {
+		function.chunk->setNative(jit::compile(*function.chunk));
+	}
+}
+
+template <typename T, typename... Args>
+std::shared_ptr<T> VM::makeShared(Args &&...args) {
+	return std::allocate_shared<T>(
+	    std::pmr::polymorphic_allocator<T>{heap.resource()},
+	    std::forward<Args>(args)...);
+}
+
+std::shared_ptr<ObjUpvalue> VM::captureUpvalue(Value *slot) {
+	// captures are mostly of the innermost frames, so the search starts at
+	// the top of the stack
+	auto it = open_upvalues.end();
+	while (it != open_upvalues.begin() && (*std::prev(it))->location > slot) {
+		--it;
+	}
+	if (it != open_upvalues.begin() && (*std::prev(it))->location == slot) {
+		return *std::prev(it);
+	}
+	return *open_upvalues.insert(it, makeShared<ObjUpvalue>(slot));
+}
+
+Value VM::makeClosure(const Value &constant, Value *slots,
+                      std::span<const std::shared_ptr<ObjUpvalue>> upvalues) {
+	const auto &function = std::get<ObjFunction>(constant.asObj().value);
+	auto captures = function.chunk->captures();
+	// functions that capture nothing are shared as they are
+	if (captures.empty()) {
+		return constant;
+	}
+	ObjFunction closure = function.clone();
+	closure.upvalues.reserve(captures.size());
+	for (const auto &capture : captures) {
+		closure.upvalues.push_back(capture.isLocal
+		                               ? captureUpvalue(slots + capture.index)
+		                               : upvalues[capture.index]);
+	}
+	return heap.allocate(Obj{std::move(closure)});
+}
+
+void VM::closeUpvalues(const Value *last) {
+	while (!open_upvalues.empty() && open_upvalues.back()->location >= last) {
+		auto &upvalue = *open_upvalues.back();
+		// the slot is dropped right after, so its value can be moved
+		upvalue.closed = std::move(*upvalue.location);
+		upvalue.location = &upvalue.closed;
+		open_upvalues.pop_back();
+	}
+}
+
+bool VM::reserveStack(const ObjFunction &function, const Value *slots) {
+	// verified code pushes without checks, so the deepest stack it can
+	// reach has to fit before the frame starts
+	auto depth = function.chunk->maxStack();
+	if (depth.has_value() &&
+	    *depth > static_cast<size_t>(stack.data() + stack.size() - slots)) {
+		runtimeError("Stack overflow.");
+		return false;
+	}
+	if (depth.has_value()) {
+		stack_high = std::max(stack_high, slots + *depth);
+	}
+	return true;
+}
+
+void VM::collectGarbage() {
+	// the slots above the top hold popped values, clearing them keeps
+	// the next collections from reading objects this one frees
+	for (Value *slot = stackTop; slot < stack_high; ++slot) {
+		*slot = Value{};
+	}
+	stack_high = stackTop;
+	heap.beginCollection();
+	for (const Value *slot = stack.data(); slot != stackTop; ++slot) {
+		heap.mark(*slot);
+	}
+	for (const auto &frame : callFrames) {
+		heap.mark(frame.closure.function.get());
+	}
+	for (const auto &global : globals) {
+		heap.mark(global);
+	}
+	heap.endCollection();
+}
+
 bool VM::callValue(const Value &callee, size_t argCount) {
-	if (stack.size() <= argCount && argCount > 0) {
+	if (stackSize() <= argCount && argCount > 0) {
 		runtimeError("not enough values to call function");
 		return false;
 	}
 
-	if (auto *obj = std::get_if<Obj>(&callee.value); obj) {
+	if (callee.isObj()) {
+		auto *obj = &callee.asObj();
 		if (auto *function = std::get_if<ObjFunction>(&obj->value); function) {
 			return call(*function, argCount);
 		} else if (auto *native = std::get_if<ObjNative>(&obj->value); native) {
-
-			auto args_view =
-			    stack | std::views::drop(stack.size() - argCount) |
-			    std::views::take(argCount) |
-			    std::views::transform(
-			        [](const auto &ptr) -> std::reference_wrapper<Value> {
-				        return std::ref(*ptr);
-			        });
-			std::vector<std::reference_wrapper<Value>> args_vec(
-			    args_view.begin(), args_view.end());
-			auto args = std::span<std::reference_wrapper<Value>>(args_vec);
-
+			// the arguments are passed in place from the stack
+			auto args = std::span<Value>(stackTop - argCount, argCount);
 			auto result = native->function(argCount, args);
 			// remove the current args and the function in the stack
-			stack.erase(stack.end() - (argCount + 1), stack.end());
-			stack.emplace_back(std::make_unique<Value>(result));
+			stackTop -= argCount + 1;
+			return push(std::move(result));
+		} else if (auto *klass = classOf(callee); klass) {
+			// the instance replaces the class as the receiver of init, the
+			// class stays alive through it
+			const ObjFunction *initializer = klass->initializer;
+			stackTop[-argCount - 1] =
+			    heap.allocate(Obj{ObjInstance{callee, heap.resource()}});
+			if (initializer != nullptr) {
+				return call(*initializer, argCount);
+			}
+			if (argCount != 0) {
+				runtimeError(
+				    std::format("Expected 0 arguments but got {}.", argCount));
+				return false;
+			}
 			return true;
+		} else if (auto *bound = std::get_if<ObjBoundMethod>(&obj->value);
+		           bound) {
+			const ObjFunction *method = bound->method;
+			stackTop[-argCount - 1] = bound->receiver;
+			return call(*method, argCount);
 		}
 	}
 	runtimeError("Can only call functions and classes.");
 	return false;
 }
 
-size_t VM::readIndex(std::span<const std::byte>::iterator &ip) {
-	auto instruction = static_cast<lox::OpCode>(*(ip));
-	size_t address = static_cast<uint8_t>(nextByte(ip));
-	// 16 bit addresses
-	[[unlikely]]
-	if (instruction == OpCode::OP_CONSTANT_LONG ||
-	    instruction == OpCode::OP_GET_LOCAL_LONG ||
-	    instruction == OpCode::OP_SET_LOCAL_LONG ||
-	    instruction == OpCode::OP_GET_GLOBAL_LONG ||
-	    instruction == OpCode::OP_DEFINE_GLOBAL_LONG ||
-	    instruction == OpCode::OP_SET_GLOBAL_LONG ||
-	    instruction == OpCode::OP_JUMP ||
-	    instruction == OpCode::OP_JUMP_IF_FALSE ||
-	    instruction == OpCode::OP_LOOP ||
-	    instruction == OpCode::OP_CLOSURE_LONG) {
-		address = address << 8 | static_cast<uint8_t>(nextByte(ip));
-	}
-	return address;
-}
-
-auto VM::readConstant(std::span<const std::byte>::iterator &ip)
-    -> std::optional<std::reference_wrapper<const Value>> {
-	auto &chunk = *(*callFrames.back()).closure.chunk();
-	size_t address = readIndex(ip);
-	if (address >= chunk.constants().size()) {
-		runtimeError("Invalid constant address.");
-		return std::nullopt;
-	}
-	auto &constant = chunk.constants()[address];
-	return constant;
-}
+// the handlers are written once and dispatched either through a computed goto
+// table, where every handler jumps straight to the next one, or through the
+// portable switch when the compiler does not support labels as values
+#if CPPLOX_CONSTANT_THREADED_DISPATCH && defined(__GNUC__)
+#define CPPLOX_VM_COMPUTED_GOTO 1
+#define CPPLOX_VM_TARGET(op)                                                   \
+	TARGET_##op:                                                               \
+	case OpCode::op:
+#define CPPLOX_VM_DISPATCH()                                                   \
+	do {                                                                       \
+		if (Checks::enabled && had_error) [[unlikely]] {                       \
+			return fail();                                                     \
+		}                                                                      \
+		if constexpr (Hooks::enabled) {                                        \
+			hooks->beforeInstruction(*this, *chunk, *ip);                      \
+		}                                                                      \
+		instruction = ip++;                                                    \
+		goto *dispatch_table[static_cast<size_t>(instruction->op)];            \
+	} while (false)
+#else
+#define CPPLOX_VM_COMPUTED_GOTO 0
+#define CPPLOX_VM_TARGET(op) case OpCode::op:
+#define CPPLOX_VM_DISPATCH() continue
+#endif
 
+template <typename Hooks, typename Checks, typename Jit>
 InterpretResult VM::run() {
-	auto &callFrame = *callFrames.back();
-	auto &currentChunk = *callFrame.closure.chunk();
-	auto code = currentChunk.code();
-	std::string_view line_glyph = debug_trace_instruction ? "|" : " ";
-	for (auto ip = code.begin(); ip != code.end(); ip++) {
-		auto instruction = static_cast<lox::OpCode>(peekByte(ip));
-		if (debug_trace_stack) {
-			std::cout << std::format("{}  {}	",
-			                         cli::terminal::orange_colored("#STACK#"),
-			                         cli::terminal::gray_colored(line_glyph));
-			for (auto &slot : stack) {
-				std::cout << std::format(
-				    "[ {} ]",
-				    cli::terminal::yellow_colored((*slot).toString()));
-			}
-			std::cout << "\n";
-		}
-		if (debug_trace_instruction) {
-			auto it = ip;
-			debug::InstructionDisassembly(currentChunk, it);
-		}
-
-		switch (instruction) {
-		case OpCode::OP_CONSTANT:
-		case OpCode::OP_CONSTANT_LONG: {
-			auto constant = readConstant(ip);
-			if (!constant.has_value()) {
-				return InterpretResult::RUNTIME_ERROR;
-			}
-			stack.emplace_back(
-			    std::make_unique<Value>(constant->get().clone()));
-			break;
-		}
-		case OpCode::OP_NIL:
-			stack.emplace_back(std::make_unique<Value>());
-			break;
-		case OpCode::OP_TRUE:
-			stack.emplace_back(std::make_unique<Value>(true));
-			break;
-		case OpCode::OP_FALSE:
-			stack.emplace_back(std::make_unique<Value>(false));
-			break;
-		case OpCode::OP_POP: {
-			if (stack.empty()) {
+	// the state of the running frame is cached in locals and only written
+	// back to the frame when it calls another function or fails
+	CallFrame *frame = &callFrames.back();
+	const Chunk *chunk = frame->closure.chunk().get();
+	Instruction *code = chunk->instructions().data();
+	PropertyCache *caches = chunk->caches().data();
+	std::span<const std::shared_ptr<ObjUpvalue>> upvalues =
+	    frame->closure.function.get().upvalues;
+	Instruction *ip = frame->ip;
+	Instruction *instruction = nullptr;
+	// continues the frame in the machine code compiled for it, up to the
+	// first instruction the machine code leaves to the interpreter
+	auto runNative = [&] {
+		if constexpr (Jit::enabled) {
+			const jit::Code *native = chunk->native();
+			if (native != nullptr && native->enters(ip - code)) {
+				jit::State state{.slots = frame->slots,
+				                 .stackTop = stackTop,
+				                 .globals = globals.data()};
+				ip = code + native->run(state, ip - code);
+				stackTop = state.stackTop;
+			}
+		}
+	};
+	// reloads the cached state once a call or return changed the frame
+	auto enterFrame = [&] {
+		frame = &callFrames.back();
+		chunk = frame->closure.chunk().get();
+		code = chunk->instructions().data();
+		caches = chunk->caches().data();
+		upvalues = frame->closure.function.get().upvalues;
+		ip = frame->ip;
+		runNative();
+	};
+	auto fail = [&] {
+		frame->ip = ip;
+		if constexpr (Hooks::enabled) {
+			hooks->onRuntimeError(*this, error_message);
+		}
+		return reportError();
+	};
+	// verified code cannot underflow the stack, read a constant or a local
+	// out of bounds or overflow the slots reserved by call, these checks
+	// only run for unverified code
+	auto underflow = [&](size_t needed) {
+		if constexpr (Checks::enabled) {
+			if (stackSize() < needed) [[unlikely]] {
 				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+				return true;
 			}
-			stack.pop_back();
-			break;
 		}
-		case OpCode::OP_GET_LOCAL:
-		case OpCode::OP_GET_LOCAL_LONG: {
-			size_t relativeIndex = readIndex(ip);
-			size_t index = callFrame.stackOffset - callFrame.closure.arity() +
-			               relativeIndex;
-			if (stack.size() <= index) {
+		return false;
+	};
+	auto outOfFrame = [&](const Value *slot) {
+		if constexpr (Checks::enabled) {
+			if (slot >= stackTop) [[unlikely]] {
 				runtimeError("tried to access an non existing local");
-				return InterpretResult::RUNTIME_ERROR;
-			}
-			stack.emplace_back(
-			    std::make_unique<Value>((*stack[index]).clone()));
-			break;
-		}
-		case OpCode::OP_SET_LOCAL:
-		case OpCode::OP_SET_LOCAL_LONG: {
-			size_t relativeIndex = readIndex(ip);
-			size_t index = callFrame.stackOffset - callFrame.closure.arity() +
-			               relativeIndex;
-			if (stack.empty()) {
-				runtimeError("Stack underflow");
-				return InterpretResult::RUNTIME_ERROR;
-			}
-			if (stack.size() <= index) {
-				runtimeError("tried to set an non existing local");
-				return InterpretResult::RUNTIME_ERROR;
-			}
-			(*stack[index]) = (*stack.back()).clone();
-			break;
-		}
-		case OpCode::OP_GET_GLOBAL:
-		case OpCode::OP_GET_GLOBAL_LONG: {
-			auto value = readConstant(ip);
-			if (!value.has_value()) {
-				return InterpretResult::RUNTIME_ERROR;
-			}
-			std::string name = value->get().toString();
-			if (auto it = globals.find(name); it != globals.end()) {
-				stack.emplace_back(std::make_unique<Value>(it->second.clone()));
-			} else {
-				runtimeError(std::format("Undefined variable '{}'", name));
-				return InterpretResult::RUNTIME_ERROR;
+				return true;
 			}
-			break;
 		}
-		case OpCode::OP_DEFINE_GLOBAL:
-		case OpCode::OP_DEFINE_GLOBAL_LONG: {
-			auto value = readConstant(ip);
-			if (!value.has_value()) {
-				return InterpretResult::RUNTIME_ERROR;
+		return false;
+	};
+	auto constantAt = [&](size_t index) -> const Value * {
+		auto constants = chunk->constants();
+		if constexpr (Checks::enabled) {
+			if (index >= constants.size()) [[unlikely]] {
+				runtimeError("Invalid constant address.");
+				return nullptr;
 			}
-			std::string name = value->get().toString();
-			if (stack.empty()) {
-				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+		}
+		return &constants[index];
+	};
+	auto upvalueAt = [&](size_t index) -> ObjUpvalue * {
+		if constexpr (Checks::enabled) {
+			if (index >= upvalues.size()) [[unlikely]] {
+				runtimeError("Invalid upvalue address.");
+				return nullptr;
 			}
-			globals[name] = (*stack.back()).clone();
-			stack.pop_back();
-			break;
 		}
-		case OpCode::OP_SET_GLOBAL:
-		case OpCode::OP_SET_GLOBAL_LONG: {
-			auto value = readConstant(ip);
-			if (!value.has_value()) {
-				return InterpretResult::RUNTIME_ERROR;
+		return upvalues[index].get();
+	};
+	auto globalAt = [&](size_t slot) -> Value * {
+		if constexpr (Checks::enabled) {
+			if (slot >= globals.size()) [[unlikely]] {
+				runtimeError("Invalid constant address.");
+				return nullptr;
 			}
-			std::string name = value->get().toString();
-			if (auto it = globals.find(name); it != globals.end()) {
-				globals[name] = (*stack.back()).clone();
-			} else {
-				runtimeError(std::format("Undefined variable '{}'", name));
-				return InterpretResult::RUNTIME_ERROR;
-			}
-			break;
-		}
-		case OpCode::OP_EQUAL:
-		case OpCode::OP_NOT_EQUAL:
-		case OpCode::OP_GREATER:
-		case OpCode::OP_GREATER_EQUAL:
-		case OpCode::OP_LESS:
-		case OpCode::OP_LESS_EQUAL:
-		case OpCode::OP_ADD:
-		case OpCode::OP_SUBTRACT:
-		case OpCode::OP_MULTIPLY:
-		case OpCode::OP_DIVIDE: {
-			// check that there is at least 2 elements in the stack
-			if (stack.size() < 2) {
-				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+		}
+		return &globals[slot];
+	};
+	auto undefinedGlobal = [&](size_t slot) {
+		runtimeError(
+		    std::format("Undefined variable '{}'", global_names[slot]));
+		return fail();
+	};
+	auto pushValue = [&](Value value) {
+		if constexpr (Checks::enabled) {
+			push(std::move(value));
+		} else {
+			*stackTop++ = std::move(value);
+		}
+	};
+
+#if CPPLOX_VM_COMPUTED_GOTO
+	// generated from the same list as OpCode, so the order always matches
+#define CPPLOX_VM_LABEL(op, ...) &&TARGET_##op,
+	static const void *const dispatch_table[] = {
+	    CPPLOX_OPCODES(CPPLOX_VM_LABEL)};
+#undef CPPLOX_VM_LABEL
+	static_assert(std::size(dispatch_table) == opcodes.size());
+	CPPLOX_VM_DISPATCH();
+#endif
+
+	for (;;) {
+		if (Checks::enabled && had_error) [[unlikely]] {
+			return fail();
+		}
+		if constexpr (Hooks::enabled) {
+			hooks->beforeInstruction(*this, *chunk, *ip);
+		}
+		instruction = ip++;
+
+		switch (instruction->op) {
+		CPPLOX_VM_TARGET(OP_CONSTANT) {
+			const Value *constant = constantAt(instruction->operand);
+			if (constant == nullptr) {
+				return fail();
 			}
-			binaryOp(ip);
-			break;
+			pushValue(*constant);
+			CPPLOX_VM_DISPATCH();
 		}
-		case lox::OpCode::OP_NEGATE: {
-			if (stack.empty()) {
-				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+		CPPLOX_VM_TARGET(OP_NIL) {
+			pushValue(Value{});
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_TRUE) {
+			pushValue(Value{true});
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_FALSE) {
+			pushValue(Value{false});
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_POP) {
+			if (underflow(1)) {
+				return fail();
 			}
-			auto &value = *stack.back();
-			if (!std::holds_alternative<double>(value.value)) {
-				runtimeError("Operand must be a number.");
-				return InterpretResult::RUNTIME_ERROR;
+			stackTop--;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_GET_LOCAL) {
+			size_t index = instruction->operand;
+			if (outOfFrame(frame->slots + index)) {
+				return fail();
 			}
-			value = -std::get<double>(value.value);
-			break;
+			pushValue(frame->slots[index]);
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_NOT: {
-			if (stack.empty()) {
-				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+		CPPLOX_VM_TARGET(OP_SET_LOCAL) {
+			size_t index = instruction->operand;
+			if (underflow(1)) {
+				return fail();
 			}
-			auto &value = *stack.back();
-			value = !value.isTruthy();
-			break;
+			if (outOfFrame(frame->slots + index)) {
+				return fail();
+			}
+			frame->slots[index] = peek();
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_PRINT: {
-			if (stack.empty()) {
-				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+		CPPLOX_VM_TARGET(OP_GET_GLOBAL) {
+			Value *global = globalAt(instruction->operand2);
+			if (global == nullptr) {
+				return fail();
+			}
+			if (global->isUndefined()) [[unlikely]] {
+				return undefinedGlobal(instruction->operand2);
+			}
+			pushValue(*global);
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_DEFINE_GLOBAL) {
+			Value *global = globalAt(instruction->operand2);
+			if (global == nullptr) {
+				return fail();
+			}
+			if (underflow(1)) {
+				return fail();
 			}
-			std::cout << std::format("{}\n", (*stack.back()).toString());
-			stack.pop_back();
-			break;
+			*global = pop();
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_JUMP: {
-			size_t offset = readIndex(ip);
-			ip += offset;
-			break;
+		CPPLOX_VM_TARGET(OP_SET_GLOBAL) {
+			Value *global = globalAt(instruction->operand2);
+			if (global == nullptr) {
+				return fail();
+			}
+			if (global->isUndefined()) [[unlikely]] {
+				return undefinedGlobal(instruction->operand2);
+			}
+			if (underflow(1)) {
+				return fail();
+			}
+			*global = peek();
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_JUMP_IF_FALSE: {
-			size_t offset = readIndex(ip);
-			if (!(*stack.back()).isTruthy()) {
-				ip += offset;
+		CPPLOX_VM_TARGET(OP_GET_UPVALUE) {
+			ObjUpvalue *upvalue = upvalueAt(instruction->operand);
+			if (upvalue == nullptr) {
+				return fail();
 			}
-			break;
+			pushValue(*upvalue->location);
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_LOOP: {
-			size_t offset = readIndex(ip);
-			ip -= offset;
-			break;
+		CPPLOX_VM_TARGET(OP_SET_UPVALUE) {
+			ObjUpvalue *upvalue = upvalueAt(instruction->operand);
+			if (upvalue == nullptr) {
+				return fail();
+			}
+			if (underflow(1)) {
+				return fail();
+			}
+			*upvalue->location = peek();
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_CALL: {
-			size_t argCount = readIndex(ip);
-			if (stack.size() < argCount + 1) {
-				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+		CPPLOX_VM_TARGET(OP_EQUAL)
+		CPPLOX_VM_TARGET(OP_NOT_EQUAL)
+		CPPLOX_VM_TARGET(OP_GREATER)
+		CPPLOX_VM_TARGET(OP_GREATER_EQUAL)
+		CPPLOX_VM_TARGET(OP_LESS)
+		CPPLOX_VM_TARGET(OP_LESS_EQUAL)
+		CPPLOX_VM_TARGET(OP_ADD)
+		CPPLOX_VM_TARGET(OP_SUBTRACT)
+		CPPLOX_VM_TARGET(OP_MULTIPLY)
+		CPPLOX_VM_TARGET(OP_DIVIDE) {
+			// check that there is at least 2 elements in the stack
+			if (underflow(2)) {
+				return fail();
+			}
+			OpCode op = instruction->op;
+			// quicken the instruction for the operand types it has seen
+			if (peek(1).isInt() && peek().isInt()) {
+				instruction->op = integerForm(op);
+			} else if (peek(1).isNumber() && peek().isNumber()) {
+				instruction->op = numberForm(op);
+			} else if (op == OpCode::OP_ADD &&
+			           isString(peek(1)) && isString(peek())) {
+				instruction->op = OpCode::OP_ADD_STR;
+			}
+			if (!binaryOp(op)) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		// the quickened forms check their operand types once and rewrite
+		// themselves back to the generic form when the check fails
+		CPPLOX_VM_TARGET(OP_ADD_NUM) {
+			if (underflow(2) ||
+			    !numberOp(*instruction, OpCode::OP_ADD, Add{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_SUBTRACT_NUM) {
+			if (underflow(2) ||
+			    !numberOp(*instruction, OpCode::OP_SUBTRACT, Subtract{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_MULTIPLY_NUM) {
+			if (underflow(2) ||
+			    !numberOp(*instruction, OpCode::OP_MULTIPLY, Multiply{})) {
+				return fail();
 			}
-			size_t calleeIndex = stack.size() - argCount - 1;
-			auto &callee = *stack[calleeIndex];
-			bool isNative = std::holds_alternative<Obj>(callee.value) &&
-			                std::holds_alternative<ObjNative>(
-			                    std::get<Obj>(callee.value).value);
-			if (!callValue(callee, argCount)) {
-				return InterpretResult::RUNTIME_ERROR;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_DIVIDE_NUM) {
+			if (underflow(2)) {
+				return fail();
 			}
-			// only run if is not a native function
-			if (!isNative) {
-				auto result = run();
-				if (result != InterpretResult::OK) {
-					return result;
+			// division by zero is reported by the generic form
+			if (peek().isNumber() && peek().asNumber() == 0) {
+				instruction->op = OpCode::OP_DIVIDE;
+				if (!binaryOp(OpCode::OP_DIVIDE)) {
+					return fail();
 				}
+				CPPLOX_VM_DISPATCH();
 			}
-			break;
+			if (!numberOp(*instruction, OpCode::OP_DIVIDE, Divide{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_CLOSURE:
-		case OpCode::OP_CLOSURE_LONG: {
-			auto constant = readConstant(ip);
-			if (!constant.has_value()) {
-				return InterpretResult::RUNTIME_ERROR;
+		CPPLOX_VM_TARGET(OP_GREATER_NUM) {
+			if (underflow(2) ||
+			    !numberOp(*instruction, OpCode::OP_GREATER, std::greater<>{})) {
+				return fail();
 			}
-
-			if (!std::holds_alternative<Obj>(constant->get().value) ||
-			    !std::holds_alternative<ObjFunction>(
-			        std::get<Obj>(constant->get().value).value)) {
-				runtimeError("Expected function for closure.");
-				return InterpretResult::RUNTIME_ERROR;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_GREATER_EQUAL_NUM) {
+			if (underflow(2) ||
+			    !numberOp(*instruction, OpCode::OP_GREATER_EQUAL, std::greater_equal<>{})) {
+				return fail();
 			}
-
-			auto &func = std::get<ObjFunction>(
-			    std::get<Obj>(constant->get().value).value);
-			stack.push_back(std::make_unique<Value>(func.clone()));
-			break;
+			CPPLOX_VM_DISPATCH();
 		}
-		case OpCode::OP_RETURN: {
-			// pop all the elements from the stack until the last frame
-			size_t top = callFrame.stackOffset - callFrame.closure.arity() - 1;
-			if (stack.size() < top) {
-				runtimeError("Stack underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+		CPPLOX_VM_TARGET(OP_LESS_NUM) {
+			if (underflow(2) ||
+			    !numberOp(*instruction, OpCode::OP_LESS, std::less<>{})) {
+				return fail();
 			}
-			Value result = (*stack.back()).clone();
-			stack.erase(stack.begin() + top, stack.end());
-			stack.emplace_back(std::make_unique<Value>(result));
-			if (callFrames.empty()) {
-				runtimeError("CallFrames underflow.");
-				return InterpretResult::RUNTIME_ERROR;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_LESS_EQUAL_NUM) {
+			if (underflow(2) ||
+			    !numberOp(*instruction, OpCode::OP_LESS_EQUAL, std::less_equal<>{})) {
+				return fail();
 			}
-			callFrames.pop_back();
-			return InterpretResult::OK;
+			CPPLOX_VM_DISPATCH();
 		}
+		CPPLOX_VM_TARGET(OP_ADD_STR) {
+			if (underflow(2) || !addStrings(*instruction)) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
 		}
-		if (had_error) {
-			return InterpretResult::RUNTIME_ERROR;
+		CPPLOX_VM_TARGET(OP_ADD_INT) {
+			if (underflow(2) ||
+			    !integerOp(*instruction, OpCode::OP_ADD, Add{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
 		}
-	}
-	return InterpretResult::OK;
-}
-
-InterpretResult VM::interpret(const ObjFunction &function) {
-	had_error = false;
-	callFrames.clear();
-	stack.push_back(std::make_unique<Value>(function.clone()));
-	call(function, 0);
-	return run();
+		CPPLOX_VM_TARGET(OP_SUBTRACT_INT) {
+			if (underflow(2) ||
+			    !integerOp(*instruction, OpCode::OP_SUBTRACT, Subtract{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_MULTIPLY_INT) {
+			if (underflow(2) ||
+			    !integerOp(*instruction, OpCode::OP_MULTIPLY, Multiply{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_GREATER_INT) {
+			if (underflow(2) ||
+			    !integerOp(*instruction, OpCode::OP_GREATER, std::greater<>{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_GREATER_EQUAL_INT) {
+			if (underflow(2) || !integerOp(*instruction, OpCode::OP_GREATER_EQUAL,
+			                               std::greater_equal<>{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_LESS_INT) {
+			if (underflow(2) ||
+			    !integerOp(*instruction, OpCode::OP_LESS, std::less<>{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_LESS_EQUAL_INT) {
+			if (underflow(2) || !integerOp(*instruction, OpCode::OP_LESS_EQUAL,
+			                               std::less_equal<>{})) {
+				return fail();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_NEGATE) {
+			if (underflow(1)) {
+				return fail();
+			}
+			auto &value = peek();
+			if (!value.isNumber()) {
+				runtimeError("Operand must be a number.");
+				return fail();
+			}
+			// integer zero negates to -0, which only the double can hold
+			if (value.isInt() && value.asInt() != 0) {
+				value = Value{-value.asInt()};
+			} else {
+				value = -value.asNumber();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_NOT) {
+			if (underflow(1)) {
+				return fail();
+			}
+			auto &value = peek();
+			value = !value.isTruthy();
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_PRINT) {
+			if (underflow(1)) {
+				return fail();
+			}
+			std::cout << std::format("{}\n", pop().toString());
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_JUMP) {
+			ip = code + instruction->operand;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_JUMP_IF_FALSE) {
+			if (underflow(1)) {
+				return fail();
+			}
+			if (!peek().isTruthy()) {
+				ip = code + instruction->operand;
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_LOOP) {
+			ip = code + instruction->operand;
+			if (heap.wantsCollection()) [[unlikely]] {
+				collectGarbage();
+			}
+			// loops make a function hot without calls to it
+			if constexpr (Jit::enabled) {
+				if (jit_threshold != 0 && chunk->native() == nullptr &&
+				    chunk->countHot(jit_threshold)) {
+					chunk->setNative(jit::compile(*chunk));
+				}
+				runNative();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_TAIL_CALL) {
+			size_t argCount = instruction->operand;
+			if (underflow(argCount + 1)) {
+				return fail();
+			}
+			const Value &callee = peek(argCount);
+			auto *function =
+			    callee.isObj() ? std::get_if<ObjFunction>(&callee.asObj().value)
+			                   : nullptr;
+			// natives and methods fall through to a regular call
+			if (function != nullptr && !function->isMethod) {
+				if (function->arity != argCount) {
+					runtimeError(std::format("Expected {} arguments but got {}.",
+					                         function->arity, argCount));
+					return fail();
+				}
+				if (function->chunk->lazy() != nullptr && !compileLazy(*function))
+				    [[unlikely]] {
+					return fail();
+				}
+				// tail calls replace the frame instead of going through call
+				if (heap.wantsCollection()) [[unlikely]] {
+					collectGarbage();
+				}
+				countCall(*function);
+				// slide the callee and the arguments over the frame of the
+				// caller, which is dropped before the callee reuses its slots
+				Value *base = frame->base();
+				size_t elided = frame->elided + 1;
+				closeUpvalues(frame->slots);
+				callFrames.pop_back();
+				std::move(stackTop - argCount - 1, stackTop, base);
+				stackTop = base + argCount + 1;
+				const auto &moved = std::get<ObjFunction>(base->asObj().value);
+				if (!reserveStack(moved, base + 1)) {
+					return fail();
+				}
+				callFrames.emplace_back(moved, base + 1);
+				callFrames.back().elided = elided;
+				if constexpr (Hooks::enabled) {
+					hooks->onCall(*this, callFrames.back());
+				}
+				enterFrame();
+				CPPLOX_VM_DISPATCH();
+			}
+			[[fallthrough]];
+		}
+		CPPLOX_VM_TARGET(OP_CALL) {
+			size_t argCount = instruction->operand;
+			if (underflow(argCount + 1)) {
+				return fail();
+			}
+			frame->ip = ip;
+			if (!callValue(peek(argCount), argCount)) {
+				return fail();
+			}
+			// natives return immediately, functions push a new frame
+			if constexpr (Hooks::enabled) {
+				if (frame != &callFrames.back()) {
+					hooks->onCall(*this, callFrames.back());
+				}
+			}
+			enterFrame();
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_CLOSURE) {
+			const Value *constant = constantAt(instruction->operand);
+			if (constant == nullptr) {
+				return fail();
+			}
+
+			if (!(*constant).isObj() ||
+			    !std::holds_alternative<ObjFunction>(
+			        (*constant).asObj().value)) {
+				runtimeError("Expected function for closure.");
+				return fail();
+			}
+
+			const auto &func =
+			    std::get<ObjFunction>((*constant).asObj().value);
+			for (const auto &capture : func.chunk->captures()) {
+				if (capture.isLocal) {
+					// a local function captures the slot it is pushed to
+					Value *slot = frame->slots + capture.index;
+					if (slot != stackTop && outOfFrame(slot)) {
+						return fail();
+					}
+				} else if (upvalueAt(capture.index) == nullptr) {
+					return fail();
+				}
+			}
+			pushValue(makeClosure(*constant, frame->slots, upvalues));
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_CLOSE_UPVALUE) {
+			if (underflow(1)) {
+				return fail();
+			}
+			closeUpvalues(stackTop - 1);
+			--stackTop;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_CLASS) {
+			const Value *constant = constantAt(instruction->operand);
+			if (constant == nullptr) {
+				return fail();
+			}
+			pushValue(
+			    heap.allocate(Obj{makeShared<ObjClass>(nameOf(*constant))}));
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_INHERIT) {
+			if (underflow(2)) {
+				return fail();
+			}
+			const auto *superclass = classOf(peek(1));
+			if (superclass == nullptr) {
+				runtimeError("Superclass must be a class.");
+				return fail();
+			}
+			auto *subclass = classOf(peek());
+			if (subclass == nullptr) {
+				runtimeError("Expected class for inheritance.");
+				return fail();
+			}
+			auto &klass = *subclass;
+			klass.methods = superclass->methods;
+			klass.superclass = peek(1);
+			klass.initializer = klass.findMethod("init");
+			--stackTop;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_METHOD) {
+			if (underflow(2)) {
+				return fail();
+			}
+			const Value *constant = constantAt(instruction->operand);
+			if (constant == nullptr) {
+				return fail();
+			}
+			auto *klass = classOf(peek(1));
+			const auto *function =
+			    peek().isObj() ? std::get_if<ObjFunction>(&peek().asObj().value)
+			                   : nullptr;
+			if (klass == nullptr || function == nullptr) {
+				runtimeError("Expected class and function for method.");
+				return fail();
+			}
+			const auto &name = nameOf(*constant);
+			// overrides replace the inherited method in place
+			auto &methods = klass->methods;
+			auto &method =
+			    methods.insert_or_assign(std::string(name), *function)
+			        .first->second;
+			if (name == "init") {
+				klass->initializer = &method;
+			}
+			--stackTop;
+			CPPLOX_VM_DISPATCH();
+		}
+		// the property instructions look the shape of the instance up in the
+		// cache of the site and only hash the name the first time they see it
+		CPPLOX_VM_TARGET(OP_GET_PROPERTY) {
+			if (underflow(1)) {
+				return fail();
+			}
+			auto *instance = instanceOf(peek());
+			if (instance == nullptr) {
+				runtimeError("Only instances have properties.");
+				return fail();
+			}
+			auto &cache = caches[instruction->cache];
+			const auto *entry = cache.find(instance->shape);
+			if (entry == nullptr) [[unlikely]] {
+				const Value *constant = constantAt(instruction->operand);
+				if (constant == nullptr) {
+					return fail();
+				}
+				const auto &name = nameOf(*constant);
+				auto found = readEntry(*instance, name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			if (entry->method != nullptr) {
+				peek() = heap.allocate(Obj{ObjBoundMethod{peek(), entry->method}});
+			} else {
+				// copied out before the instance is released from the slot
+				Value field = instance->fields[entry->slot];
+				peek() = std::move(field);
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_SET_PROPERTY) {
+			if (underflow(2)) {
+				return fail();
+			}
+			auto *instance = instanceOf(peek(1));
+			if (instance == nullptr) {
+				runtimeError("Only instances have fields.");
+				return fail();
+			}
+			auto &object = *instance;
+			auto &cache = caches[instruction->cache];
+			const auto *entry = cache.find(object.shape);
+			if (entry == nullptr) [[unlikely]] {
+				const Value *constant = constantAt(instruction->operand);
+				if (constant == nullptr) {
+					return fail();
+				}
+				entry = cache.add(writeEntry(object, nameOf(*constant)));
+			}
+			if (entry->transition != nullptr) {
+				object.fields.push_back(peek());
+				object.shape = entry->transition;
+			} else {
+				object.fields[entry->slot] = peek();
+			}
+			// the assigned value is the result of the expression
+			peek(1) = std::move(peek());
+			--stackTop;
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_GET_SUPER) {
+			if (underflow(2)) {
+				return fail();
+			}
+			const auto *superclass = classOf(peek());
+			auto *instance = instanceOf(peek(1));
+			if (superclass == nullptr || instance == nullptr) {
+				runtimeError("Expected instance and superclass for super.");
+				return fail();
+			}
+			auto &cache = caches[instruction->cache];
+			const auto *entry = cache.find(&superclass->root);
+			if (entry == nullptr) [[unlikely]] {
+				const Value *constant = constantAt(instruction->operand);
+				if (constant == nullptr) {
+					return fail();
+				}
+				const auto &name = nameOf(*constant);
+				auto found = superEntry(peek(), name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			peek(1) =
+			    heap.allocate(Obj{ObjBoundMethod{peek(1), entry->method}});
+			--stackTop;
+			CPPLOX_VM_DISPATCH();
+		}
+		// calls the method on the receiver in place, without the bound method
+		// OP_GET_PROPERTY and OP_CALL would make
+		CPPLOX_VM_TARGET(OP_INVOKE) {
+			size_t argCount = instruction->operand2;
+			if (underflow(argCount + 1)) {
+				return fail();
+			}
+			Value &receiver = peek(argCount);
+			auto *instance = instanceOf(receiver);
+			if (instance == nullptr) {
+				runtimeError("Only instances have methods.");
+				return fail();
+			}
+			auto &cache = caches[instruction->cache];
+			const auto *entry = cache.find(instance->shape);
+			if (entry == nullptr) [[unlikely]] {
+				const Value *constant = constantAt(instruction->operand);
+				if (constant == nullptr) {
+					return fail();
+				}
+				const auto &name = nameOf(*constant);
+				auto found = readEntry(*instance, name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			frame->ip = ip;
+			if (entry->method != nullptr) {
+				if (!call(*entry->method, argCount)) {
+					return fail();
+				}
+			} else {
+				// a field holding a function is called like any callee
+				Value field = instance->fields[entry->slot];
+				receiver = std::move(field);
+				if (!callValue(receiver, argCount)) {
+					return fail();
+				}
+			}
+			if constexpr (Hooks::enabled) {
+				if (frame != &callFrames.back()) {
+					hooks->onCall(*this, callFrames.back());
+				}
+			}
+			enterFrame();
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_SUPER_INVOKE) {
+			size_t argCount = instruction->operand2;
+			if (underflow(argCount + 2)) {
+				return fail();
+			}
+			const auto *superclass = classOf(peek());
+			if (superclass == nullptr) {
+				runtimeError("Superclass must be a class.");
+				return fail();
+			}
+			auto &cache = caches[instruction->cache];
+			const auto *entry = cache.find(&superclass->root);
+			if (entry == nullptr) [[unlikely]] {
+				const Value *constant = constantAt(instruction->operand);
+				if (constant == nullptr) {
+					return fail();
+				}
+				const auto &name = nameOf(*constant);
+				auto found = superEntry(peek(), name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			// the cache keeps the superclass alive once it is popped
+			--stackTop;
+			frame->ip = ip;
+			if (!call(*entry->method, argCount)) {
+				return fail();
+			}
+			if constexpr (Hooks::enabled) {
+				hooks->onCall(*this, callFrames.back());
+			}
+			enterFrame();
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_RETURN) {
+			// drop the locals and the callee, then push the result back
+			Value *top = frame->base();
+			if (Checks::enabled && stackTop <= top) {
+				runtimeError("Stack underflow.");
+				return fail();
+			}
+			Value result = pop();
+			if constexpr (Hooks::enabled) {
+				hooks->onReturn(*this, *frame, result);
+			}
+			closeUpvalues(frame->slots);
+			stackTop = top;
+			pushValue(std::move(result));
+			callFrames.pop_back();
+			if (callFrames.empty()) {
+				return InterpretResult::OK;
+			}
+			enterFrame();
+			CPPLOX_VM_DISPATCH();
+		}
+		// superinstructions take the fast path for numbers and fall back to
+		// the generic instructions for anything else
+		CPPLOX_VM_TARGET(OP_JUMP_IF_FALSE_POP) {
+			if (underflow(1)) {
+				return fail();
+			}
+			if (!(--stackTop)->isTruthy()) {
+				ip = code + instruction->operand;
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_LESS_JUMP) {
+			if (underflow(2)) {
+				return fail();
+			}
+			bool less;
+			const Value &a = peek(1);
+			const Value &b = peek();
+			if (a.isInt() && b.isInt()) {
+				less = a.asInt() < b.asInt();
+				stackTop -= 2;
+			} else if (a.isNumber() && b.isNumber()) {
+				less = a.asNumber() < b.asNumber();
+				stackTop -= 2;
+			} else {
+				if (!binaryOp(OpCode::OP_LESS)) {
+					return fail();
+				}
+				less = pop().isTruthy();
+			}
+			if (!less) {
+				ip = code + instruction->operand;
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_ADD_LOCALS) {
+			Value *a = frame->slots + instruction->operand;
+			Value *b = frame->slots + instruction->operand2;
+			if (outOfFrame(a) || outOfFrame(b)) {
+				return fail();
+			}
+			if (a->isNumber() && b->isNumber()) {
+				pushValue(numberResult(*a, *b, Add{}));
+			} else {
+				pushValue(*a);
+				pushValue(*b);
+				if (!binaryOp(OpCode::OP_ADD)) {
+					return fail();
+				}
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_ADD_CONSTANT) {
+			const Value *constant = constantAt(instruction->operand);
+			if (constant == nullptr) {
+				return fail();
+			}
+			if (underflow(1)) {
+				return fail();
+			}
+			auto &value = peek();
+			if (value.isNumber() && (*constant).isNumber()) {
+				value = numberResult(value, *constant, Add{});
+			} else {
+				pushValue(*constant);
+				if (!binaryOp(OpCode::OP_ADD)) {
+					return fail();
+				}
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_INCREMENT_LOCAL) {
+			Value *local = frame->slots + instruction->operand;
+			if (outOfFrame(local)) {
+				return fail();
+			}
+			const Value *constant = constantAt(instruction->operand2);
+			if (constant == nullptr) {
+				return fail();
+			}
+			if (local->isNumber() && constant->isNumber()) {
+				*local = numberResult(*local, *constant, Add{});
+			} else {
+				pushValue(*local);
+				pushValue(*constant);
+				if (!binaryOp(OpCode::OP_ADD)) {
+					return fail();
+				}
+				*local = pop();
+			}
+			CPPLOX_VM_DISPATCH();
+		}
+		CPPLOX_VM_TARGET(OP_SET_LOCAL_POP) {
+			size_t index = instruction->operand;
+			if (underflow(1)) {
+				return fail();
+			}
+			if (outOfFrame(frame->slots + index + 1)) {
+				return fail();
+			}
+			frame->slots[index] = pop();
+			CPPLOX_VM_DISPATCH();
+		}
+		// the prefix is folded into the instruction it widens when decoding,
+		// unknown bytes and dangling prefixes decode as OP_WIDE
+		CPPLOX_VM_TARGET(OP_WIDE) {
+			runtimeError("Unknown opcode.");
+			return fail();
+		}
+		}
+	}
+}
+
+#undef CPPLOX_VM_TARGET
+#undef CPPLOX_VM_DISPATCH
+
+// the register loop is dispatched the same way as the stack loop
+#if CPPLOX_VM_COMPUTED_GOTO
+#define CPPLOX_REG_TARGET(op)                                                  \
+	REG_TARGET_##op:                                                           \
+	case RegOp::op:
+#define CPPLOX_REG_DISPATCH()                                                  \
+	do {                                                                       \
+		if constexpr (Hooks::enabled) {                                        \
+			hooks->beforeRegisterInstruction(*this, *chunk, *ip);              \
+		}                                                                      \
+		instruction = ip++;                                                    \
+		goto *dispatch_table[static_cast<size_t>(instruction->op)];            \
+	} while (false)
+#else
+#define CPPLOX_REG_TARGET(op) case RegOp::op:
+#define CPPLOX_REG_DISPATCH() continue
+#endif
+
+template <typename Hooks> InterpretResult VM::runRegisters() {
+	// the registers are the slots of the frame window, so calls pass their
+	// arguments in place like the stack loop does
+	CallFrame *frame = nullptr;
+	const Chunk *chunk = nullptr;
+	RegInstruction *code = nullptr;
+	// decoded stack code the instructions were made from
+	Instruction *source = nullptr;
+	PropertyCache *caches = nullptr;
+	const Value *constants = nullptr;
+	std::span<const std::shared_ptr<ObjUpvalue>> upvalues;
+	Value *slots = nullptr;
+	RegInstruction *ip = nullptr;
+	RegInstruction *instruction = nullptr;
+	auto enterFrame = [&] {
+		frame = &callFrames.back();
+		chunk = frame->closure.chunk().get();
+		code = chunk->registers()->code.data();
+		source = chunk->instructions().data();
+		caches = chunk->caches().data();
+		constants = chunk->constants().data();
+		upvalues = frame->closure.function.get().upvalues;
+		slots = frame->slots;
+		ip = frame->registerIp;
+		// values above the registers of the frame are dead
+		stackTop = slots + chunk->registers()->registers;
+		stack_high = std::max<const Value *>(stack_high, stackTop);
+	};
+	// functions loaded before the VM ran register code can still be called
+	// from it, they are rejected instead of entered
+	auto enterCallee = [&] {
+		const auto &callee = callFrames.back().closure;
+		if (callee.chunk()->registers() == nullptr) [[unlikely]] {
+			runtimeError(std::format("Function '{}' has no register code.",
+			                         callee.function.get().name));
+			return false;
+		}
+		enterFrame();
+		return true;
+	};
+	// the error trace and the hooks read the position in the stack code
+	auto saveFrame = [&] {
+		frame->registerIp = ip;
+		frame->ip = source + instruction->source + 1;
+	};
+	auto fail = [&] {
+		saveFrame();
+		if constexpr (Hooks::enabled) {
+			hooks->onRuntimeError(*this, error_message);
+		}
+		return reportError();
+	};
+	auto rk = [&](uint32_t operand) -> const Value & {
+		return operand & constant_operand
+		           ? constants[operand & ~constant_operand]
+		           : slots[operand];
+	};
+	auto undefinedGlobal = [&](size_t slot) {
+		runtimeError(
+		    std::format("Undefined variable '{}'", global_names[slot]));
+		return fail();
+	};
+	// numbers take the fast path, anything else the checks of binaryResult
+	auto arithmetic = [&](OpCode generic, auto operation) {
+		const Value &b = rk(instruction->b);
+		const Value &c = rk(instruction->c);
+		if (b.isNumber() && c.isNumber()) [[likely]] {
+			slots[instruction->a] = numberResult(b, c, operation);
+			return true;
+		}
+		auto result = binaryResult(generic, b, c);
+		if (!result.has_value()) {
+			return false;
+		}
+		slots[instruction->a] = std::move(*result);
+		return true;
+	};
+	auto compare = [&](OpCode generic, auto operation) -> std::optional<bool> {
+		const Value &b = rk(instruction->b);
+		const Value &c = rk(instruction->c);
+		if (b.isInt() && c.isInt()) [[likely]] {
+			return operation(b.asInt(), c.asInt());
+		}
+		if (b.isNumber() && c.isNumber()) {
+			return operation(b.asNumber(), c.asNumber());
+		}
+		auto result = binaryResult(generic, b, c);
+		if (!result.has_value()) {
+			return std::nullopt;
+		}
+		return result->isTruthy();
+	};
+	auto compareJump = [&](OpCode generic, auto operation) {
+		auto result = compare(generic, operation);
+		if (result.has_value() && !*result) {
+			ip = code + instruction->a;
+		}
+		return result.has_value();
+	};
+	auto compareInto = [&](OpCode generic, auto operation) {
+		auto result = compare(generic, operation);
+		if (result.has_value()) {
+			slots[instruction->a] = *result;
+		}
+		return result.has_value();
+	};
+	// the inline cache of the stack instruction the property instruction
+	// was made from
+	auto cacheOf = [&](const RegInstruction &instruction) -> PropertyCache & {
+		return caches[source[instruction.source].cache];
+	};
+	enterFrame();
+
+#if CPPLOX_VM_COMPUTED_GOTO
+#define CPPLOX_REG_LABEL(op, ...) &&REG_TARGET_##op,
+	static const void *const dispatch_table[] = {
+	    CPPLOX_REG_OPCODES(CPPLOX_REG_LABEL)};
+#undef CPPLOX_REG_LABEL
+	static_assert(std::size(dispatch_table) == reg_opcodes.size());
+	CPPLOX_REG_DISPATCH();
+#endif
+
+	for (;;) {
+		if constexpr (Hooks::enabled) {
+			hooks->beforeRegisterInstruction(*this, *chunk, *ip);
+		}
+		instruction = ip++;
+
+		switch (instruction->op) {
+		CPPLOX_REG_TARGET(OP_MOVE) {
+			slots[instruction->a] = rk(instruction->b);
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_NIL) {
+			slots[instruction->a] = Value{};
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_TRUE) {
+			slots[instruction->a] = Value{true};
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_FALSE) {
+			slots[instruction->a] = Value{false};
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GET_GLOBAL) {
+			const Value &global = globals[instruction->c];
+			if (global.isUndefined()) [[unlikely]] {
+				return undefinedGlobal(instruction->c);
+			}
+			slots[instruction->a] = global;
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_DEFINE_GLOBAL) {
+			globals[instruction->c] = rk(instruction->a);
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_SET_GLOBAL) {
+			Value &global = globals[instruction->c];
+			if (global.isUndefined()) [[unlikely]] {
+				return undefinedGlobal(instruction->c);
+			}
+			global = rk(instruction->a);
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GET_UPVALUE) {
+			slots[instruction->a] = *upvalues[instruction->b]->location;
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_SET_UPVALUE) {
+			*upvalues[instruction->a]->location = rk(instruction->b);
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_EQUAL) {
+			slots[instruction->a] =
+			    rk(instruction->b).equals(rk(instruction->c));
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_NOT_EQUAL) {
+			slots[instruction->a] =
+			    !rk(instruction->b).equals(rk(instruction->c));
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GREATER) {
+			if (!compareInto(OpCode::OP_GREATER, std::greater<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GREATER_EQUAL) {
+			if (!compareInto(OpCode::OP_GREATER_EQUAL, std::greater_equal<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_LESS) {
+			if (!compareInto(OpCode::OP_LESS, std::less<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_LESS_EQUAL) {
+			if (!compareInto(OpCode::OP_LESS_EQUAL, std::less_equal<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_ADD) {
+			if (!arithmetic(OpCode::OP_ADD, Add{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_SUBTRACT) {
+			if (!arithmetic(OpCode::OP_SUBTRACT, Subtract{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_MULTIPLY) {
+			if (!arithmetic(OpCode::OP_MULTIPLY, Multiply{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_DIVIDE) {
+			// division by zero is reported by binaryResult
+			const Value &divisor = rk(instruction->c);
+			if (divisor.isNumber() && divisor.asNumber() == 0) {
+				auto result =
+				    binaryResult(OpCode::OP_DIVIDE, rk(instruction->b), divisor);
+				if (!result.has_value()) {
+					return fail();
+				}
+			}
+			if (!arithmetic(OpCode::OP_DIVIDE, Divide{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_NOT) {
+			slots[instruction->a] = !rk(instruction->b).isTruthy();
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_NEGATE) {
+			const Value &value = rk(instruction->b);
+			if (!value.isNumber()) {
+				runtimeError("Operand must be a number.");
+				return fail();
+			}
+			// integer zero negates to -0, which only the double can hold
+			if (value.isInt() && value.asInt() != 0) {
+				slots[instruction->a] = Value{-value.asInt()};
+			} else {
+				slots[instruction->a] = -value.asNumber();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_PRINT) {
+			std::cout << std::format("{}\n", rk(instruction->a).toString());
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_JUMP) {
+			ip = code + instruction->a;
+			// loops jump back, they collect like the stack loop does
+			if (heap.wantsCollection()) [[unlikely]] {
+				collectGarbage();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_JUMP_IF_FALSE) {
+			if (!rk(instruction->b).isTruthy()) {
+				ip = code + instruction->a;
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_EQUAL_JUMP) {
+			if (!rk(instruction->b).equals(rk(instruction->c))) {
+				ip = code + instruction->a;
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_NOT_EQUAL_JUMP) {
+			if (rk(instruction->b).equals(rk(instruction->c))) {
+				ip = code + instruction->a;
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GREATER_JUMP) {
+			if (!compareJump(OpCode::OP_GREATER, std::greater<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GREATER_EQUAL_JUMP) {
+			if (!compareJump(OpCode::OP_GREATER_EQUAL, std::greater_equal<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_LESS_JUMP) {
+			if (!compareJump(OpCode::OP_LESS, std::less<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_LESS_EQUAL_JUMP) {
+			if (!compareJump(OpCode::OP_LESS_EQUAL, std::less_equal<>{})) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_TAIL_CALL) {
+			size_t argCount = instruction->b;
+			Value *callee = slots + instruction->a;
+			auto *function =
+			    callee->isObj() ? std::get_if<ObjFunction>(&callee->asObj().value)
+			                    : nullptr;
+			// natives and methods fall through to a regular call
+			if (function != nullptr && !function->isMethod) {
+				if (function->arity != argCount) {
+					runtimeError(std::format("Expected {} arguments but got {}.",
+					                         function->arity, argCount));
+					return fail();
+				}
+				if (function->chunk->lazy() != nullptr && !compileLazy(*function))
+				    [[unlikely]] {
+					return fail();
+				}
+				if (function->chunk->registers() == nullptr) [[unlikely]] {
+					runtimeError(
+					    std::format("Function '{}' has no register code.",
+					                function->name));
+					return fail();
+				}
+				// tail calls replace the frame instead of going through call
+				if (heap.wantsCollection()) [[unlikely]] {
+					collectGarbage();
+				}
+				countCall(*function);
+				// the callee and the arguments are temporaries above the
+				// locals, they slide over the frame of the caller
+				Value *base = frame->base();
+				size_t elided = frame->elided + 1;
+				closeUpvalues(frame->slots);
+				callFrames.pop_back();
+				std::move(callee, callee + argCount + 1, base);
+				stackTop = base + argCount + 1;
+				const auto &moved = std::get<ObjFunction>(base->asObj().value);
+				if (!reserveStack(moved, base + 1)) {
+					return fail();
+				}
+				callFrames.emplace_back(moved, base + 1);
+				callFrames.back().elided = elided;
+				if constexpr (Hooks::enabled) {
+					hooks->onCall(*this, callFrames.back());
+				}
+				enterFrame();
+				CPPLOX_REG_DISPATCH();
+			}
+			[[fallthrough]];
+		}
+		CPPLOX_REG_TARGET(OP_CALL) {
+			size_t argCount = instruction->b;
+			saveFrame();
+			stackTop = slots + instruction->a + argCount + 1;
+			if (!callValue(slots[instruction->a], argCount)) {
+				return fail();
+			}
+			// natives return immediately, functions push a new frame
+			if constexpr (Hooks::enabled) {
+				if (frame != &callFrames.back()) {
+					hooks->onCall(*this, callFrames.back());
+				}
+			}
+			if (!enterCallee()) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_CLOSURE) {
+			slots[instruction->a] =
+			    makeClosure(constants[instruction->b], slots, upvalues);
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_CLOSE_UPVALUE) {
+			closeUpvalues(slots + instruction->a);
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_CLASS) {
+			slots[instruction->a] = heap.allocate(
+			    Obj{makeShared<ObjClass>(nameOf(constants[instruction->b]))});
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_INHERIT) {
+			const auto *superclass = classOf(slots[instruction->a]);
+			if (superclass == nullptr) {
+				runtimeError("Superclass must be a class.");
+				return fail();
+			}
+			auto *subclass = classOf(slots[instruction->b]);
+			if (subclass == nullptr) {
+				runtimeError("Expected class for inheritance.");
+				return fail();
+			}
+			auto &klass = *subclass;
+			klass.methods = superclass->methods;
+			klass.superclass = slots[instruction->a];
+			klass.initializer = klass.findMethod("init");
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_METHOD) {
+			auto *klass = classOf(slots[instruction->a]);
+			const Value &value = slots[instruction->b];
+			const auto *function =
+			    value.isObj() ? std::get_if<ObjFunction>(&value.asObj().value)
+			                  : nullptr;
+			if (klass == nullptr || function == nullptr) {
+				runtimeError("Expected class and function for method.");
+				return fail();
+			}
+			const auto &name = nameOf(constants[instruction->c]);
+			auto &methods = klass->methods;
+			auto &method =
+			    methods.insert_or_assign(std::string(name), *function)
+			        .first->second;
+			if (name == "init") {
+				klass->initializer = &method;
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GET_PROPERTY) {
+			auto *instance = instanceOf(slots[instruction->b]);
+			if (instance == nullptr) {
+				runtimeError("Only instances have properties.");
+				return fail();
+			}
+			auto &cache = cacheOf(*instruction);
+			const auto *entry = cache.find(instance->shape);
+			if (entry == nullptr) [[unlikely]] {
+				const auto &name = nameOf(constants[instruction->c]);
+				auto found = readEntry(*instance, name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			// the result may replace the instance in its register
+			Value property =
+			    entry->method != nullptr
+			        ? heap.allocate(Obj{ObjBoundMethod{slots[instruction->b],
+			                                           entry->method}})
+			        : instance->fields[entry->slot];
+			slots[instruction->a] = std::move(property);
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_SET_PROPERTY) {
+			auto *instance = instanceOf(slots[instruction->a]);
+			if (instance == nullptr) {
+				runtimeError("Only instances have fields.");
+				return fail();
+			}
+			auto &object = *instance;
+			auto &cache = cacheOf(*instruction);
+			const auto *entry = cache.find(object.shape);
+			if (entry == nullptr) [[unlikely]] {
+				entry = cache.add(
+				    writeEntry(object, nameOf(constants[instruction->c])));
+			}
+			if (entry->transition != nullptr) {
+				object.fields.push_back(rk(instruction->b));
+				object.shape = entry->transition;
+			} else {
+				object.fields[entry->slot] = rk(instruction->b);
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_GET_SUPER) {
+			const auto *superclass = classOf(slots[instruction->c]);
+			auto *instance = instanceOf(slots[instruction->b]);
+			if (superclass == nullptr || instance == nullptr) {
+				runtimeError("Expected instance and superclass for super.");
+				return fail();
+			}
+			auto &cache = cacheOf(*instruction);
+			const auto *entry = cache.find(&superclass->root);
+			if (entry == nullptr) [[unlikely]] {
+				const auto &name = nameOf(constants[source[instruction->source].operand]);
+				auto found = superEntry(slots[instruction->c], name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			slots[instruction->a] = heap.allocate(
+			    Obj{ObjBoundMethod{slots[instruction->b], entry->method}});
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_INVOKE) {
+			size_t argCount = instruction->b;
+			Value &receiver = slots[instruction->a];
+			auto *instance = instanceOf(receiver);
+			if (instance == nullptr) {
+				runtimeError("Only instances have methods.");
+				return fail();
+			}
+			auto &cache = cacheOf(*instruction);
+			const auto *entry = cache.find(instance->shape);
+			if (entry == nullptr) [[unlikely]] {
+				const auto &name = nameOf(constants[instruction->c]);
+				auto found = readEntry(*instance, name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			saveFrame();
+			stackTop = slots + instruction->a + argCount + 1;
+			if (entry->method != nullptr) {
+				if (!call(*entry->method, argCount)) {
+					return fail();
+				}
+			} else {
+				// a field holding a function is called like any callee
+				Value field = instance->fields[entry->slot];
+				receiver = std::move(field);
+				if (!callValue(receiver, argCount)) {
+					return fail();
+				}
+			}
+			if constexpr (Hooks::enabled) {
+				if (frame != &callFrames.back()) {
+					hooks->onCall(*this, callFrames.back());
+				}
+			}
+			if (!enterCallee()) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_SUPER_INVOKE) {
+			size_t argCount = instruction->b;
+			const auto *superclass =
+			    classOf(slots[instruction->a + argCount + 1]);
+			if (superclass == nullptr) {
+				runtimeError("Superclass must be a class.");
+				return fail();
+			}
+			auto &cache = cacheOf(*instruction);
+			const auto *entry = cache.find(&superclass->root);
+			if (entry == nullptr) [[unlikely]] {
+				const auto &name = nameOf(constants[instruction->c]);
+				auto found = superEntry(slots[instruction->a + argCount + 1], name);
+				if (!found.has_value()) {
+					runtimeError(std::format("Undefined property '{}'.", name));
+					return fail();
+				}
+				entry = cache.add(std::move(*found));
+			}
+			// the cache keeps the superclass alive once it is dropped
+			saveFrame();
+			stackTop = slots + instruction->a + argCount + 1;
+			if (!call(*entry->method, argCount)) {
+				return fail();
+			}
+			if constexpr (Hooks::enabled) {
+				hooks->onCall(*this, callFrames.back());
+			}
+			if (!enterCallee()) {
+				return fail();
+			}
+			CPPLOX_REG_DISPATCH();
+		}
+		CPPLOX_REG_TARGET(OP_RETURN) {
+			Value *base = frame->base();
+			// a local captured by a closure keeps its value for the upvalue
+			// closed below, any other register of the frame is dead
+			bool captured = !open_upvalues.empty() &&
+			                open_upvalues.back()->location >= slots;
+			Value result = (instruction->a & constant_operand) || captured
+			                   ? rk(instruction->a)
+			                   : std::move(slots[instruction->a]);
+			if constexpr (Hooks::enabled) {
+				hooks->onReturn(*this, *frame, result);
+			}
+			closeUpvalues(slots);
+			stackTop = base;
+			*stackTop++ = std::move(result);
+			callFrames.pop_back();
+			if (callFrames.empty()) {
+				return InterpretResult::OK;
+			}
+			enterFrame();
+			CPPLOX_REG_DISPATCH();
+		}
+		}
+	}
+}
+
+#undef CPPLOX_VM_COMPUTED_GOTO
+#undef CPPLOX_REG_TARGET
+#undef CPPLOX_REG_DISPATCH
+
+InterpretResult VM::interpret(const ObjFunction &function) {
+	had_error = false;
+	resetStack();
+	load(function);
+	// only OP_CLOSURE gives a function its upvalues
+	if (function.upvalues.size() != function.chunk->captures().size()) {
+		runtimeError("Can only run functions that capture no variables.");
+		return reportError();
+	}
+	// functions of rejected code stay reachable through the globals, so
+	// the VM keeps the checked loop once it has loaded any
+	if (!verifier::verifyFunction(function)) {
+		verified_code = false;
+	}
+	// like rejected code, functions without register code stay reachable
+	// through the globals, so the VM keeps the stack loop once it has
+	// loaded any
+	if (!hasRegisterCode(function)) {
+		register_code = false;
+	}
+	// the frame runs the copy in the heap, which the stack slot keeps alive
+	push(heap.allocate(Obj{function}));
+	if (!call(std::get<ObjFunction>(peek().asObj().value), 0)) {
+		return reportError();
+	}
+	if (backend == Backend::REGISTER && verified_code && register_code) {
+		if (hooks != nullptr) {
+			hooks->onCall(*this, callFrames.back());
+			return runRegisters<HooksEnabled>();
+		}
+		return runRegisters<HooksDisabled>();
+	}
+	if (hooks != nullptr) {
+		hooks->onCall(*this, callFrames.back());
+		return verified_code ? run<HooksEnabled, ChecksDisabled>()
+		                     : run<HooksEnabled, ChecksEnabled>();
+	}
+	if (!verified_code) {
+		return run<HooksDisabled, ChecksEnabled>();
+	}
+	if ((jit::supported && jit_threshold != 0) || native_code) {
+		return run<HooksDisabled, ChecksDisabled, JitEnabled>();
+	}
+	return run<HooksDisabled, ChecksDisabled>();
 }
 
 InterpretResult VM::interpret(std::string_view source) {
 	auto compiler = Compiler{};
+	compiler.backend = backend;
+	compiler.profile = profile;
+	compiler.lazy = lazy;
+	compiler.heap = &heap;
 	if (const auto result = compiler.compile(source); result.has_value()) {
 		auto &function = result->get();
 		function.name = "<script>";